@@ -4,28 +4,190 @@
 #include <QThread>
 #include <csignal>
 #include <QSocketNotifier>
+#include <QLocalServer>
+#include <QLocalSocket>
 #include <QTextStream>
+#include <QElapsedTimer>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <string>
+#include <atomic>
+#include <chrono>
 #ifdef Q_OS_WIN
 #include <conio.h>
+#include <windows.h>
+#else
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 #include "uLab.h"
 
-// 全局指针，用于信号处理函数访问controller
+#define CONTROL_SERVER_NAME     "uLab-Immunofluorescence"     // 本地运行控制套接字名称
+
+// 全局指针，用于主线程的停止流程访问controller
 ULab* g_controller = nullptr;
 
-// 信号处理函数
+// *********************************************************************************
+//                     信号安全的急停通道
+// 信号处理函数里只能调用异步信号安全的函数，不能碰Qt对象、不能加锁、不能分配内存。
+// 因此分两级：
+//   1. 快速通道：信号处理函数直接把预生成的停泵帧写到串口fd，停泵不依赖主线程状态；
+//   2. 自管道：信号处理函数再写1个字节到管道，主线程的QSocketNotifier被唤醒后
+//      执行完整的StopAllDevices/ClosePort流程并报告急停延迟。
+// Windows下没有管道fd可用于QSocketNotifier，快速通道改用WriteFile，主线程通过定时器轮询标志。
+// *********************************************************************************
+
+#define STOP_FRAME_BUF_SIZE     64      // 预生成停泵帧缓冲区大小
+#define STOP_FRAME_REPEAT       2       // 停泵帧重复写入次数，防止与主线程正在写的半帧拼接导致第一份帧无效
+
+static char g_stopFrames[STOP_FRAME_BUF_SIZE];
+static volatile std::sig_atomic_t g_stopFramesLen = 0;
+static volatile std::sig_atomic_t g_stopSignal = 0;     // 收到的信号编号，0表示没有
+static std::atomic<bool> g_fastPathArmed{false};
+
+#ifdef Q_OS_WIN
+static HANDLE g_portHandle = INVALID_HANDLE_VALUE;
+static std::atomic<long long> g_signalNs{0};
+static std::atomic<long long> g_fastStopNs{0};
+
+static long long monotonicNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+#else
+static volatile std::sig_atomic_t g_portFd = -1;
+static int g_signalPipe[2] = {-1, -1};
+static struct timespec g_signalTime;                    // 收到信号的时刻
+static struct timespec g_fastStopTime;                  // 快速通道写完停泵帧的时刻
+
+// clock_gettime是异步信号安全的
+static long long monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long timespecNs(const struct timespec& ts)
+{
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+#endif
+
+// 串口打开后调用：预生成停泵帧并记录串口句柄，之后信号处理函数可直接写串口
+void ArmEmergencyStop(ULab& controller)
+{
+    QByteArray frames = controller.EmergencyStopFrames();
+    int len = 0;
+    for (int i = 0; i < STOP_FRAME_REPEAT && len + frames.size() <= STOP_FRAME_BUF_SIZE; ++i)
+    {
+        memcpy(g_stopFrames + len, frames.constData(), frames.size());
+        len += frames.size();
+    }
+    g_stopFramesLen = len;
+#ifdef Q_OS_WIN
+    g_portHandle = controller.PortHandle();
+#else
+    g_portFd = controller.PortHandle();
+#endif
+    g_fastPathArmed.store(true);
+}
+
+// 关闭串口前必须先解除，避免信号处理函数写到已关闭(甚至被复用)的fd
+void DisarmEmergencyStop()
+{
+    g_fastPathArmed.store(false);
+#ifdef Q_OS_WIN
+    g_portHandle = INVALID_HANDLE_VALUE;
+#else
+    g_portFd = -1;
+#endif
+}
+
+// 快速通道：只做一次写操作，不经过指令队列
+static void writeStopFramesFromSignal()
+{
+    if (!g_fastPathArmed.load() || g_stopFramesLen <= 0)
+        return;
+#ifdef Q_OS_WIN
+    DWORD written = 0;
+    if (g_portHandle != INVALID_HANDLE_VALUE)
+        WriteFile(g_portHandle, g_stopFrames, (DWORD)g_stopFramesLen, &written, nullptr);
+    g_fastStopNs.store(monotonicNs());
+#else
+    if (g_portFd >= 0)
+    {
+        ssize_t ret = ::write(g_portFd, g_stopFrames, (size_t)g_stopFramesLen);
+        (void)ret;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &g_fastStopTime);
+#endif
+}
+
+// 信号处理函数：只写停泵帧和一个唤醒字节，其余工作交给主线程
 void signalHandler(int signal)
 {
+#ifdef Q_OS_WIN
+    g_signalNs.store(monotonicNs());
+    writeStopFramesFromSignal();
+    if (signal == SIGFPE || signal == SIGILL || signal == SIGSEGV)
+    {
+        // 程序错误类信号返回后会再次触发，泵已停，直接退出
+        _exit(1);
+    }
+    g_stopSignal = signal;
+    std::signal(signal, signalHandler);     // Windows下信号处理函数触发后会被重置
+#else
+    int savedErrno = errno;
+    clock_gettime(CLOCK_MONOTONIC, &g_signalTime);
+    writeStopFramesFromSignal();
+    g_stopSignal = signal;
+    if (g_signalPipe[1] >= 0)
+    {
+        unsigned char b = (unsigned char)signal;
+        ssize_t ret = ::write(g_signalPipe[1], &b, 1);
+        (void)ret;
+    }
+    errno = savedErrno;
+#endif
+}
+
+// 主线程中执行的完整停止流程
+void handleStopSignal()
+{
+    int signal = g_stopSignal;
+    long long mainNs = monotonicNs();
+#ifdef Q_OS_WIN
+    long long signalNs = g_signalNs.load();
+    long long fastNs = g_fastStopNs.load();
+#else
+    long long signalNs = timespecNs(g_signalTime);
+    long long fastNs = timespecNs(g_fastStopTime);
+#endif
+    bool fastPath = g_fastPathArmed.load();
+
     qDebug() << "接收到信号" << signal << "，正在安全停止所有设备...";
-    
+    if (fastPath)
+    {
+        qDebug().noquote() << QString("急停延迟: 快速通道 %1 us (信号→停泵帧写出)，主线程响应 %2 ms")
+                              .arg((fastNs - signalNs) / 1000.0, 0, 'f', 1)
+                              .arg((mainNs - signalNs) / 1e6, 0, 'f', 2);
+    }
+    else
+    {
+        qDebug().noquote() << QString("急停延迟: 快速通道未启用(串口未打开)，主线程响应 %1 ms")
+                              .arg((mainNs - signalNs) / 1e6, 0, 'f', 2);
+    }
+
     if (g_controller) {
         g_controller->StopAllDevices();
+        DisarmEmergencyStop();
         g_controller->ClosePort();
     }
-    
+
     qDebug() << "设备已安全停止，程序退出";
     //QCoreApplication::exit(0);  //只会退出Qt的事件循环，但程序的 main()后续代码还会继续执行。
     std::exit(0); //彻底终止程序
@@ -41,17 +203,56 @@ int main(int argc, char *argv[])
     g_controller = &controller;  // 设置全局指针
 
     // 注册信号处理函数
+#ifdef Q_OS_WIN
     std::signal(SIGINT, signalHandler);   // Ctrl+C，中断信号(2),在控制台按Ctrl+C时发送
     std::signal(SIGTERM, signalHandler);  // 终止信号(15),Qt Creator点击"停止"按钮时发送的信号
     std::signal(SIGABRT, signalHandler);  // 异常终止(6)，程序调用abort()函数或断言失败时触发
-#ifdef SIGBREAK
     std::signal(SIGBREAK, signalHandler); // Windows Ctrl+Break(21)
-#endif
-#ifdef Q_OS_WIN
     // Windows特有信号
     std::signal(SIGFPE, signalHandler);   // 浮点异常(8)，除零或其他数学错误时触发
     std::signal(SIGILL, signalHandler);   // 非法指令(4)
     std::signal(SIGSEGV, signalHandler);  // 段错误（内存访问错误）(11),程序访问无效内存地址时自动触发
+
+    // Windows下信号处理在另一个线程执行，主线程轮询停止标志
+    QTimer signalPollTimer;
+    signalPollTimer.setInterval(10);
+    QObject::connect(&signalPollTimer, &QTimer::timeout, []() {
+        if (g_stopSignal != 0)
+            handleStopSignal();
+    });
+    signalPollTimer.start();
+#else
+    // 自管道：信号处理函数写入，主线程事件循环读取
+    if (pipe(g_signalPipe) == 0)
+    {
+        for (int fd : g_signalPipe)
+        {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+    else
+    {
+        qDebug() << "创建信号管道失败，信号只能触发快速停泵";
+    }
+    QSocketNotifier signalNotifier(g_signalPipe[0], QSocketNotifier::Read);
+    signalNotifier.setEnabled(g_signalPipe[0] >= 0);
+    QObject::connect(&signalNotifier, &QSocketNotifier::activated, [](int fd) {
+        unsigned char buf[16];
+        while (::read(fd, buf, sizeof(buf)) > 0) {}
+        handleStopSignal();
+    });
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signalHandler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &sa, nullptr);      // Ctrl+C，中断信号(2),在控制台按Ctrl+C时发送
+    sigaction(SIGTERM, &sa, nullptr);     // 终止信号(15),Qt Creator点击"停止"按钮时发送的信号
+    // 异常终止(6)，abort()返回后进程仍会终止，只有快速通道能生效
+    sa.sa_flags = SA_RESETHAND;
+    sigaction(SIGABRT, &sa, nullptr);
 #endif
 
     // 将 controller 对象的 SendMessage 信号，连接到一个用于打印的 Lambda 槽函数
@@ -100,10 +301,66 @@ int main(int argc, char *argv[])
     });
 #endif
 
-    if(!controller.InitPort("COM5"))   // Windows: COMx    // mac: /dev/tty.usbserial-140
-    {
-        qDebug() << "串口连接失败，程序退出。";
-        return 1;
+    // 本地套接字运行控制：其他进程(如监控脚本)连接后按行发送与终端相同的指令，每条指令回复当前运行状态
+    QLocalServer controlServer;
+    QLocalServer::removeServer(CONTROL_SERVER_NAME);    // 清理上次异常退出残留的套接字文件
+    if (!controlServer.listen(CONTROL_SERVER_NAME)) {
+        qDebug() << "运行控制套接字监听失败:" << controlServer.errorString();
+    }
+    QObject::connect(&controlServer, &QLocalServer::newConnection, [&controlServer, &controller]() {
+        while (QLocalSocket* socket = controlServer.nextPendingConnection()) {
+            QObject::connect(socket, &QLocalSocket::disconnected, socket, &QLocalSocket::deleteLater);
+            QObject::connect(socket, &QLocalSocket::readyRead, socket, [socket, &controller]() {
+                while (socket->canReadLine()) {
+                    QString line = QString::fromUtf8(socket->readLine()).trimmed();
+                    if (line.isEmpty()) {
+                        continue;
+                    }
+                    qDebug() << "接收到控制指令:" << line;
+                    emit controller.UserInputReceived(line);
+                    socket->write((controller.RunStatus() + "\n").toUtf8());
+                }
+            });
+        }
+    });
+
+    // 启动参数 -p <协议文件.json>：从文件加载试剂/样品映射和实验步骤，替换下面的内置序列，修改流程无需重新编译
+    // 在打开串口前解析和校验，协议有误时不动作任何设备
+    ProtocolFile protocolFile;
+    QStringList args = QCoreApplication::arguments();
+    int protocolArg = args.indexOf("-p");
+    if (protocolArg >= 0) {
+        if (protocolArg + 1 >= args.size()) {
+            qDebug() << "-p 后需要指定协议文件路径";
+            return 1;
+        }
+        QElapsedTimer parseClock;
+        parseClock.start();
+        QStringList errors;
+        if (!LoadProtocolFile(args[protocolArg + 1], &protocolFile, &errors)) {
+            qDebug().noquote() << "协议文件" << args[protocolArg + 1] << "无效：";
+            for (const QString& e : errors) {
+                qDebug().noquote() << "  -" << e;
+            }
+            return 1;
+        }
+        qDebug().noquote() << QString("已加载协议文件 %1：%2 种试剂，%3 个样品，%4 步，用时 %5 ms")
+                              .arg(args[protocolArg + 1]).arg(protocolFile.reagents.size()).arg(protocolFile.samples.size())
+                              .arg(protocolFile.steps.size()).arg(parseClock.nsecsElapsed() / 1e6, 0, 'f', 2);
+    }
+
+    // 启动参数 --dry-run：不连接串口，按虚拟时钟执行流程并输出时间线和耗时估算
+    // 启动参数 --simulate [次数]：不连接串口，按仿真模型蒙特卡洛运行，对比不同阀切换时长下的单次时长、每班产能和资源利用率
+    bool dryRun = args.contains("--dry-run") || args.contains("--simulate");
+    if (dryRun) {
+        controller.SetDryRun(true);
+    } else {
+        if(!controller.InitPort("COM5"))   // Windows: COMx    // mac: /dev/tty.usbserial-140
+        {
+            qDebug() << "串口连接失败，程序退出。";
+            return 1;
+        }
+        ArmEmergencyStop(controller);
     }
 
 
@@ -143,7 +400,11 @@ int main(int argc, char *argv[])
     qDebug() << "\n\n=======================================================";
     qDebug() << "*** 免疫荧光实验即将开始 ***";
     qDebug() << "实验流程期间可随时在在下方 Terminal 输出框中:";
+    qDebug() << "- 输入 'p' 或 'pause' 暂停(停泵、保持阀位)，'r' 或 'resume' 继续";
+    qDebug() << "- 输入 's' 或 'skip' 跳过当前步骤，'a' 或 'abort' 中止运行(停泵、不退出)";
+    qDebug() << "- 输入 'status' 查看运行状态，'latency' 查看各指令排队/响应/分发延时分布";
     qDebug() << "- 输入 'q' 或 'quit' 或 ‘exit’ 退出程序";
+    qDebug() << "以上指令也可通过本地套接字" << CONTROL_SERVER_NAME << "发送，每行一条";
     qDebug() << "=======================================================";
 
     // ======================================================================
@@ -154,58 +415,113 @@ int main(int argc, char *argv[])
     // =================== 2. 用户实验序列 (调用已配置的动作) ===================
     // ======================================================================
 
-     QTimer::singleShot(1000, &controller, [&]() {
+    // 步骤按顺序执行，每完成一步写入断点；程序中途退出后重新启动会从上次完成的步骤之后继续
+    // 启动参数 --fresh 忽略断点从头开始
+    QList<ProtocolStep> protocol;
+
+    // 在开始实验前，先进行初始化管路冲洗
+    protocol << StepInitialWash();
 
-        // 在开始实验前，先进行初始化管路冲洗
-        controller.InitialWashPipelines();
+    // AddLiquid参数：试剂名称, 体积(uL), 速度(SLOW/MEDIUM/FAST), 样品名称, 加液抽液的间隔时间(秒)
+    // WashPipeline参数：试剂名称, 样品名称
+    // 通透剂、封闭液、一抗、二抗的通道在配置区未启用，对应步骤暂时注释；接好管路并启用通道后再恢复，
+    // 否则流程编译时会因试剂未配置而拒绝整个流程
+    
+    // 1. PBS预热洗涤，样品1
+    protocol << StepAddLiquid("PBS", 200.0, MEDIUM, "样品1", 1);
+
+    // 2. 固定液处理，样品1
+    protocol << StepAddLiquid("固定液", 200.0, MEDIUM, "样品1", 1);
 
-        // AddLiquid参数：试剂名称, 体积(uL), 速度(SLOW/MEDIUM/FAST), 样品名称, 加液抽液的间隔时间(秒)
-        // WashPipeline参数：试剂名称, 样品名称
-        
-        // 1. PBS预热洗涤，样品1
-        controller.AddLiquid("PBS", 200.0, MEDIUM, "样品1", 1);
+    // 3. PBS冲洗管路到废液缸
+    protocol << StepWashPipeline("PBS", "废液缸");
 
-        // 2. 固定液处理，样品1
-        controller.AddLiquid("固定液", 200.0, MEDIUM, "样品1", 1);
+    // 4. PBS洗涤，样品1
+    protocol << StepAddLiquid("PBS", 200.0, MEDIUM, "样品1", 1);
 
-        // 3. PBS冲洗管路到废液缸
-        controller.WashPipeline("PBS", "废液缸");
+    // 5. 通透剂处理，样品1
+    //protocol << StepAddLiquid("通透剂", 200.0, MEDIUM, "样品1", 1);
 
-        // 4. PBS洗涤，样品1
-        controller.AddLiquid("PBS", 200.0, MEDIUM, "样品1", 1);
+    // 6. PBS冲洗管路到废液缸
+    protocol << StepWashPipeline("PBS", "废液缸");
 
-        // 5. 通透剂处理，样品1
-        controller.AddLiquid("通透剂", 200.0, MEDIUM, "样品1", 1);
+    // 7. PBS洗涤，样品1  
+    protocol << StepAddLiquid("PBS", 200.0, MEDIUM, "样品1", 1);
 
-        // 6. PBS冲洗管路到废液缸
-        controller.WashPipeline("PBS", "废液缸");
+    // 8. 封闭液处理，样品1
+    //protocol << StepAddLiquid("封闭液", 200.0, MEDIUM, "样品1", 1);
 
-        // 7. PBS洗涤，样品1  
-        controller.AddLiquid("PBS", 200.0, MEDIUM, "样品1", 1);
+    // 9. 一抗稀释液处理，样品1
+    //protocol << StepAddLiquid("一抗稀释液", 200.0, MEDIUM, "样品1", 1);
 
-        // 8. 封闭液处理，样品1
-        controller.AddLiquid("封闭液", 200.0, MEDIUM, "样品1", 1);
+    // 10. PBS冲洗管路到废液缸
+    protocol << StepWashPipeline("PBS", "废液缸");
 
-        // 9. 一抗稀释液处理，样品1
-        controller.AddLiquid("一抗稀释液", 200.0, MEDIUM, "样品1", 1);
+    // 11. PBS洗涤，样品1
+    protocol << StepAddLiquid("PBS", 200.0, MEDIUM, "样品1", 1);
 
-        // 10. PBS冲洗管路到废液缸
-        controller.WashPipeline("PBS", "废液缸");
+    // 12. 二抗稀释液处理，样品1，使用快速，间隔2秒
+    //protocol << StepAddLiquid("二抗稀释液", 200.0, FAST, "样品1", 2);
 
-        // 11. PBS洗涤，样品1
-        controller.AddLiquid("PBS", 200.0, MEDIUM, "样品1", 1);
+    // 13. PBS冲洗管路到废液缸
+    protocol << StepWashPipeline("PBS", "废液缸");
 
-        // 12. 二抗稀释液处理，样品1，使用快速，间隔2秒
-        controller.AddLiquid("二抗稀释液", 200.0, FAST, "样品1", 2);
+    // 14. 最终PBS洗涤，样品1，使用慢速，间隔0.5秒
+    protocol << StepAddLiquid("PBS", 200.0, SLOW, "样品1", 0);  // 0秒表示无间隔
 
-        // 13. PBS冲洗管路到废液缸
-        controller.WashPipeline("PBS", "废液缸");
+    // 使用协议文件时替换内置配置和序列
+    if (protocolArg >= 0) {
+        controller.SetReagentConfig(protocolFile.reagents);
+        controller.SetSampleConfig(protocolFile.samples);
+        protocol = protocolFile.steps;
+    }
 
-        // 14. 最终PBS洗涤，样品1，使用慢速，间隔0.5秒
-        controller.AddLiquid("PBS", 200.0, SLOW, "样品1", 0);  // 0秒表示无间隔
+    if (args.contains("--simulate")) {
+        int simIndex = args.indexOf("--simulate");
+        int runs = (simIndex + 1 < args.size()) ? args[simIndex + 1].toInt() : 0;
+        runs = runs > 0 ? runs : 200;
+        QTimer::singleShot(0, &controller, [&controller, protocol, runs]() {
+            // 模型参数：名称, 阀切换均值/标准差(ms), 泵时长比例均值/标准差, 班次(h), 次数, 随机种子
+            QList<SimulationModel> sweep = {
+                {"阀等待5s(当前)", VALVE_SWITCH_DELAY_MS, 0.0, 1.0, 0.03, 8.0, runs, 1},
+                {"阀等待2s", 2000.0, 200.0, 1.0, 0.03, 8.0, runs, 1},
+                {"阀等待1s", 1000.0, 100.0, 1.0, 0.03, 8.0, runs, 1},
+            };
+            QElapsedTimer cpuClock;
+            cpuClock.start();
+            QList<SimulationResult> results;
+            for (const SimulationModel& model : sweep) {
+                results << controller.Simulate(protocol, model);
+            }
+            qDebug().noquote() << FormatSimulationResults(results);
+            qDebug().noquote() << QString("仿真计算用时 %1 ms").arg(cpuClock.nsecsElapsed() / 1e6, 0, 'f', 2);
+            QCoreApplication::exit(0);
+        });
+        return a.exec();
+    }
 
-        qDebug() << "\n\n*** 实验执行完毕 ***";
+    if (dryRun) {
+        QTimer::singleShot(0, &controller, [&controller, protocol]() {
+            QElapsedTimer cpuClock;
+            cpuClock.start();
+            bool ok = controller.RunProtocol(protocol, false);
+            qint64 elapsedNs = cpuClock.nsecsElapsed();
+            if (ok) {
+                qDebug().noquote() << controller.DryRunReport();
+                qDebug().noquote() << QString("干运行计算用时 %1 ms").arg(elapsedNs / 1e6, 0, 'f', 2);
+            }
+            QCoreApplication::exit(ok ? 0 : 1);
+        });
+        return a.exec();
+    }
 
+    bool resume = !args.contains("--fresh");
+    QTimer::singleShot(1000, &controller, [&controller, protocol, resume]() {
+        if (controller.RunProtocol(protocol, resume)) {
+            qDebug() << "\n\n*** 实验执行完毕 ***";
+        } else {
+            qDebug() << "\n\n*** 实验已中止，重新启动程序将从断点继续 ***";
+        }
     });
 
     // *********************************************************************************
@@ -214,10 +530,14 @@ int main(int argc, char *argv[])
     // 确保在应用退出前关闭端口，可以连接 aboutToQuit 信号
     QObject::connect(&a, &QCoreApplication::aboutToQuit, [&controller, inputStream, stdinNotifier](){
         qDebug() << "\n应用程序即将退出，正在安全停止所有设备...";
-        
+    
+        if (!controller.IsDryRun()) {
+            qDebug().noquote() << controller.LatencyReport();
+        }
         controller.StopAllDevices();
+        DisarmEmergencyStop();
         controller.ClosePort();
-        
+    
         // 清理输入流资源
         if (inputStream) {
             delete inputStream;
@@ -225,7 +545,7 @@ int main(int argc, char *argv[])
         if (stdinNotifier) {
             delete stdinNotifier;
         }
-        
+    
         qDebug() << "\n设备已安全停止";
     });
 
@@ -0,0 +1,576 @@
+#include <QtTest>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QSet>
+#include "uLab.h"
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+// FakeClock驱动的测试：所有等待只推进虚拟时间，真实耗时应远小于流程时长。
+// 串口用伪终端代替，从主端读出写入的指令帧
+class TestULab : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void advanceFromWaitStarted();
+    void waitTimeoutAndWake();
+    void addLiquidOnFakeClock();
+    void addLiquidStopped();
+    void addLiquidPauseResume();
+    void initialWashOnFakeClock();
+    void skipStep();
+    void checkpointResume();
+    void planMoreReagents();
+    void planMoreSamples();
+    void planWasteOnly();
+    void planDuplicateChannels();
+    void washAspirationOverlap();
+
+private:
+    static QByteArray frame(uint8_t code, uint8_t id, uint8_t contentH, uint8_t contentL);
+    static QByteArray readAll(int fd);
+    static void startDriver(QTimer* driver, FakeClock* clock);
+    static void setWashConfig(ULab* lab);
+    static QString checkPlan(const QVector<WashFlush>& plan, const QList<uint8_t>& reagents,
+                             const QList<uint8_t>& samples, uint8_t waste);
+#ifdef Q_OS_UNIX
+    bool openPty(int* master, QString* slave);
+#endif
+};
+
+QByteArray TestULab::frame(uint8_t code, uint8_t id, uint8_t contentH, uint8_t contentL)
+{
+    QByteArray cmd = QByteArray::fromHex("FE").append(code).append(id).append(contentH).append(contentL);
+    cmd.append(CRCMDBS_GetValue(cmd)).append(0xFF);
+    return cmd;
+}
+
+QByteArray TestULab::readAll(int fd)
+{
+    QByteArray data;
+#ifdef Q_OS_UNIX
+    QTest::qWait(50);   // 等QSerialPort写出缓冲
+    char buf[256];
+    ssize_t n;
+    while ((n = ::read(fd, buf, sizeof(buf))) > 0) {
+        data.append(buf, static_cast<int>(n));
+    }
+#else
+    Q_UNUSED(fd);
+#endif
+    return data;
+}
+
+// 有等待时每轮事件循环推进10ms，周期任务(串口发送/解析)随之执行。
+// 驱动槽里不能触发新的等待：定时器在自己的槽返回前不会再次触发，嵌套的等待将挂起
+void TestULab::startDriver(QTimer* driver, FakeClock* clock)
+{
+    connect(driver, &QTimer::timeout, clock, [clock]() {
+        if (clock->PendingWaits() > 0) clock->Advance(10);
+    });
+    driver->start(0);
+}
+
+// 三个样品通道(通道1为废液缸)、两种试剂：冲洗 1->2、3->4 需要抽液，3->1 冲向废液缸
+void TestULab::setWashConfig(ULab* lab)
+{
+    lab->SetReagentConfig({{"PBS", {"PBS", 1}}, {"抗体", {"抗体", 3}}});
+    lab->SetSampleConfig({{"废液缸", {"废液缸", 1}}, {"样品1", {"样品1", 2}}, {"样品2", {"样品2", 4}}});
+}
+
+// 冲洗计划的覆盖性：每条试剂管路、每条样品管路至少冲洗一次，只有非废液缸样品抽液，
+// 次数为去重后的max(试剂数, 样品数)。返回第一处不满足的说明，满足时为空
+QString TestULab::checkPlan(const QVector<WashFlush>& plan, const QList<uint8_t>& reagents,
+                            const QList<uint8_t>& samples, uint8_t waste)
+{
+    QSet<uint8_t> reagentSet, sampleSet;
+    for (uint8_t ch : reagents) {
+        reagentSet << ch;
+    }
+    for (uint8_t ch : samples) {
+        sampleSet << ch;
+    }
+    if (plan.size() != qMax(reagentSet.size(), sampleSet.size())) {
+        return QString("%1 flushes").arg(plan.size());
+    }
+    QSet<uint8_t> flushedReagents, flushedSamples;
+    for (const WashFlush& f : plan) {
+        if (f.aspirate != (f.sample_channel != waste)) {
+            return QString("flush %1 -> %2 aspirate %3").arg(f.reagent_channel).arg(f.sample_channel).arg(f.aspirate);
+        }
+        flushedReagents << f.reagent_channel;
+        flushedSamples << f.sample_channel;
+    }
+    if (flushedReagents != reagentSet || flushedSamples != sampleSet) {
+        return QString("not every line flushed");
+    }
+    return QString();
+}
+
+#ifdef Q_OS_UNIX
+bool TestULab::openPty(int* master, QString* slave)
+{
+    *master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (*master < 0 || grantpt(*master) != 0 || unlockpt(*master) != 0) {
+        return false;
+    }
+    fcntl(*master, F_SETFL, fcntl(*master, F_GETFL) | O_NONBLOCK);
+    *slave = QString::fromLocal8Bit(ptsname(*master));
+    return true;
+}
+#endif
+
+// waitStarted直连的槽里推进时钟，等待应立即到期返回而不是挂起
+void TestULab::advanceFromWaitStarted()
+{
+    FakeClock clock;
+    connect(&clock, &FakeClock::waitStarted, &clock, [&clock](qint64 deadlineNs) {
+        if (deadlineNs >= 0) {
+            clock.Advance((deadlineNs - clock.NowNs()) / 1000000);
+        }
+    }, Qt::DirectConnection);
+
+    QElapsedTimer real;
+    real.start();
+    MSleep(1500, &clock);
+    QCOMPARE(clock.NowNs(), 1500 * 1000000LL);
+    QCOMPARE(clock.PendingWaits(), 0);
+    MSleep(0, &clock);
+    QCOMPARE(clock.NowNs(), 1500 * 1000000LL);
+    QVERIFY(real.elapsed() < 1000);
+}
+
+// 到截止时刻返回true；截止前被令牌唤醒返回false，时间停在唤醒时刻
+void TestULab::waitTimeoutAndWake()
+{
+    FakeClock clock;
+    {
+        QEventLoop loop;
+        QTimer::singleShot(0, &clock, [&clock]() { clock.Advance(100); });
+        QVERIFY(clock.Wait(loop, 100));
+        QCOMPARE(clock.NowNs(), 100 * 1000000LL);
+    }
+
+    CancelToken token;
+    int task = clock.StartPeriodic(50, [&clock, &token]() {
+        if (clock.NowNs() >= 350 * 1000000LL) {
+            token.Cancel();
+        }
+    });
+    QTimer driver;
+    connect(&driver, &QTimer::timeout, &clock, [&clock]() { clock.Advance(10); });
+    driver.start(0);
+    QVERIFY(!MSleepInterruptible(1000, &token, &clock));
+    driver.stop();
+    clock.StopPeriodic(task);
+    QCOMPARE(clock.NowNs(), 350 * 1000000LL);
+    QCOMPARE(clock.PendingWaits(), 0);
+}
+
+// 完整加液：阀切换等待、加液、间隔、抽液都在虚拟时钟上走完，指令帧按顺序写出
+void TestULab::addLiquidOnFakeClock()
+{
+#ifndef Q_OS_UNIX
+    QSKIP("需要伪终端");
+#else
+    int master = -1;
+    QString slave;
+    QVERIFY(openPty(&master, &slave));
+
+    FakeClock clock;
+    ULab lab;
+    lab.SetClock(&clock);
+    QVERIFY(lab.InitPort(slave));
+    lab.SetReagentConfig({{"PBS", {"PBS", 1}}});
+    lab.SetSampleConfig({{"样品1", {"样品1", 2}}});
+
+    // 有等待时每轮事件循环推进10ms，周期任务(串口发送/解析)随之执行
+    QTimer driver;
+    connect(&driver, &QTimer::timeout, &clock, [&clock]() {
+        if (clock.PendingWaits() > 0) clock.Advance(10);
+    });
+    driver.start(0);
+
+    QElapsedTimer real;
+    real.start();
+    qint64 beginNs = clock.NowNs();
+    lab.AddLiquid("PBS", 200.0, MEDIUM, "样品1", 1);
+    qint64 elapsedMs = (clock.NowNs() - beginNs) / 1000000;
+    driver.stop();
+
+    // 中速100uL/s：加液 (200+死体积)/100 s，抽液再多ASPIRATE_EXTRA_MS，两次阀切换等待，间隔1s
+    const qint64 pumpMs = (200 + DEAD_VOLUME) * 10;
+    const qint64 expectedMs = 2 * VALVE_SWITCH_DELAY_MS + pumpMs + 1000 + pumpMs + ASPIRATE_EXTRA_MS;
+    QVERIFY2(elapsedMs >= expectedMs, qPrintable(QString("virtual %1 ms").arg(elapsedMs)));
+    QVERIFY2(elapsedMs < expectedMs + 2000, qPrintable(QString("virtual %1 ms").arg(elapsedMs)));
+    QVERIFY(real.elapsed() < expectedMs / 2);
+
+    QByteArray written = readAll(master);
+    int reagentValve = written.indexOf(frame(0x08, 0x01, 1, REAGENT_VALVE_ADDR));
+    int sampleValve = written.indexOf(frame(0x08, 0x01, 2, SAMPLE_VALVE_ADDR));
+    int pumpInStart = written.indexOf(frame(0x0A, PUMP_IN_ID, 0x01, 0x01));
+    int pumpInStop = written.indexOf(frame(0x0A, PUMP_IN_ID, 0x01, 0x02));
+    int aspirateValve = written.indexOf(frame(0x08, ASPIRATE_VALVE_ID, 2, 0x00));
+    int pumpOutStart = written.indexOf(frame(0x0A, PUMP_OUT_ID, 0x01, 0x01));
+    int pumpOutStop = written.indexOf(frame(0x0A, PUMP_OUT_ID, 0x01, 0x02));
+    QVERIFY(reagentValve >= 0 && sampleValve > reagentValve);
+    QVERIFY(pumpInStart > sampleValve && pumpInStop > pumpInStart);
+    QVERIFY(aspirateValve > pumpInStop);
+    QVERIFY(pumpOutStart > aspirateValve && pumpOutStop > pumpOutStart);
+
+    lab.ClosePort();
+    lab.SetClock(nullptr);
+    ::close(master);
+#endif
+}
+
+// 加液中途取消：泵立即停止，不再切换抽液阀，虚拟时间停在取消附近
+void TestULab::addLiquidStopped()
+{
+#ifndef Q_OS_UNIX
+    QSKIP("需要伪终端");
+#else
+    int master = -1;
+    QString slave;
+    QVERIFY(openPty(&master, &slave));
+
+    FakeClock clock;
+    ULab lab;
+    lab.SetClock(&clock);
+    QVERIFY(lab.InitPort(slave));
+    lab.SetReagentConfig({{"PBS", {"PBS", 1}}});
+    lab.SetSampleConfig({{"样品1", {"样品1", 2}}});
+
+    // 阀切换等待之后、加液结束之前取消
+    const qint64 cancelMs = VALVE_SWITCH_DELAY_MS + 3000;
+    int task = clock.StartPeriodic(10, [&clock, &lab, cancelMs]() {
+        if (clock.NowNs() >= cancelMs * 1000000LL) {
+            lab.StopToken()->Cancel();
+        }
+    });
+    QTimer driver;
+    connect(&driver, &QTimer::timeout, &clock, [&clock]() {
+        if (clock.PendingWaits() > 0) clock.Advance(10);
+    });
+    driver.start(0);
+
+    lab.AddLiquid("PBS", 200.0, MEDIUM, "样品1", 1);
+    qint64 elapsedMs = clock.NowNs() / 1000000;
+    driver.stop();
+    clock.StopPeriodic(task);
+
+    QVERIFY(lab.StopToken()->IsCancelled());
+    QVERIFY2(elapsedMs < cancelMs + 200, qPrintable(QString("virtual %1 ms").arg(elapsedMs)));
+
+    QByteArray written = readAll(master);
+    QVERIFY(written.indexOf(frame(0x0A, PUMP_IN_ID, 0x01, 0x01)) >= 0);
+    QVERIFY(written.indexOf(frame(0x0A, PUMP_IN_ID, 0x01, 0x02)) >= 0);
+    QCOMPARE(written.indexOf(frame(0x08, ASPIRATE_VALVE_ID, 2, 0x00)), -1);
+    QCOMPARE(written.indexOf(frame(0x0A, PUMP_OUT_ID, 0x01, 0x01)), -1);
+
+    lab.ClosePort();
+    lab.SetClock(nullptr);
+    ::close(master);
+#endif
+}
+
+// 加液中途暂停：泵立即停止，继续后重新启动补齐剩余时长，总时长只多出暂停的时间
+void TestULab::addLiquidPauseResume()
+{
+#ifndef Q_OS_UNIX
+    QSKIP("需要伪终端");
+#else
+    int master = -1;
+    QString slave;
+    QVERIFY(openPty(&master, &slave));
+
+    FakeClock clock;
+    ULab lab;
+    lab.SetClock(&clock);
+    QVERIFY(lab.InitPort(slave));
+    lab.SetReagentConfig({{"PBS", {"PBS", 1}}});
+    lab.SetSampleConfig({{"样品1", {"样品1", 2}}});
+
+    // 加液开始约1s后暂停3s
+    const qint64 pauseMs = VALVE_SWITCH_DELAY_MS + 1000;
+    const qint64 resumeMs = pauseMs + 3000;
+    int task = clock.StartPeriodic(10, [&clock, &lab, pauseMs, resumeMs]() {
+        qint64 nowMs = clock.NowNs() / 1000000;
+        if (nowMs >= pauseMs && nowMs < resumeMs && !lab.IsPaused()) {
+            lab.PauseRun();
+        } else if (nowMs >= resumeMs && lab.IsPaused()) {
+            lab.ResumeRun();
+        }
+    });
+    QTimer driver;
+    startDriver(&driver, &clock);
+
+    lab.AddLiquid("PBS", 200.0, MEDIUM, "样品1", 1);
+    qint64 elapsedMs = clock.NowNs() / 1000000;
+    driver.stop();
+    clock.StopPeriodic(task);
+
+    const qint64 pumpMs = (200 + DEAD_VOLUME) * 10;
+    const qint64 expectedMs = 2 * VALVE_SWITCH_DELAY_MS + pumpMs + 1000 + pumpMs + ASPIRATE_EXTRA_MS + (resumeMs - pauseMs);
+    QVERIFY2(elapsedMs >= expectedMs, qPrintable(QString("virtual %1 ms").arg(elapsedMs)));
+    QVERIFY2(elapsedMs < expectedMs + 2000, qPrintable(QString("virtual %1 ms").arg(elapsedMs)));
+
+    QByteArray written = readAll(master);
+    QCOMPARE(written.count(frame(0x0A, PUMP_IN_ID, 0x01, 0x01)), 2);
+    QCOMPARE(written.count(frame(0x0A, PUMP_IN_ID, 0x01, 0x02)), 2);
+    QCOMPARE(written.count(frame(0x0A, PUMP_OUT_ID, 0x01, 0x01)), 1);
+
+    lab.ClosePort();
+    lab.SetClock(nullptr);
+    ::close(master);
+#endif
+}
+
+// 初始化冲洗：三次冲洗各加液一次，两次抽液在后台进行。
+// 干运行走同一条代码路径，只是换成自动推进的时钟，估算时长应与FakeClock上的执行一致
+void TestULab::initialWashOnFakeClock()
+{
+#ifndef Q_OS_UNIX
+    QSKIP("需要伪终端");
+#else
+    int master = -1;
+    QString slave;
+    QVERIFY(openPty(&master, &slave));
+
+    // 后台泵到时停止写指令时可能要等指令间隔，这种嵌套等待需要自动推进
+    FakeClock clock;
+    clock.SetAutoAdvance(true);
+    ULab lab;
+    lab.SetClock(&clock);
+    QVERIFY(lab.InitPort(slave));
+    setWashConfig(&lab);
+
+    QElapsedTimer real;
+    real.start();
+    lab.InitialWashPipelines();
+    qint64 elapsedMs = clock.NowNs() / 1000000;
+    QVERIFY(real.elapsed() < elapsedMs / 10);
+
+    QByteArray written = readAll(master);
+    QCOMPARE(written.count(frame(0x0A, PUMP_IN_ID, 0x01, 0x01)), 3);
+    QCOMPARE(written.count(frame(0x0A, PUMP_IN_ID, 0x01, 0x02)), 3);
+    QCOMPARE(written.count(frame(0x0A, PUMP_OUT_ID, 0x01, 0x01)), 2);
+    QCOMPARE(written.count(frame(0x0A, PUMP_OUT_ID, 0x01, 0x02)), 2);
+    lab.ClosePort();
+    lab.SetClock(nullptr);
+    ::close(master);
+
+    ULab dry;
+    setWashConfig(&dry);
+    dry.SetDryRun(true);
+    QVERIFY(dry.RunProtocol({StepInitialWash()}, false));
+    qint64 dryMs = dry.GetClock()->TimelineMs();
+    int background = 0;
+    for (const TimelineEvent& e : dry.GetClock()->Timeline()) {
+        if (e.background) {
+            QCOMPARE(e.category, TIME_PUMP);
+            QVERIFY(e.duration_ms >= WASH_DURATION_SEC * 1000 + ASPIRATE_EXTRA_MS);
+            QVERIFY(e.start_ms + e.duration_ms <= dryMs);
+            ++background;
+        }
+    }
+    QCOMPARE(background, 2);
+    QVERIFY(dry.DryRunReport().contains("后台"));
+    dry.SetDryRun(false);
+    QVERIFY2(qAbs(dryMs - elapsedMs) <= CMD_INTERVAL, qPrintable(QString("dry run %1 ms, executed %2 ms").arg(dryMs).arg(elapsedMs)));
+#endif
+}
+
+// 跳过只结束当前步骤，后续步骤照常执行
+void TestULab::skipStep()
+{
+    FakeClock clock;
+    ULab lab;
+    lab.SetClock(&clock);
+    lab.ClearCheckpoint();
+
+    bool skipped = false;
+    int task = clock.StartPeriodic(10, [&clock, &lab, &skipped]() {
+        if (!skipped && clock.NowNs() >= 3000 * 1000000LL) {
+            skipped = true;
+            lab.SkipStep();
+        }
+    });
+    QTimer driver;
+    startDriver(&driver, &clock);
+
+    QVERIFY(lab.RunProtocol({StepWait(10), StepWait(2)}, false));
+    qint64 elapsedMs = clock.NowNs() / 1000000;
+    driver.stop();
+    clock.StopPeriodic(task);
+
+    QVERIFY(skipped);
+    QVERIFY2(elapsedMs >= 5000 && elapsedMs < 5100, qPrintable(QString("virtual %1 ms").arg(elapsedMs)));
+    lab.SetClock(nullptr);
+}
+
+// 中止后断点保留在已完成的步骤，重新运行从中止的步骤开始，完成后删除断点
+void TestULab::checkpointResume()
+{
+    const QString path = QCoreApplication::applicationDirPath() + "/" + CHECKPOINT_FILE;
+    const QList<ProtocolStep> steps = {StepWait(1), StepWait(2), StepWait(3)};
+    {
+        FakeClock clock;
+        ULab lab;
+        lab.SetClock(&clock);
+        lab.ClearCheckpoint();
+
+        // 中止时停泵要等待，投递到事件循环中执行，不在驱动槽里嵌套等待
+        bool aborted = false;
+        int task = clock.StartPeriodic(10, [&clock, &lab, &aborted]() {
+            if (!aborted && clock.NowNs() >= 3500 * 1000000LL) {
+                aborted = true;
+                QTimer::singleShot(0, &lab, [&lab]() { lab.AbortRun(); });
+            }
+        });
+        QTimer driver;
+        startDriver(&driver, &clock);
+
+        QVERIFY(!lab.RunProtocol(steps, true));
+        driver.stop();
+        clock.StopPeriodic(task);
+        QVERIFY(QFile::exists(path));
+        lab.SetClock(nullptr);
+    }
+
+    FakeClock clock;
+    ULab lab;
+    lab.SetClock(&clock);
+    QTimer driver;
+    startDriver(&driver, &clock);
+
+    QVERIFY(lab.RunProtocol(steps, true));
+    qint64 elapsedMs = clock.NowNs() / 1000000;
+    driver.stop();
+
+    QVERIFY2(elapsedMs >= 3000 && elapsedMs < 3100, qPrintable(QString("virtual %1 ms").arg(elapsedMs)));
+    QVERIFY(!QFile::exists(path));
+    lab.SetClock(nullptr);
+}
+
+// 试剂多于样品：多出的试剂冲向废液缸，不抽液；从通道1出发按最近邻排序
+void TestULab::planMoreReagents()
+{
+    ULab lab;
+    QVector<WashFlush> plan = lab.planInitialWash({1, 3, 5}, {1, 2}, 1);
+    QString error = checkPlan(plan, {1, 3, 5}, {1, 2}, 1);
+    QVERIFY2(error.isEmpty(), qPrintable(error));
+    QCOMPARE(plan.size(), 3);
+    QCOMPARE(int(plan[0].reagent_channel), 1);
+    QCOMPARE(int(plan[0].sample_channel), 2);
+    QCOMPARE(int(plan[1].reagent_channel), 3);
+    QCOMPARE(int(plan[1].sample_channel), 1);
+    QCOMPARE(int(plan[2].reagent_channel), 5);
+    QCOMPARE(int(plan[2].sample_channel), 1);
+}
+
+// 样品多于试剂：多出的样品复用试剂，废液缸仍冲洗一次
+void TestULab::planMoreSamples()
+{
+    ULab lab;
+    QVector<WashFlush> plan = lab.planInitialWash({1, 2}, {1, 3, 4, 6}, 1);
+    QString error = checkPlan(plan, {1, 2}, {1, 3, 4, 6}, 1);
+    QVERIFY2(error.isEmpty(), qPrintable(error));
+    int aspirated = 0;
+    for (const WashFlush& f : plan) {
+        aspirated += f.aspirate ? 1 : 0;
+    }
+    QCOMPARE(aspirated, 3);
+}
+
+// 只有废液缸：每种试剂冲向废液缸一次，都不抽液
+void TestULab::planWasteOnly()
+{
+    ULab lab;
+    QVector<WashFlush> plan = lab.planInitialWash({1, 2}, {1}, 1);
+    QString error = checkPlan(plan, {1, 2}, {1}, 1);
+    QVERIFY2(error.isEmpty(), qPrintable(error));
+    QCOMPARE(plan.size(), 2);
+    QVERIFY(!plan[0].aspirate && !plan[1].aspirate);
+
+    QVERIFY(lab.planInitialWash({1}, {}, 1).isEmpty());
+    QVERIFY(lab.planInitialWash({}, {1}, 1).isEmpty());
+}
+
+// 多个名称共用同一通道：计划与去重后相同，同一管路不重复冲洗
+void TestULab::planDuplicateChannels()
+{
+    ULab lab;
+    QVector<WashFlush> plan = lab.planInitialWash({1, 3, 1}, {1, 2, 2, 1}, 1);
+    QString error = checkPlan(plan, {1, 3}, {1, 2}, 1);
+    QVERIFY2(error.isEmpty(), qPrintable(error));
+    QVector<WashFlush> unique = lab.planInitialWash({1, 3}, {1, 2}, 1);
+    QCOMPARE(plan.size(), unique.size());
+    for (int i = 0; i < plan.size(); ++i) {
+        QCOMPARE(plan[i].reagent_channel, unique[i].reagent_channel);
+        QCOMPARE(plan[i].sample_channel, unique[i].sample_channel);
+        QCOMPARE(plan[i].aspirate, unique[i].aspirate);
+    }
+}
+
+// 后台抽液：第一次冲洗的抽液在后台运行期间，第二次冲洗已开始加液；
+// 时间线上后台抽液与前台加液重叠，串口上后一次加液启动夹在抽液启停之间
+void TestULab::washAspirationOverlap()
+{
+#ifndef Q_OS_UNIX
+    QSKIP("需要伪终端");
+#else
+    int master = -1;
+    QString slave;
+    QVERIFY(openPty(&master, &slave));
+
+    FakeClock clock;
+    clock.SetAutoAdvance(true);
+    ULab lab;
+    lab.SetClock(&clock);
+    QVERIFY(lab.InitPort(slave));
+    setWashConfig(&lab);
+
+    clock.StartTimeline();
+    lab.InitialWashPipelines();
+    clock.StopTimeline();
+
+    QByteArray written = readAll(master);
+    const QByteArray pumpInStart = frame(0x0A, PUMP_IN_ID, 0x01, 0x01);
+    const QByteArray pumpOutStart = frame(0x0A, PUMP_OUT_ID, 0x01, 0x01);
+    const QByteArray pumpOutStop = frame(0x0A, PUMP_OUT_ID, 0x01, 0x02);
+    int firstOutStart = written.indexOf(pumpOutStart);
+    int firstOutStop = written.indexOf(pumpOutStop);
+    int nextInStart = written.indexOf(pumpInStart, firstOutStart);
+    QVERIFY(firstOutStart >= 0);
+    QVERIFY2(nextInStart > firstOutStart && nextInStart < firstOutStop,
+             qPrintable(QString("out start %1, in start %2, out stop %3").arg(firstOutStart).arg(nextInStart).arg(firstOutStop)));
+
+    int overlapped = 0;
+    for (const TimelineEvent& bg : clock.Timeline()) {
+        if (!bg.background) {
+            continue;
+        }
+        for (const TimelineEvent& e : clock.Timeline()) {
+            if (!e.background && (e.resources & RES_PUMP_IN) &&
+                e.start_ms >= bg.start_ms && e.start_ms < bg.start_ms + bg.duration_ms) {
+                ++overlapped;
+            }
+        }
+    }
+    QVERIFY(overlapped > 0);
+
+    lab.ClosePort();
+    lab.SetClock(nullptr);
+    ::close(master);
+#endif
+}
+
+QTEST_GUILESS_MAIN(TestULab)
+
+#include "tst_ulab.moc"
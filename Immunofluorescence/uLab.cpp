@@ -4,6 +4,15 @@
 #include <QDebug>
 #include <QTextStream>
 #include <QThread>
+#include <QFile>
+#include <QHash>
+#include <climits>
+#include <algorithm>
+#include <QSaveFile>
+#include <QCryptographicHash>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
 
 QString getWellName(int row, int col)
 {
@@ -19,13 +28,14 @@ QString getWellName(int row, int col)
 ULab::ULab(QObject *parent) : QObject(parent)
 {
     pPort = new QSerialPort(this);
-    pPortTimer = new QTimer(this);
-    pParseTimer = new QTimer(this);
     pReadTimer = new QTimer(this);
     pGetFlowTimer = new QTimer(this);
     m_pumpInterval = 1000; // 默认间隔1秒
-    connect(pPortTimer, &QTimer::timeout, this, &ULab::RefreshPort);
-    connect(pParseTimer, &QTimer::timeout, this, &ULab::ParsePort);
+    m_realClock = new RealClock(this);
+    m_clock = m_realClock;
+    connect(&m_stopToken, &CancelToken::cancelled, this, [this]() {
+        stopBackgroundPump(false);
+    });
     //    pCRC = new CRC();
 }
 
@@ -35,14 +45,20 @@ ULab::~ULab()
     StopAllDevices();
     
     ClosePort();
-    delete pPortTimer;
-    delete pParseTimer;
     delete pReadTimer;
     delete pGetFlowTimer;
     delete pPort;
     //    delete pCRC;
 }
 
+void ULab::SetClock(Clock* clock)
+{
+    m_clock = clock ? clock : m_realClock;
+    // 两个时钟的时间基准不同，旧时刻留到新时钟上比较会让RefreshPort一直让出
+    m_lastWriteNs = -1;
+    m_lastDirectWriteNs = -1;
+}
+
 bool ULab::InitPort(QString portName)
 {
     pPort->setPortName(portName);
@@ -51,8 +67,8 @@ bool ULab::InitPort(QString portName)
     pPort->setStopBits(QSerialPort::OneStop);
     if (pPort->open(QIODevice::ReadWrite))
     {
-        pPortTimer->start(CMD_INTERVAL);
-        pParseTimer->start(PARSE_INTERVAL);
+        m_portTask = m_clock->StartPeriodic(CMD_INTERVAL, [this]() { RefreshPort(); });
+        m_parseTask = m_clock->StartPeriodic(PARSE_INTERVAL, [this]() { ParsePort(); });
         pReadTimer->start(READ_INTERVAL);
         pGetFlowTimer->start(FLOW_INTERVAL);
         emit SendMessage("Succeed in connecting " + portName);
@@ -67,36 +83,50 @@ bool ULab::InitPort(QString portName)
 
 void ULab::ClosePort()
 {
-    pPortTimer->stop();
-    pParseTimer->stop();
+    m_clock->StopPeriodic(m_portTask);
+    m_clock->StopPeriodic(m_parseTask);
+    m_portTask = m_parseTask = -1;
     pReadTimer->stop();
     if (pPort->isOpen())
         pPort->close();
     emit SendMessage("Disconnect from " + portName);
 }
 
+// 停泵帧与Rotate(false, false, id)一致，只生成不入队
+QByteArray ULab::EmergencyStopFrames()
+{
+    return GenCMD(0x0A, PUMP_IN_ID, 0x01, 0x02) + GenCMD(0x0A, PUMP_OUT_ID, 0x01, 0x02);
+}
+
+QSerialPort::Handle ULab::PortHandle() const
+{
+    return pPort->handle();
+}
+
 void ULab::Rotate(bool start, bool direction, uint8_t id)
 {
-    wrtCmdList.append(GenCMD(0x0A, id, !direction ? 0x01 : 0x00, start ? 0x01 : 0x02));
+    enqueueCmd(GenCMD(0x0A, id, !direction ? 0x01 : 0x00, start ? 0x01 : 0x02));
     emit SendMessage(QString("Peristaltic pump (ID:%1) ").arg(id) + (start ? (QString("start to rotate in ") +
                                                (direction ? "normal" : "reverse") + " direction") : " stop rotating"));
 }
 
 void ULab::SetSpeed(uint16_t speed, uint8_t id)
 {
-    wrtCmdList.append(GenCMD(0x09, id, speed >> 8, speed & 0xff));
+    enqueueCmd(GenCMD(0x09, id, speed >> 8, speed & 0xff));
     emit SendMessage("Set peristaltic pump speed to " + QString::number(speed));
 }
 
 void ULab::GotoChannel(uint8_t addr, uint8_t channel, uint8_t id)
 {
-    wrtCmdList.append(GenCMD(0x08, id, channel, addr));
+    enqueueCmd(GenCMD(0x08, id, channel, addr));
+    m_valveState[(id << 8) | addr] = channel;
+    m_pendingValves |= (id == ASPIRATE_VALVE_ID) ? RES_ASPIRATE_VALVE : (addr == REAGENT_VALVE_ADDR ? RES_REAGENT_VALVE : RES_SAMPLE_VALVE);
     emit SendMessage("Valve (ID:" + QString::number(id) +  ")(addr:" + QString::number(addr) + ") go to channel No." + QString::number(channel));
 }
 
 void ULab::Home(AXIS axis, DEVICE_CODE id)
 {
-    wrtCmdList.append(GenCMD(axis, id, 0x00, 0x00));
+    enqueueCmd(GenCMD(axis, id, 0x00, 0x00));
     emit SendMessage(GetAxisName(axis) + " of low-precision table go back to home");
     m_currentPos[id] = QPoint(0,0);
 }
@@ -109,33 +139,33 @@ void ULab::Goto(AXIS axis, uint16_t pos, DEVICE_CODE id)
     //        return;
     //    }
     //    uint16_t pos_ = pos / 2;
-    wrtCmdList.append(GenCMD(1+axis, id, pos >> 8, pos & 0xff));
+    enqueueCmd(GenCMD(1+axis, id, pos >> 8, pos & 0xff));
     emit SendMessage(GetAxisName(axis) + " of " + (id == LOW_STAGE_CODE ? "low-precision" : "high-precision") + "table go to " + QString::number(pos));
 }
 
 void ULab::SetSpeedStage(AXIS axis, uint16_t speed, DEVICE_CODE id)
 {
-    wrtCmdList.append(GenCMD(2+axis, id, speed >> 8, speed & 0xff));
+    enqueueCmd(GenCMD(2+axis, id, speed >> 8, speed & 0xff));
 }
 
 void ULab::SetTime(AXIS axis, uint16_t time, DEVICE_CODE id)
 {
-    wrtCmdList.append(GenCMD(3+axis, id, time >> 8, time & 0xff));
+    enqueueCmd(GenCMD(3+axis, id, time >> 8, time & 0xff));
 }
 
 void ULab::Go(AXIS axis, bool direction, DEVICE_CODE id)
 {
-    wrtCmdList.append(GenCMD(4+axis, id, direction ? 0x01: 0x00, 0x00));
+    enqueueCmd(GenCMD(4+axis, id, direction ? 0x01: 0x00, 0x00));
 }
 
 void ULab::Enable(AXIS axis, bool enable, DEVICE_CODE id)
 {
-    wrtCmdList.append(GenCMD(5+axis, id, enable ? 0x00: 0x01, 0x00));
+    enqueueCmd(GenCMD(5+axis, id, enable ? 0x00: 0x01, 0x00));
 }
 
 void ULab::GetPos(AXIS axis, DEVICE_CODE id)
 {
-    wrtCmdList.append(GenCMD(7+axis, id, 1+axis, 0x00));
+    enqueueCmd(GenCMD(7+axis, id, 1+axis, 0x00));
 }
 
 void ULab::SetAxisEnable(AXIS axis, bool enable, DEVICE_CODE code)
@@ -203,58 +233,76 @@ void ULab::SetFluigentEnable(bool enable)
 
 void ULab::StartPump(uint16_t speed)
 {
-    wrtCmdList.append(GenCMD(0x31, PUMP_CODE, speed >> 8, speed & 0xff));
+    enqueueCmd(GenCMD(0x31, PUMP_CODE, speed >> 8, speed & 0xff));
 }
 
 void ULab::StopPump()
 {
-    wrtCmdList.append(GenCMD(0x32, PUMP_CODE, 0x00, 0x00));
+    enqueueCmd(GenCMD(0x32, PUMP_CODE, 0x00, 0x00));
 }
 
 void ULab::SetPressure(uint16_t pressure)
 {
     QByteArray cmd = GenCMD(0x20, PUMP_CODE, pressure >> 8, pressure & 0xff);
     for (int i = 0; i < 3; ++i)
-        wrtCmdList.append(cmd);
+        enqueueCmd(cmd);
 }
 
 void ULab::SetFlow(uint16_t flow)
 {
     QByteArray cmd = GenCMD(0x21, PUMP_CODE, flow >> 8, flow & 0xff);
     for (int i = 0; i < 3; ++i)
-        wrtCmdList.append(cmd);
+        enqueueCmd(cmd);
 }
 
 void ULab::GetPressure()
 {
-    wrtCmdList.append(GenCMD(0x24, PUMP_CODE, 0x00, 0x00));
+    enqueueCmd(GenCMD(0x24, PUMP_CODE, 0x00, 0x00));
 }
 
 void ULab::GetFlow()
 {
-    wrtCmdList.append(GenCMD(0x23, PUMP_CODE, 0x00, 0x00));
+    enqueueCmd(GenCMD(0x23, PUMP_CODE, 0x00, 0x00));
 }
 
 void ULab::PeristalticPumpRotate(bool start)
 {
-    wrtCmdList.append(GenCMD(0x52, PUMP_CODE, start ? 0x01 : 0x00, 0x00));
+    enqueueCmd(GenCMD(0x52, PUMP_CODE, start ? 0x01 : 0x00, 0x00));
 }
 
 void ULab::PeristalticPumpSetSpeed(uint16_t speed)
 {
-    wrtCmdList.append(GenCMD(0x51, PUMP_CODE, speed >> 8 , speed & 0xff));
+    enqueueCmd(GenCMD(0x51, PUMP_CODE, speed >> 8 , speed & 0xff));
 }
 
 void ULab::SetSolenoidValve(uint8_t valves)
 {
-    wrtCmdList.append(GenCMD(0x41, PUMP_CODE, valves , 0x00));
+    enqueueCmd(GenCMD(0x41, PUMP_CODE, valves , 0x00));
 }
 
 void ULab::RefreshPort()
 {
+    // 刚有指令绕过队列直接写出，或有直接写入正在等间隔时本拍让出，保证相邻指令间隔不小于CMD_INTERVAL
+    if (m_directWritesWaiting > 0 ||
+        (m_lastDirectWriteNs >= 0 && m_clock->NowNs() - m_lastDirectWriteNs < CMD_INTERVAL * 1000000LL))
+    {
+        return;
+    }
     if (!wrtCmdList.isEmpty())
     {
-        pPort->write(wrtCmdList.takeFirst());
+        QByteArray cmd = wrtCmdList.takeFirst();
+        qint64 enqueuedNs = wrtCmdTimes.takeFirst();
+        m_lastWriteNs = m_clock->NowNs();
+        // 干运行不连接串口，只按节拍出队
+        if (pPort->isOpen())
+        {
+            pPort->write(cmd);
+            recordWrite(cmd, enqueuedNs);
+        }
+        if (wrtCmdList.isEmpty())
+        {
+            emit CmdQueueEmpty();
+        }
     }
 }
 
@@ -276,6 +324,19 @@ void ULab::ParsePort()
             {
                 continue;
             }
+            // 回复帧与请求帧的指令码、设备码相同，按FIFO与最早一次未回复的写入匹配
+            quint16 key = ((quint16)(uint8_t)cmd.at(2) << 8) | (uint8_t)cmd.at(1);
+            qint64 parsedNs = m_clock->NowNs();
+            CommandLatency& latency = m_latency[key];
+            QList<qint64>& inFlight = m_inFlight[key];
+            if (!inFlight.isEmpty())
+            {
+                latency.response.Record((parsedNs - inFlight.takeFirst()) / 1000);
+            }
+            else
+            {
+                latency.unmatched++;
+            }
             switch (cmd.at(2))
             {
             case PIPET_CODE:break;
@@ -302,14 +363,51 @@ void ULab::ParsePort()
             }
             default:;
             }
+            // 信号为直接连接，发射返回时槽函数已执行完毕
+            m_latency[key].dispatch.Record((m_clock->NowNs() - parsedNs) / 1000);
         }
     }
 }
 
+void ULab::enqueueCmd(const QByteArray& cmd)
+{
+    wrtCmdList.append(cmd);
+    wrtCmdTimes.append(m_clock->NowNs());
+}
+
+void ULab::clearCmdQueue()
+{
+    wrtCmdList.clear();
+    wrtCmdTimes.clear();
+}
+
+void ULab::recordWrite(const QByteArray& frame, qint64 enqueuedNs)
+{
+    if (frame.length() != 8)
+    {
+        return;
+    }
+    quint16 key = ((quint16)(uint8_t)frame.at(2) << 8) | (uint8_t)frame.at(1);
+    qint64 writeNs = m_clock->NowNs();
+    CommandLatency& latency = m_latency[key];
+    if (enqueuedNs >= 0)
+    {
+        latency.queueWait.Record((writeNs - enqueuedNs) / 1000);
+    }
+    // 不回复的指令不会被取走，限制长度以免无限增长
+    QList<qint64>& inFlight = m_inFlight[key];
+    inFlight.append(writeNs);
+    if (inFlight.size() > LATENCY_MAX_INFLIGHT)
+    {
+        inFlight.removeFirst();
+        latency.unanswered++;
+    }
+}
+
 void ULab::GetPresAndFlow()
 {
     GetPressure();
-    MSleep(FLOW_INTERVAL / 2);
+    MSleep(FLOW_INTERVAL / 2, m_clock);
     GetFlow();
 }
 
@@ -418,39 +516,330 @@ QString GetAxisName(AXIS axis)
     }
 }
 
+// ******************************************************************************
+
+// ******************************* 时钟 *****************************************
+
+RealClock::RealClock(QObject *parent) : Clock(parent)
+{
+    m_elapsed.start();
+}
+
+bool Clock::Wait(QEventLoop& loop, qint64 msec, const WaitNote& note)
+{
+    qint64 startNs = NowNs();
+    ++m_depth;
+    bool timedOut = waitFor(loop, msec);
+    --m_depth;
+    if (m_depth == 0 && NowNs() > startNs) {
+        AddTimelineEvent(startNs, (NowNs() - startNs) / 1000000, note, false);
+    }
+    return timedOut;
+}
+
+void Clock::StartTimeline()
+{
+    m_timeline.clear();
+    m_originNs = NowNs();
+    m_step = -1;
+    m_recording = true;
+}
+
+void Clock::AddTimelineEvent(qint64 startNs, qint64 duration_ms, const WaitNote& note, bool background)
+{
+    if (m_recording) {
+        m_timeline.append({(startNs - m_originNs) / 1000000, duration_ms, note.category, m_step, note.what, note.resources, background});
+    }
+}
+
+bool RealClock::waitFor(QEventLoop& loop, qint64 msec)
+{
+    bool timedOut = false;
+    QTimer timer;
+    timer.setSingleShot(true);
+    timer.setTimerType(Qt::PreciseTimer);
+    if (msec >= 0) {
+        connect(&timer, &QTimer::timeout, &loop, [&loop, &timedOut]() {
+            timedOut = true;
+            loop.quit();
+        });
+        timer.start(msec);
+    }
+    loop.exec();
+    return timedOut;
+}
+
+int RealClock::StartPeriodic(int msec, std::function<void()> task)
+{
+    QTimer* timer = new QTimer(this);
+    connect(timer, &QTimer::timeout, this, task);
+    timer->setTimerType(Qt::PreciseTimer);
+    timer->start(msec);
+    m_tasks[m_nextId] = timer;
+    return m_nextId++;
+}
+
+void RealClock::StopPeriodic(int id)
+{
+    if (m_tasks.contains(id)) {
+        delete m_tasks.take(id);
+    }
+}
+
+// 截止时刻已到(msec为0)时仍进入一次事件循环，保持与真实时钟相同的事件处理顺序。
+// waitStarted投递到loop中发出：QEventLoop::exec会清除进入前的quit，若在exec之前直接发出，
+// 直连的槽里调用Advance(或其他唤醒)退出的是尚未运行的loop，等待将永远挂起
+bool FakeClock::waitFor(QEventLoop& loop, qint64 msec)
+{
+    bool timedOut = false;
+    qint64 deadlineNs = msec >= 0 ? m_nowNs + msec * 1000000 : -1;
+    quint64 serial = m_nextWait++;
+    m_waits.append({deadlineNs, &loop, &timedOut, serial});
+    QTimer::singleShot(0, this, [this, serial, deadlineNs]() {
+        if (!isPending(serial)) {
+            return;                             // 等待已结束时不再通知
+        }
+        emit waitStarted(deadlineNs);
+        if (m_autoAdvance) {
+            autoStep(serial, deadlineNs);
+        }
+    });
+    if (msec == 0) {
+        timedOut = true;
+        QTimer::singleShot(0, &loop, &QEventLoop::quit);
+    }
+    loop.exec();
+    for (int i = 0; i < m_waits.size(); ++i) {
+        if (m_waits[i].loop == &loop) {
+            m_waits.removeAt(i);
+            break;
+        }
+    }
+    return timedOut;
+}
+
+bool FakeClock::isPending(quint64 serial) const
+{
+    for (const PendingWait& w : m_waits) {
+        if (w.serial == serial) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// 不限时的等待每轮事件循环只触发一个事件，让唤醒信号退出的loop先返回，时钟不会越过唤醒时刻
+void FakeClock::autoStep(quint64 serial, qint64 deadlineNs)
+{
+    if (!isPending(serial)) {
+        return;
+    }
+    if (deadlineNs >= 0) {
+        advanceTo(deadlineNs);
+        return;
+    }
+    if (fireNext(LLONG_MAX)) {
+        QTimer::singleShot(0, this, [this, serial]() { autoStep(serial, -1); });
+    }
+}
+
+int FakeClock::StartPeriodic(int msec, std::function<void()> task)
+{
+    qint64 periodNs = qMax(1, msec) * 1000000LL;
+    m_tasks[m_nextId] = {periodNs, m_nowNs + periodNs, task};
+    return m_nextId++;
+}
+
+void FakeClock::StopPeriodic(int id)
+{
+    m_tasks.remove(id);
+}
+
+void FakeClock::Advance(qint64 msec)
+{
+    advanceTo(m_nowNs + msec * 1000000);
+}
+
+void FakeClock::advanceTo(qint64 targetNs)
+{
+    while (fireNext(targetNs)) {
+    }
+    m_nowNs = qMax(m_nowNs, targetNs);      // 到期事件中嵌套调用Advance时时间可能已超过targetNs，不能倒退
+}
+
+bool FakeClock::fireNext(qint64 limitNs)
+{
+    // 找出最早到期的事件：等待截止或周期任务
+    qint64 nextNs = limitNs;
+    bool found = false;
+    for (const PendingWait& w : m_waits) {
+        if (w.deadlineNs >= 0 && !*w.timedOut && w.deadlineNs <= nextNs) {
+            nextNs = w.deadlineNs;
+            found = true;
+        }
+    }
+    int taskId = -1;
+    for (auto it = m_tasks.constBegin(); it != m_tasks.constEnd(); ++it) {
+        if (found ? it.value().nextNs < nextNs : it.value().nextNs <= nextNs) {
+            nextNs = it.value().nextNs;
+            taskId = it.key();
+            found = true;
+        }
+    }
+    if (!found) {
+        return false;
+    }
+    m_nowNs = qMax(m_nowNs, nextNs);
+    if (taskId >= 0) {
+        m_tasks[taskId].nextNs += m_tasks[taskId].periodNs;
+        std::function<void()> task = m_tasks[taskId].task;
+        task();
+        return true;
+    }
+    for (PendingWait& w : m_waits) {
+        if (w.deadlineNs >= 0 && w.deadlineNs <= m_nowNs && !*w.timedOut) {
+            *w.timedOut = true;
+            w.loop->quit();
+        }
+    }
+    return true;
+}
+
+Clock* DefaultClock()
+{
+    static RealClock clock;
+    return &clock;
+}
+
 // 延时函数，阻塞当前函数执行，但仍能处理Qt事件，串口数据接收、定时器等可继续工作
-void MSleep(uint msec)
+void MSleep(uint msec, Clock* clock)
 {
     QEventLoop loop;
-    QTimer::singleShot(msec, &loop, SLOT(quit()));
-    loop.exec();
+    (clock ? clock : DefaultClock())->Wait(loop, msec);
 }
 
-// 可中断的延时函数
-void MSleepInterruptible(uint msec)
+// 可中断的延时函数：令牌取消时立即返回false
+bool MSleepInterruptible(uint msec, const CancelToken* token, Clock* clock)
 {
+    if (token && token->IsCancelled()) {
+        return false;
+    }
     QEventLoop loop;
-    QTimer timer;
-    timer.setSingleShot(true);
-    QObject::connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
-    
-    // 每100ms检查一次是否应该停止
-    const uint checkInterval = 100;
-    uint elapsed = 0;
-    
-    while (elapsed < msec) {
-        int sleepTime = qMin(checkInterval, static_cast<uint>(msec - elapsed));
-        timer.start(sleepTime);
-        loop.exec();
-        elapsed += sleepTime;
-        
-        // 检查全局停止标志
-        if (QCoreApplication::instance() && 
-            QCoreApplication::instance()->property("shouldStop").toBool()) {
-            qDebug() << "检测到停止信号，中断延时操作";
+    if (token) {
+        QObject::connect(token, &CancelToken::cancelled, &loop, &QEventLoop::quit);
+    }
+    (clock ? clock : DefaultClock())->Wait(loop, msec);
+
+    return !(token && token->IsCancelled());
+}
+
+// 所有绕过队列的写入(精确定时泵、后台泵的启停)都经过这里的间隔闸门：
+// 距上一条指令(队列或直接写出)不足CMD_INTERVAL时先等满再写。等待不可中断，停止指令必须发出，至多推迟一个间隔
+qint64 ULab::WriteFrameNow(const QByteArray& frame)
+{
+    // 等待期间RefreshPort让出；嵌套的直接写入(如后台泵到时停止)先写出后，这里重新计算剩余间隔
+    ++m_directWritesWaiting;
+    qint64 gapNs;
+    while (m_lastWriteNs >= 0 && (gapNs = CMD_INTERVAL * 1000000LL - (m_clock->NowNs() - m_lastWriteNs)) > 0)
+    {
+        QEventLoop loop;
+        m_clock->Wait(loop, (gapNs + 999999) / 1000000, WaitNote(TIME_QUEUE, "指令间隔"));
+    }
+    --m_directWritesWaiting;
+
+    m_lastWriteNs = m_clock->NowNs();
+    m_lastDirectWriteNs = m_lastWriteNs;
+    if (pPort->isOpen())
+    {
+        pPort->write(frame);
+        pPort->flush();
+        recordWrite(frame, -1);
+    }
+    return m_lastWriteNs;
+}
+
+// 等待队列中已有的指令全部发出，且距离最后一条指令满CMD_INTERVAL，保证指令顺序和间隔不变
+bool ULab::WaitCmdQueueDrained()
+{
+    if (!wrtCmdList.isEmpty())
+    {
+        QEventLoop loop;
+        connect(this, &ULab::CmdQueueEmpty, &loop, &QEventLoop::quit);
+        connect(&m_stopToken, &CancelToken::cancelled, &loop, &QEventLoop::quit);
+        connect(&m_skipToken, &CancelToken::cancelled, &loop, &QEventLoop::quit);
+        if (!stepCancelled())
+        {
+            m_clock->Wait(loop, -1, WaitNote(TIME_QUEUE, "等待指令队列"));
+        }
+    }
+    if (stepCancelled())
+    {
+        return false;
+    }
+
+    qint64 sinceLastMs = (m_clock->NowNs() - m_lastWriteNs) / 1000000;
+    if (m_lastWriteNs >= 0 && sinceLastMs < CMD_INTERVAL)
+    {
+        QEventLoop loop;
+        m_clock->Wait(loop, CMD_INTERVAL - sinceLastMs, WaitNote(TIME_QUEUE, "指令间隔"));
+    }
+    return true;
+}
+
+// 精确定时出液：启动指令绕过队列直接写串口并记录写入时刻，
+// 停止指令以启动时刻为基准用PreciseTimer定时写出，不受队列排队和100ms分片延时的影响；
+// 与其他指令相距不足CMD_INTERVAL时由WriteFrameNow推迟写出，出液时长按实际写入时刻累计。
+// 暂停时立即写停止指令并累计已出液时长，继续后重新启动泵补齐剩余时长
+double ULab::TimedRotate(uint8_t id, bool direction, uint on_ms)
+{
+    if (!WaitCmdQueueDrained() || !waitWhilePaused())
+    {
+        return 0.0;
+    }
+
+    on_ms = static_cast<uint>(modelPumpMs(on_ms));
+    WaitNote note(TIME_PUMP, QString("蠕动泵(ID:%1)运行").arg(id), id == PUMP_OUT_ID ? RES_PUMP_OUT : RES_PUMP_IN);
+    QByteArray startFrame = GenCMD(0x0A, id, !direction ? 0x01 : 0x00, 0x01);
+    QByteArray stopFrame = GenCMD(0x0A, id, !direction ? 0x01 : 0x00, 0x02);
+    qint64 startNs = WriteFrameNow(startFrame);
+    emit SendMessage(QString("Peristaltic pump (ID:%1) start to rotate in %2 direction for %3 ms")
+                         .arg(id).arg(direction ? "normal" : "reverse").arg(on_ms));
+
+    double achievedMs = 0.0;
+    while (true)
+    {
+        QEventLoop loop;
+        connect(&m_stopToken, &CancelToken::cancelled, &loop, &QEventLoop::quit);
+        connect(&m_skipToken, &CancelToken::cancelled, &loop, &QEventLoop::quit);
+        connect(this, &ULab::RunPaused, &loop, &QEventLoop::quit);
+
+        // 以本段启动指令的写入时刻为基准计算剩余时长
+        qint64 remainingMs = qRound64(on_ms - achievedMs) - (m_clock->NowNs() - startNs) / 1000000;
+        if (remainingMs > 0 && !stepCancelled() && !m_paused)
+        {
+            m_clock->Wait(loop, remainingMs, note);
+        }
+
+        qint64 stopNs = WriteFrameNow(stopFrame);
+        achievedMs += (stopNs - startNs) / 1e6;
+        if (!m_paused || stepCancelled() || achievedMs >= on_ms)
+        {
+            break;
+        }
+
+        emit SendMessage(QString("Peristaltic pump (ID:%1) paused, %2 ms remaining")
+                             .arg(id).arg(on_ms - achievedMs, 0, 'f', 0));
+        if (!waitWhilePaused() || !WaitCmdQueueDrained())
+        {
             break;
         }
+        startNs = WriteFrameNow(startFrame);
+        emit SendMessage(QString("Peristaltic pump (ID:%1) resumed").arg(id));
     }
+
+    emit SendMessage(QString("Peristaltic pump (ID:%1) stop rotating, on-time %2 ms (requested %3 ms)")
+                         .arg(id).arg(achievedMs, 0, 'f', 1).arg(on_ms));
+    return achievedMs;
 }
 
 void ULab::SendData(const QByteArray &data)
@@ -458,6 +847,7 @@ void ULab::SendData(const QByteArray &data)
     if (pPort && pPort->isOpen()) {
         pPort->write(data);
         pPort->flush();
+        recordWrite(data, -1);
     }
 }
 
@@ -479,90 +869,67 @@ void ULab::SetSampleConfig(const QMap<QString, SampleConfig>& config)
 
 void ULab::AddLiquid(const QString& reagent_name, double volume_ul, FluidSpeed speed, const QString& sample_name, uint delay_sec)
 {
+    CompiledProtocol compiled;
+    if (CompileProtocol({StepAddLiquid(reagent_name, volume_ul, speed, sample_name, delay_sec)}, &compiled)) {
+        executeAddLiquid(compiled.steps.first(), compiled.names);
+    }
+}
+
+// 加液步骤：试剂/样品已在编译时解析为阀通道，执行期间不再查表
+void ULab::executeAddLiquid(const CompiledStep& step, const QStringList& names)
+{
+    const QString& reagent_name = names[step.reagent_name];
+    const QString& sample_name = names[step.sample_name];
+
     emit SendMessage("\n\n");
     emit SendMessage(QString("=").repeated(60));
 
-    // 检查试剂是否已配置
-    if (!m_reagentConfigs.contains(reagent_name)) {
-        emit SendMessage(QString("\n错误：试剂: [%1] 未在配置中找到").arg(reagent_name));
-        return;
-    }
-    
-    // 检查样品是否已配置
-    if (!m_sampleConfigs.contains(sample_name)) {
-        emit SendMessage(QString("\n错误：'%1' 未在配置中找到").arg(sample_name));
-        return;
-    }
-
-    // 获取试剂和样品配置
-    ReagentConfig reagent = m_reagentConfigs[reagent_name];
-    SampleConfig sample = m_sampleConfigs[sample_name];
-    
-    // 根据速度枚举转换为实际流速值 (uL/s)
-    double flow_speed = 0.0;
-    switch (speed) {
-        case SLOW:   flow_speed = 50.0;  break;  // 慢速：50 uL/s
-        case MEDIUM: flow_speed = 100.0;  break;  // 中速：100 uL/s
-        case FAST:   flow_speed = 150.0; break;  // 快速：150 uL/s
-    }
+    if (!beginStep(QString("加液 %1 -> %2").arg(reagent_name, sample_name))) return;
 
     emit SendMessage(QString("\n[加液操作]: %1uL %2 --> %3 (%4速)")
-                         .arg(QString::number(volume_ul),
+                         .arg(QString::number(step.volume_ul),
                               reagent_name,
                               sample_name,
-                              speed == SLOW ? "慢" : (speed == MEDIUM ? "中" : "快")));
+                              step.speed == SLOW ? "慢" : (step.speed == MEDIUM ? "中" : "快")));
 
 
     // 切换第一个切换阀到试剂通道
-    emit SendMessage(QString("\n  > 切换[试剂阀] 到 [通道%1]").arg(reagent.valve_channel));
-    GotoChannel(REAGENT_VALVE_ADDR, reagent.valve_channel, 0x01);
+    emit SendMessage(QString("\n  > 切换[试剂阀] 到 [通道%1]").arg(step.reagent_channel));
+    GotoChannel(REAGENT_VALVE_ADDR, step.reagent_channel, 0x01);
     
-    MSleep(50);
+    fixedDelay(50);
     
     // 切换第二个切换阀到样品通道
-    emit SendMessage(QString("\n  > 切换[样品阀] 到 [通道%1]").arg(sample.valve_channel));
-    GotoChannel(SAMPLE_VALVE_ADDR, sample.valve_channel, 0x01);
-    
-    MSleep(VALVE_SWITCH_DELAY_MS);
-
-    // 执行加液操作
-    
-    if (flow_speed <= 0) {
-        emit SendMessage("\n  > 错误：流速输入有误，无法计算时长。");
-        return;
-    }
+    emit SendMessage(QString("\n  > 切换[样品阀] 到 [通道%1]").arg(step.sample_channel));
+    GotoChannel(SAMPLE_VALVE_ADDR, step.sample_channel, 0x01);
     
-    uint duration_ms = static_cast<uint>((volume_ul + DEAD_VOLUME) / flow_speed * 1000.0);
+    if (!stepWait(VALVE_SWITCH_DELAY_MS, TIME_VALVE)) return;
 
     // 启动蠕动泵加液
-    SetSpeed(flow_speed, PUMP_IN_ID);
-    Rotate(true, false, PUMP_IN_ID);
+    SetSpeed(step.flow_speed, PUMP_IN_ID);
     emit SendMessage(QString("\n  > 开始加液"));
 
-    MSleepInterruptible(duration_ms);
-    Rotate(false, false, PUMP_IN_ID);
+    TimedRotate(PUMP_IN_ID, false, step.pump_ms);
+    if (stepCancelled()) return;
     emit SendMessage(QString("\n  > 加液完成"));
     
-    // 用户设置的间隔时间(转换秒为毫秒)
-    uint interval_ms = delay_sec * 1000;
-    if (interval_ms > 0) {
-        emit SendMessage(QString("\n  > 等待 %1 秒...").arg(delay_sec));
-        MSleepInterruptible(interval_ms);
+    // 用户设置的间隔时间
+    if (step.delay_ms > 0) {
+        emit SendMessage(QString("\n  > 等待 %1 秒...").arg(step.delay_ms / 1000));
+        if (!stepWait(step.delay_ms)) return;
     }
 
     // 第三个切换阀（抽液阀）切换到对应的样品通道
-    emit SendMessage(QString("\n  > 切换[抽液阀] 到 [通道%1]").arg(sample.valve_channel));
-    GotoChannel(0x00, sample.valve_channel, 0x08);
+    emit SendMessage(QString("\n  > 切换[抽液阀] 到 [通道%1]").arg(step.sample_channel));
+    GotoChannel(0x00, step.sample_channel, ASPIRATE_VALVE_ID);
 
-    MSleep(VALVE_SWITCH_DELAY_MS);
+    if (!stepWait(VALVE_SWITCH_DELAY_MS, TIME_VALVE)) return;
 
     // 启动蠕动泵抽液
-    SetSpeed(flow_speed, PUMP_OUT_ID);
-    Rotate(true, false, PUMP_OUT_ID);
+    SetSpeed(step.flow_speed, PUMP_OUT_ID);
     emit SendMessage(QString("\n  > 开始抽液"));
 
-    MSleepInterruptible(duration_ms + 5000);
-    Rotate(false, false, PUMP_OUT_ID);
+    TimedRotate(PUMP_OUT_ID, false, step.aspirate_ms);
     emit SendMessage(QString("\n  > 抽液完成"));
 
     emit SendMessage(QString("\n  > '%1' 操作完成.").arg(reagent_name));
@@ -570,51 +937,56 @@ void ULab::AddLiquid(const QString& reagent_name, double volume_ul, FluidSpeed s
 
 void ULab::WashPipeline(const QString& reagent_name, const QString& sample_name)
 {
-    // 检查试剂是否已配置
-    if (!m_reagentConfigs.contains(reagent_name)) {
-        emit SendMessage(QString("\n错误：试剂: [%1] 未在配置中找到").arg(reagent_name));
-        return;
+    CompiledProtocol compiled;
+    if (CompileProtocol({StepWashPipeline(reagent_name, sample_name)}, &compiled)) {
+        executeWashPipeline(compiled.steps.first(), compiled.names);
     }
+}
 
-    // 检查样品是否已配置
-    if (!m_sampleConfigs.contains(sample_name)) {
-        emit SendMessage(QString("\n错误：[%1] 未在配置中找到").arg(sample_name));
-        return;
-    }
+void ULab::executeWashPipeline(const CompiledStep& step, const QStringList& names)
+{
+    const QString& reagent_name = names[step.reagent_name];
+    const QString& sample_name = names[step.sample_name];
 
-    // 获取试剂和样品配置
-    ReagentConfig reagent = m_reagentConfigs[reagent_name];
-    SampleConfig sample = m_sampleConfigs[sample_name];
+    if (!beginStep(QString("冲洗管路 %1 -> %2").arg(reagent_name, sample_name))) return;
 
     emit SendMessage(QString("\n[冲洗管路]: 使用 [%1] 冲洗到 [%2]")
                          .arg(reagent_name, sample_name));
 
 
     // 切换第一个切换阀到试剂通道
-    GotoChannel(REAGENT_VALVE_ADDR, reagent.valve_channel, 0x01);
+    GotoChannel(REAGENT_VALVE_ADDR, step.reagent_channel, 0x01);
 
-    MSleep(50);
+    fixedDelay(50);
     
     // 切换第二个切换阀到废液缸通道
-    GotoChannel(SAMPLE_VALVE_ADDR, sample.valve_channel, 0x01);
+    GotoChannel(SAMPLE_VALVE_ADDR, step.sample_channel, 0x01);
 
-    MSleep(VALVE_SWITCH_DELAY_MS);
+    if (!stepWait(VALVE_SWITCH_DELAY_MS, TIME_VALVE)) return;
 
     // 执行冲洗操作 - 使用固定的速度和时间
     emit SendMessage(QString("\n  > 开始冲洗管路"));
 
     // 启动蠕动泵进行冲洗
-    SetSpeed(WASH_SPEED, PUMP_IN_ID);
-    Rotate(true, false, PUMP_IN_ID);
+    SetSpeed(step.flow_speed, PUMP_IN_ID);
+    TimedRotate(PUMP_IN_ID, false, step.pump_ms);
+    emit SendMessage(QString("\n  > 管路冲洗完成"));
+}
 
-    MSleepInterruptible(WASH_DURATION_SEC * 1000);  // 使用可中断的延时
+// 孵育等待：可暂停、跳过
+void ULab::executeWait(const CompiledStep& step)
+{
+    if (!beginStep(QString("等待 %1 秒").arg(step.delay_ms / 1000))) return;
 
-    Rotate(false, false, PUMP_IN_ID);
-    emit SendMessage(QString("\n  > 管路冲洗完成"));
+    emit SendMessage(QString("\n[等待]: %1 秒").arg(step.delay_ms / 1000));
+    if (!stepWait(step.delay_ms)) return;
+    emit SendMessage(QString("\n  > 等待完成"));
 }
 
 void ULab::InitialWashPipelines()
 {
+    if (!beginStep(QString("初始化管路冲洗"))) return;
+
     emit SendMessage(QString("\n\n*** 开始初始化管路冲洗 ***"));
     emit SendMessage(QString("\n注意：初始时所有通道都连接[PBS]，冲洗完成后请更换为[实际试剂]"));
     
@@ -630,9 +1002,11 @@ void ULab::InitialWashPipelines()
         sampleChannels.append(it.value().valve_channel);
     }
     
-    // 按通道号排序
+    // 按通道号排序，多个名称共用同一通道时只冲洗一次
     std::sort(reagentChannels.begin(), reagentChannels.end());
     std::sort(sampleChannels.begin(), sampleChannels.end());
+    reagentChannels.erase(std::unique(reagentChannels.begin(), reagentChannels.end()), reagentChannels.end());
+    sampleChannels.erase(std::unique(sampleChannels.begin(), sampleChannels.end()), sampleChannels.end());
     
     // 构建通道号字符串用于显示
     QStringList reagentChStrList, sampleChStrList;
@@ -649,67 +1023,52 @@ void ULab::InitialWashPipelines()
     // 找出废液缸通道（通道号最小的样品通道）
     uint8_t wasteChannel = sampleChannels.isEmpty() ? 1 : sampleChannels.first();
     emit SendMessage(QString("废液缸所在通道: %1 (默认为通道号最小的样品通道)").arg(wasteChannel));
-    
-    int reagentCount = reagentChannels.size();
-    int sampleCount = sampleChannels.size();
-    
-    emit SendMessage(QString("\n开始按策略进行管路冲洗:"));
-    
-    if (reagentCount < sampleCount) {
-        // 情况1: 试剂数量 < 样品数量
-        emit SendMessage(QString("=== 策略1: 试剂数量(%1) < 样品数量(%2) ===").arg(reagentCount).arg(sampleCount));
-        
-        // 首先按对应关系冲洗
-        for (int i = 0; i < reagentCount; i++) {
-            uint8_t reagentCh = reagentChannels[i];
-            uint8_t sampleCh = sampleChannels[i];
-            
-            emit SendMessage(QString("\n[冲洗] 试剂通道%1 -> 样品通道%2").arg(reagentCh).arg(sampleCh));
-            performWash(reagentCh, sampleCh, wasteChannel);
-        }
-        
-        // 剩余样品通道都用最小的试剂通道冲洗
-        uint8_t minReagentCh = reagentChannels.first();
-        for (int i = reagentCount; i < sampleCount; i++) {
-            uint8_t sampleCh = sampleChannels[i];
-            
-            emit SendMessage(QString("\n[冲洗] 试剂通道%1 -> 样品通道%2 (剩余样品通道)").arg(minReagentCh).arg(sampleCh));
-            performWash(minReagentCh, sampleCh, wasteChannel);
-        }
-        
-    } else if (reagentCount == sampleCount) {
-        // 情况2: 试剂数量 = 样品数量
-        emit SendMessage(QString("=== 策略2: 试剂数量(%1) = 样品数量(%2) ===").arg(reagentCount).arg(sampleCount));
-        
-        for (int i = 0; i < reagentCount; i++) {
-            uint8_t reagentCh = reagentChannels[i];
-            uint8_t sampleCh = sampleChannels[i];
-            
-            emit SendMessage(QString("\n[冲洗] 试剂通道%1 -> 样品通道%2").arg(reagentCh).arg(sampleCh));
-            performWash(reagentCh, sampleCh, wasteChannel);
+
+    // 冲洗计划：每次冲洗purge一条试剂管路和一条样品管路，共max(试剂数, 样品数)次；
+    // 按阀行程最短的顺序执行，阀已在目标通道时不再切换和等待，
+    // 上一次冲洗的抽液在后台进行，与下一次冲洗的阀切换和加液重叠
+    QVector<WashFlush> plan = planInitialWash(reagentChannels, sampleChannels, wasteChannel);
+    emit SendMessage(QString("\n冲洗计划: 共 %1 次冲洗").arg(plan.size()));
+    for (int i = 0; i < plan.size(); ++i) {
+        emit SendMessage(QString("  %1. 试剂通道%2 -> 样品通道%3%4").arg(i + 1).arg(plan[i].reagent_channel)
+                             .arg(plan[i].sample_channel).arg(plan[i].aspirate ? QString("") : QString(" (废液缸，不抽液)")));
+    }
+
+    SetSpeed(WASH_SPEED, PUMP_IN_ID);
+    SetSpeed(WASH_SPEED, PUMP_OUT_ID);
+    for (int i = 0; i < plan.size(); ++i) {
+        const WashFlush& flush = plan[i];
+        emit SendMessage(QString("\n[冲洗 %1/%2] 试剂通道%3 -> 样品通道%4").arg(i + 1).arg(plan.size())
+                             .arg(flush.reagent_channel).arg(flush.sample_channel));
+        if (!beginStep(QString("冲洗 试剂通道%1 -> 样品通道%2").arg(flush.reagent_channel).arg(flush.sample_channel))) {
+            if (m_stopToken.IsCancelled()) break;
+            continue;
         }
-        
-    } else {
-        // 情况3: 试剂数量 > 样品数量
-        emit SendMessage(QString("=== 策略3: 试剂数量(%1) > 样品数量(%2) ===").arg(reagentCount).arg(sampleCount));
-        
-        // 首先按对应关系冲洗
-        for (int i = 0; i < sampleCount; i++) {
-            uint8_t reagentCh = reagentChannels[i];
-            uint8_t sampleCh = sampleChannels[i];
-            
-            emit SendMessage(QString("\n[冲洗] 试剂通道%1 -> 样品通道%2").arg(reagentCh).arg(sampleCh));
-            performWash(reagentCh, sampleCh, wasteChannel);
+
+        // 加液阀和样品阀切换；抽液阀空闲时一并预先切换，共用一次等待
+        bool moved = setValve(REAGENT_VALVE_ADDR, flush.reagent_channel, 0x01);
+        moved = setValve(SAMPLE_VALVE_ADDR, flush.sample_channel, 0x01) || moved;
+        if (flush.aspirate && !m_bgPump.active && !m_bgPump.pending) {
+            moved = setValve(0x00, flush.sample_channel, ASPIRATE_VALVE_ID) || moved;
         }
-        
-        // 剩余试剂通道都连接废液缸冲洗
-        for (int i = sampleCount; i < reagentCount; i++) {
-            uint8_t reagentCh = reagentChannels[i];
-            
-            emit SendMessage(QString("\n[冲洗] 试剂通道%1 -> 废液缸通道%2 (剩余试剂通道)").arg(reagentCh).arg(wasteChannel));
-            performWash(reagentCh, wasteChannel, wasteChannel);
+        if (moved && !stepWait(VALVE_SWITCH_DELAY_MS, TIME_VALVE)) continue;
+
+        TimedRotate(PUMP_IN_ID, false, WASH_DURATION_SEC * 1000);
+        if (stepCancelled()) continue;
+        emit SendMessage(QString("\n  > 加液完成"));
+
+        if (!flush.aspirate) {
+            emit SendMessage(QString("\n  > 跳过抽液（废液缸）"));
+            continue;
         }
+        // 等上一次的后台抽液结束后抽液阀才能切换到本样品
+        if (!waitBackgroundPump()) continue;
+        if (setValve(0x00, flush.sample_channel, ASPIRATE_VALVE_ID) && !stepWait(VALVE_SWITCH_DELAY_MS, TIME_VALVE)) continue;
+        emit SendMessage(QString("\n  > 开始后台抽液，同时进行下一次冲洗"));
+        startBackgroundPump(PUMP_OUT_ID, false, WASH_DURATION_SEC * 1000 + ASPIRATE_EXTRA_MS);
     }
+    waitBackgroundPump();
+    if (m_stopToken.IsCancelled()) return;
     
     emit SendMessage(QString("\n*** 初始化管路冲洗完成 ***"));
     emit SendMessage(QString("请现在更换为各通道的[实际试剂]"));
@@ -722,24 +1081,25 @@ void ULab::InitialWashPipelines()
 
 void ULab::performWash(uint8_t reagentChannel, uint8_t sampleChannel, uint8_t wasteChannel)
 {
+    if (!beginStep(QString("冲洗 试剂通道%1 -> 样品通道%2").arg(reagentChannel).arg(sampleChannel))) return;
+
     emit SendMessage(QString("\n  > 切换第一个阀到[试剂通道%1]").arg(reagentChannel));
     // 切换到试剂通道
     GotoChannel(REAGENT_VALVE_ADDR, reagentChannel, 0x01);
 
-    MSleep(50);
+    fixedDelay(50);
     
     emit SendMessage(QString("\n  > 第一个阀切换完成，开始切换第二个阀到[样品通道%1]").arg(sampleChannel));
     // 切换到样品通道
     GotoChannel(SAMPLE_VALVE_ADDR, sampleChannel, 0x01);
     
-    MSleep(VALVE_SWITCH_DELAY_MS);
+    if (!stepWait(VALVE_SWITCH_DELAY_MS, TIME_VALVE)) return;
     emit SendMessage(QString("\n  > 第二个阀切换完成"));
     
     // 启动加液泵进行冲洗
     SetSpeed(WASH_SPEED, PUMP_IN_ID);
-    Rotate(true, false, PUMP_IN_ID);
-    MSleepInterruptible(WASH_DURATION_SEC * 1000);  // 使用可中断的延时
-    Rotate(false, false, PUMP_IN_ID);
+    TimedRotate(PUMP_IN_ID, false, WASH_DURATION_SEC * 1000);
+    if (stepCancelled()) return;
     
     emit SendMessage(QString("\n  > 加液完成"));
     
@@ -748,15 +1108,13 @@ void ULab::performWash(uint8_t reagentChannel, uint8_t sampleChannel, uint8_t wa
         emit SendMessage(QString("\n  > 开始抽液（非废液缸）"));
         
         // 第三个切换阀切换到对应的样品通道
-        GotoChannel(0x00, sampleChannel, 0x08);
+        GotoChannel(0x00, sampleChannel, ASPIRATE_VALVE_ID);
 
-        MSleep(VALVE_SWITCH_DELAY_MS);
+        if (!stepWait(VALVE_SWITCH_DELAY_MS, TIME_VALVE)) return;
 
         // 启动抽液泵
         SetSpeed(WASH_SPEED, PUMP_OUT_ID);
-        Rotate(true, false, PUMP_OUT_ID);  // 抽液方向
-        MSleepInterruptible(WASH_DURATION_SEC * 1000 + 5000);  // 使用可中断的延时
-        Rotate(false, false, PUMP_OUT_ID);
+        TimedRotate(PUMP_OUT_ID, false, WASH_DURATION_SEC * 1000 + ASPIRATE_EXTRA_MS);  // 抽液方向
         
         emit SendMessage(QString("\n  > 抽液完成"));
     } else {
@@ -764,21 +1122,20 @@ void ULab::performWash(uint8_t reagentChannel, uint8_t sampleChannel, uint8_t wa
     }
     
     emit SendMessage(QString("\n  > 冲洗完成"));
-    MSleep(500); // 短暂间隔
+    fixedDelay(500); // 短暂间隔
 }
 
 void ULab::StopAllDevices()
 {
     emit SendMessage(QString("\n正在停止所有设备..."));
     
-    // 设置停止标志
-    m_shouldStop.storeRelaxed(1);
-    QCoreApplication::instance()->setProperty("shouldStop", true);
+    // 取消停止令牌，所有等待立即返回
+    m_stopToken.Cancel();
     
     // 立即停止所有蠕动泵
     Rotate(false, false, PUMP_IN_ID);   // 停止加液泵
 
-    MSleep(100);
+    MSleep(100, m_clock);
 
     Rotate(false, false, PUMP_OUT_ID);  // 停止抽液泵
 
@@ -792,10 +1149,10 @@ void ULab::StopAllDevices()
     //     }
     // }
 
-    MSleep(100);  // 这个间隔决定能否让蠕动泵停止转动！！！
+    MSleep(100, m_clock);  // 这个间隔决定能否让蠕动泵停止转动！！！
     
     // 清空剩余的待发送命令队列
-    wrtCmdList.clear();
+    clearCmdQueue();
     
     // 确保串口数据全部发送完成
     // if (pPort && pPort->isOpen()) {
@@ -818,31 +1175,29 @@ void ULab::WaitForUserInput(const QString& message)
     emit SendMessage(separator);
     emit SendMessage(QString("\n - 请输入："));
     
+    if (m_dryRun) {
+        // 操作员响应时间不计入估算
+        emit SendMessage(QString("干运行：跳过等待用户输入"));
+        m_clock->AddTimelineEvent(m_clock->NowNs(), 0, WaitNote(TIME_SLEEP, "等待用户确认(不计时)"), false);
+        return;
+    }
+
     m_waitingForInput = true;
     m_userInput.clear();
+    m_skipToken.Reset();
     
-    // 创建事件循环等待用户输入
+    // 创建事件循环等待用户输入，确认输入或停止令牌取消时立即退出
     QEventLoop loop;
-    QTimer timer;
-    timer.setSingleShot(false);
-    timer.setInterval(1000); // 每秒检查一次
-    
-    connect(&timer, &QTimer::timeout, [&]() {
-        if (!m_waitingForInput) {
-            loop.quit();
-        }
-        // 检查停止标志
-        if (m_shouldStop.loadRelaxed()) {
-            emit SendMessage(QString("检测到停止信号，取消等待用户输入"));
-            m_waitingForInput = false;
-            loop.quit();
-        }
-    });
-    
-    timer.start();
-    loop.exec();
-    timer.stop();
-    
+    connect(this, &ULab::UserInputAccepted, &loop, &QEventLoop::quit);
+    connect(&m_stopToken, &CancelToken::cancelled, &loop, &QEventLoop::quit);
+    connect(&m_skipToken, &CancelToken::cancelled, &loop, &QEventLoop::quit);
+    if (m_waitingForInput && !m_stopToken.IsCancelled()) {
+        m_clock->Wait(loop, -1);
+    }
+    if (m_stopToken.IsCancelled()) {
+        emit SendMessage(QString("检测到停止信号，取消等待用户输入"));
+    }
+    m_waitingForInput = false;
 }
 
 void ULab::onUserInputReceived(QString input)
@@ -869,6 +1224,32 @@ void ULab::onUserInputReceived(QString input)
         return;
     }
 
+    // 运行控制命令全局有效
+    if (cleanInput == "pause" || cleanInput == "p") {
+        PauseRun();
+        return;
+    }
+    if (cleanInput == "resume" || cleanInput == "r") {
+        ResumeRun();
+        return;
+    }
+    if (cleanInput == "skip" || cleanInput == "s") {
+        SkipStep();
+        return;
+    }
+    if (cleanInput == "abort" || cleanInput == "a") {
+        AbortRun();
+        return;
+    }
+    if (cleanInput == "status") {
+        emit SendMessage(RunStatus());
+        return;
+    }
+    if (cleanInput == "latency") {
+        emit SendMessage(LatencyReport());
+        return;
+    }
+
     // 只有在等待输入状态下才处理continue命令
     if (!m_waitingForInput) {
         //emit SendMessage(QString("调试：当前不在等待输入状态，除quit外的命令被忽略"));
@@ -878,6 +1259,7 @@ void ULab::onUserInputReceived(QString input)
     if (cleanInput == "continue" || cleanInput == "c") {
         emit SendMessage(QString("收到继续指令，程序继续执行"));
         m_waitingForInput = false;
+        emit UserInputAccepted();
     } else {
         emit SendMessage(QString("无效输入 '%1'，请输入:").arg(input));
         emit SendMessage(QString("  - 'continue' 或 'c' 继续"));
@@ -885,5 +1267,1034 @@ void ULab::onUserInputReceived(QString input)
     }
 }
 
+// ******************************************************************************
+
+// ******************************* 冲洗计划 *************************************
+
+// 阀行程：旋转阀按通道号差计
+static int valveTravel(uint8_t from, uint8_t to)
+{
+    return qAbs(int(from) - int(to));
+}
+
+// 最少冲洗集合：每次冲洗覆盖一条试剂管路和一条样品管路，次数为max(试剂数, 样品数)。
+// 非废液缸样品与试剂一一配对(需要抽液)，多出的样品复用试剂，多出的试剂冲向废液缸(不抽液)，
+// 废液缸管路至少冲洗一次。再从当前阀位出发按最近邻排序，减少两个阀的总行程。
+// 重复的通道只冲洗一次
+QVector<WashFlush> ULab::planInitialWash(const QList<uint8_t>& reagentList, const QList<uint8_t>& samples, uint8_t waste)
+{
+    QVector<WashFlush> flushes;
+    if (reagentList.isEmpty() || samples.isEmpty()) {
+        return flushes;
+    }
+    QList<uint8_t> reagents;
+    for (uint8_t ch : reagentList) {
+        if (!reagents.contains(ch)) {
+            reagents << ch;
+        }
+    }
+    QList<uint8_t> targets;
+    for (uint8_t ch : samples) {
+        if (ch != waste && !targets.contains(ch)) {
+            targets << ch;
+        }
+    }
+    int paired = qMin(reagents.size(), targets.size());
+    for (int i = 0; i < targets.size(); ++i) {
+        flushes.append({reagents[qMin(i, paired - 1)], targets[i], true});
+    }
+    for (int i = paired; i < reagents.size(); ++i) {
+        flushes.append({reagents[i], waste, false});
+    }
+    if (paired == reagents.size()) {
+        flushes.append({reagents.last(), waste, false});
+    }
+
+    // 最近邻排序，起点为当前阀位(未知时按通道1)
+    uint8_t curReagent = m_valveState.value((0x01 << 8) | REAGENT_VALVE_ADDR, 1);
+    uint8_t curSample = m_valveState.value((0x01 << 8) | SAMPLE_VALVE_ADDR, 1);
+    QVector<WashFlush> ordered;
+    int naiveTravel = 0, plannedTravel = 0;
+    for (int i = 0; i < flushes.size(); ++i) {
+        naiveTravel += valveTravel(i ? flushes[i - 1].reagent_channel : curReagent, flushes[i].reagent_channel)
+                     + valveTravel(i ? flushes[i - 1].sample_channel : curSample, flushes[i].sample_channel);
+    }
+    while (!flushes.isEmpty()) {
+        int best = 0, bestCost = INT_MAX;
+        for (int i = 0; i < flushes.size(); ++i) {
+            int cost = valveTravel(curReagent, flushes[i].reagent_channel) + valveTravel(curSample, flushes[i].sample_channel);
+            if (cost < bestCost) {
+                best = i;
+                bestCost = cost;
+            }
+        }
+        plannedTravel += bestCost;
+        curReagent = flushes[best].reagent_channel;
+        curSample = flushes[best].sample_channel;
+        ordered.append(flushes.takeAt(best));
+    }
+    emit SendMessage(QString("阀总行程: %1 个通道 (按配对顺序为 %2)").arg(plannedTravel).arg(naiveTravel));
+    return ordered;
+}
+
+// 阀已在目标通道时不下发指令，返回是否发生了切换(需要等待到位)
+bool ULab::setValve(uint8_t addr, uint8_t channel, uint8_t id)
+{
+    auto it = m_valveState.constFind((id << 8) | addr);
+    if (it != m_valveState.constEnd() && it.value() == channel) {
+        return false;
+    }
+    GotoChannel(addr, channel, id);
+    return true;
+}
+
+// 后台泵：启动后立即返回，到时由时钟任务写停止指令，前台可继续切换阀和加液
+void ULab::startBackgroundPump(uint8_t id, bool direction, uint on_ms)
+{
+    if (!WaitCmdQueueDrained()) {
+        return;
+    }
+    m_bgPump.id = id;
+    m_bgPump.startFrame = GenCMD(0x0A, id, !direction ? 0x01 : 0x00, 0x01);
+    m_bgPump.stopFrame = GenCMD(0x0A, id, !direction ? 0x01 : 0x00, 0x02);
+    runBackgroundPump(modelPumpMs(on_ms));
+}
+
+void ULab::runBackgroundPump(qint64 on_ms)
+{
+    m_bgPump.pending = false;
+    m_bgPump.remaining_ms = on_ms;
+    m_bgPump.startNs = WriteFrameNow(m_bgPump.startFrame);
+    m_bgPump.active = true;
+    m_bgPump.task = m_clock->StartPeriodic(on_ms, [this]() { stopBackgroundPump(false); });
+    emit SendMessage(QString("Peristaltic pump (ID:%1) start to rotate in background for %2 ms").arg(m_bgPump.id).arg(on_ms));
+}
+
+// pause为true时记录剩余时长，继续后补齐
+void ULab::stopBackgroundPump(bool pause)
+{
+    if (!m_bgPump.active) {
+        m_bgPump.pending = m_bgPump.pending && !m_stopToken.IsCancelled();
+        return;
+    }
+    m_clock->StopPeriodic(m_bgPump.task);
+    // 刚写过指令时WriteFrameNow推迟到满CMD_INTERVAL再写，多抽片刻不影响结果
+    qint64 stopNs = WriteFrameNow(m_bgPump.stopFrame);
+    qint64 ranMs = (stopNs - m_bgPump.startNs) / 1000000;
+    m_clock->AddTimelineEvent(m_bgPump.startNs, ranMs, WaitNote(TIME_PUMP, QString("蠕动泵(ID:%1)后台运行").arg(m_bgPump.id),
+                              m_bgPump.id == PUMP_OUT_ID ? RES_PUMP_OUT : RES_PUMP_IN), true);
+    m_bgPump.active = false;
+    m_bgPump.pending = pause && !m_stopToken.IsCancelled() && ranMs < m_bgPump.remaining_ms;
+    m_bgPump.remaining_ms = qMax<qint64>(0, m_bgPump.remaining_ms - ranMs);
+    emit SendMessage(QString("Peristaltic pump (ID:%1) background run %2, on-time %3 ms")
+                         .arg(m_bgPump.id).arg(m_bgPump.pending ? "paused" : "stopped").arg(ranMs));
+    if (!m_bgPump.pending) {
+        emit BackgroundPumpDone();
+    }
+}
+
+// 等待后台泵结束，暂停期间一并等待；中止时返回false
+bool ULab::waitBackgroundPump()
+{
+    while ((m_bgPump.active || m_bgPump.pending) && !m_stopToken.IsCancelled()) {
+        if (m_paused) {
+            QEventLoop loop;
+            connect(this, &ULab::RunResumed, &loop, &QEventLoop::quit);
+            connect(&m_stopToken, &CancelToken::cancelled, &loop, &QEventLoop::quit);
+            m_clock->Wait(loop, -1, WaitNote(TIME_SLEEP, "暂停"));
+            continue;
+        }
+        QEventLoop loop;
+        connect(this, &ULab::BackgroundPumpDone, &loop, &QEventLoop::quit);
+        connect(this, &ULab::RunPaused, &loop, &QEventLoop::quit);
+        connect(&m_stopToken, &CancelToken::cancelled, &loop, &QEventLoop::quit);
+        m_clock->Wait(loop, -1, WaitNote(TIME_PUMP, "等待后台抽液完成"));
+    }
+    return !m_stopToken.IsCancelled();
+}
 
 // ******************************************************************************
+
+// ******************************* 运行控制 *************************************
+
+void ULab::PauseRun()
+{
+    if (m_stopToken.IsCancelled() || m_paused) {
+        emit SendMessage(RunStatus());
+        return;
+    }
+    m_paused = true;
+    emit SendMessage(QString("\n运行已暂停 (当前步骤: %1)，泵已停止、阀位保持；输入 'resume' 或 'r' 继续").arg(m_currentStep));
+    if (m_bgPump.active) {
+        stopBackgroundPump(true);
+    }
+    emit RunPaused();
+}
+
+void ULab::ResumeRun()
+{
+    if (!m_paused) {
+        emit SendMessage(RunStatus());
+        return;
+    }
+    m_paused = false;
+    emit SendMessage(QString("\n运行继续 (当前步骤: %1)").arg(m_currentStep));
+    if (m_bgPump.pending) {
+        runBackgroundPump(m_bgPump.remaining_ms);
+    }
+    emit RunResumed();
+}
+
+void ULab::SkipStep()
+{
+    if (m_stopToken.IsCancelled()) {
+        emit SendMessage(RunStatus());
+        return;
+    }
+    emit SendMessage(QString("\n跳过当前步骤: %1").arg(m_currentStep));
+    m_skipToken.Cancel();
+}
+
+// 中止到安全状态：停泵并取消所有等待，但不退出程序，已完成的步骤和日志保留
+void ULab::AbortRun()
+{
+    if (m_stopToken.IsCancelled()) {
+        emit SendMessage(RunStatus());
+        return;
+    }
+    emit SendMessage(QString("\n中止运行 (当前步骤: %1)，剩余步骤将全部跳过").arg(m_currentStep));
+    m_paused = false;
+    StopAllDevices();
+    emit SendMessage(QString("运行已中止，设备处于安全状态；输入 'q' 退出程序"));
+}
+
+QString ULab::RunStatus() const
+{
+    QString state = m_stopToken.IsCancelled() ? "已中止" : (m_paused ? "已暂停" : "运行中");
+    return QString("运行状态: %1，当前步骤: %2").arg(state, m_currentStep.isEmpty() ? QString("无") : m_currentStep);
+}
+
+bool ULab::beginStep(const QString& name)
+{
+    if (m_stopToken.IsCancelled()) {
+        emit SendMessage(QString("\n运行已中止，跳过步骤: %1").arg(name));
+        return false;
+    }
+    m_skipToken.Reset();
+    m_currentStep = name;
+    if (m_paused) {
+        emit SendMessage(QString("\n运行已暂停，继续后开始步骤: %1").arg(name));
+    }
+    return waitWhilePaused();
+}
+
+bool ULab::stepCancelled() const
+{
+    return m_stopToken.IsCancelled() || m_skipToken.IsCancelled();
+}
+
+bool ULab::waitWhilePaused()
+{
+    if (m_paused && !stepCancelled()) {
+        QEventLoop loop;
+        connect(this, &ULab::RunResumed, &loop, &QEventLoop::quit);
+        connect(&m_stopToken, &CancelToken::cancelled, &loop, &QEventLoop::quit);
+        connect(&m_skipToken, &CancelToken::cancelled, &loop, &QEventLoop::quit);
+        m_clock->Wait(loop, -1, WaitNote(TIME_SLEEP, "暂停"));
+    }
+    return !stepCancelled();
+}
+
+// 阀切换和间隔等待：暂停期间冻结剩余时长，继续后补齐
+bool ULab::stepWait(uint msec, TIME_CATEGORY category)
+{
+    WaitNote note(category);
+    qint64 remainingMs = msec;
+    if (category == TIME_VALVE) {
+        note = WaitNote(category, "切换阀到位等待", m_pendingValves);
+        m_pendingValves = 0;
+        remainingMs = modelValveMs(msec);
+    }
+    while (remainingMs > 0) {
+        if (!waitWhilePaused()) {
+            return false;
+        }
+        qint64 startNs = m_clock->NowNs();
+        QEventLoop loop;
+        connect(&m_stopToken, &CancelToken::cancelled, &loop, &QEventLoop::quit);
+        connect(&m_skipToken, &CancelToken::cancelled, &loop, &QEventLoop::quit);
+        connect(this, &ULab::RunPaused, &loop, &QEventLoop::quit);
+        m_clock->Wait(loop, remainingMs, note);
+        remainingMs -= (m_clock->NowNs() - startNs) / 1000000;
+    }
+    return !stepCancelled();
+}
+
+
+// ******************************************************************************
+
+// ******************************* 指令延时统计 *********************************
+
+static int latencyBucketIndex(qint64 us)
+{
+    if (us < LATENCY_SUB_BUCKETS) {
+        return us < 0 ? 0 : (int)us;
+    }
+    int msb = 0;
+    while ((us >> (msb + 1)) != 0) {
+        ++msb;
+    }
+    int shift = msb - LATENCY_SUB_BUCKET_BITS;
+    return LATENCY_SUB_BUCKETS * (shift + 1) + (int)((us >> shift) - LATENCY_SUB_BUCKETS);
+}
+
+static qint64 latencyBucketUpper(int index)
+{
+    if (index < LATENCY_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / LATENCY_SUB_BUCKETS - 1;
+    qint64 lower = (qint64)(LATENCY_SUB_BUCKETS + index % LATENCY_SUB_BUCKETS) << shift;
+    return lower + ((qint64)1 << shift) - 1;
+}
+
+void LatencyHistogram::Record(qint64 us)
+{
+    us = qMax<qint64>(0, us);
+    int index = latencyBucketIndex(us);
+    if (index >= buckets.size()) {
+        buckets.resize(index + 1);
+    }
+    buckets[index]++;
+    min_us = count == 0 ? us : qMin(min_us, us);
+    max_us = count == 0 ? us : qMax(max_us, us);
+    sum_us += us;
+    count++;
+}
+
+qint64 LatencyHistogram::Percentile(double p) const
+{
+    if (count == 0) {
+        return 0;
+    }
+    quint64 target = qMax<quint64>(1, (quint64)qCeil(p / 100.0 * count));
+    quint64 seen = 0;
+    for (int i = 0; i < buckets.size(); ++i) {
+        seen += buckets[i];
+        if (seen >= target) {
+            return qMin(latencyBucketUpper(i), max_us);
+        }
+    }
+    return max_us;
+}
+
+QString LatencyHistogram::Summary() const
+{
+    if (count == 0) {
+        return QString("无数据");
+    }
+    return QString("n=%1  p50=%2  p90=%3  p99=%4  max=%5 ms").arg(count)
+        .arg(Percentile(50) / 1000.0, 0, 'f', 1).arg(Percentile(90) / 1000.0, 0, 'f', 1)
+        .arg(Percentile(99) / 1000.0, 0, 'f', 1).arg(max_us / 1000.0, 0, 'f', 1);
+}
+
+static QString deviceName(uint8_t code)
+{
+    switch (code) {
+    case PIPET_CODE: return "移液器";
+    case LOW_STAGE_CODE: return "低精度位移台";
+    case HIGH_STAGE_CODE: return "高精度位移台";
+    case PUMP_CODE: return "气泵";
+    default: return QString("设备%1").arg(code);
+    }
+}
+
+QString ULab::LatencyReport() const
+{
+    QStringList lines;
+    lines << QString("\n================ 指令延时统计 ================");
+    lines << QString("排队: 入队->写串口 (发送节拍 CMD_INTERVAL=%1 ms)").arg(CMD_INTERVAL);
+    lines << QString("响应: 写串口->解析到回复 (含解析节拍 PARSE_INTERVAL=%1 ms)").arg(PARSE_INTERVAL);
+    lines << QString("分发: 解析到回复->信号处理完毕");
+
+    QList<quint16> keys = m_latency.keys();
+    std::sort(keys.begin(), keys.end());
+    qint64 queueSum = 0, responseSum = 0;
+    quint64 queueCount = 0, responseCount = 0;
+    for (quint16 key : keys) {
+        const CommandLatency& latency = m_latency[key];
+        lines << QString("\n%1 指令0x%2").arg(deviceName(key >> 8))
+                 .arg(key & 0xff, 2, 16, QChar('0'));
+        lines << QString("  排队  %1").arg(latency.queueWait.Summary());
+        if (latency.response.count > 0 || latency.unmatched > 0) {
+            lines << QString("  响应  %1").arg(latency.response.Summary());
+            lines << QString("  分发  %1").arg(latency.dispatch.Summary());
+        } else {
+            lines << QString("  响应  无回复");
+        }
+        if (latency.unanswered > 0 || latency.unmatched > 0) {
+            lines << QString("  丢弃未回复写入 %1 次，无法匹配的回复 %2 次").arg(latency.unanswered).arg(latency.unmatched);
+        }
+        queueSum += latency.queueWait.sum_us;
+        queueCount += latency.queueWait.count;
+        responseSum += latency.response.sum_us;
+        responseCount += latency.response.count;
+    }
+    if (keys.isEmpty()) {
+        lines << QString("尚无指令记录");
+    }
+    if (queueCount > 0) {
+        double queueMs = queueSum / 1000.0 / queueCount;
+        lines << QString("\n平均排队 %1 ms，约 %2 个发送节拍").arg(queueMs, 0, 'f', 1)
+                 .arg(queueMs / CMD_INTERVAL, 0, 'f', 2);
+    }
+    if (responseCount > 0) {
+        lines << QString("平均响应 %1 ms").arg(responseSum / 1000.0 / responseCount, 0, 'f', 1);
+    }
+    return lines.join("\n");
+}
+
+void ULab::ResetLatencyStats()
+{
+    m_latency.clear();
+    m_inFlight.clear();
+}
+
+// ******************************************************************************
+
+// ******************************* 断点续跑 *************************************
+
+ProtocolStep StepInitialWash()
+{
+    return {STEP_INITIAL_WASH, QString(), 0.0, MEDIUM, QString(), 0};
+}
+
+ProtocolStep StepAddLiquid(const QString& reagent_name, double volume_ul, FluidSpeed speed, const QString& sample_name, uint delay_sec)
+{
+    return {STEP_ADD_LIQUID, reagent_name, volume_ul, speed, sample_name, delay_sec};
+}
+
+ProtocolStep StepWashPipeline(const QString& reagent_name, const QString& sample_name)
+{
+    return {STEP_WASH_PIPELINE, reagent_name, 0.0, MEDIUM, sample_name, 0};
+}
+
+ProtocolStep StepWait(uint delay_sec)
+{
+    return {STEP_WAIT, QString(), 0.0, MEDIUM, QString(), delay_sec};
+}
+
+QString ProtocolStepName(const ProtocolStep& step)
+{
+    switch (step.type) {
+    case STEP_INITIAL_WASH:
+        return QString("初始化管路冲洗");
+    case STEP_ADD_LIQUID:
+        return QString("AddLiquid(%1, %2uL, %3, %4, %5s)").arg(step.reagent_name).arg(step.volume_ul)
+                .arg(step.speed == SLOW ? "SLOW" : (step.speed == MEDIUM ? "MEDIUM" : "FAST"))
+                .arg(step.sample_name).arg(step.delay_sec);
+    case STEP_WASH_PIPELINE:
+        return QString("WashPipeline(%1, %2)").arg(step.reagent_name, step.sample_name);
+    case STEP_WAIT:
+        return QString("Wait(%1s)").arg(step.delay_sec);
+    }
+    return QString();
+}
+
+// 流程编译：运行前把所有试剂/样品名称解析为阀通道并计算泵时长，任何一步无效则整个流程被拒绝，
+// 避免运行几十分钟后才发现某个试剂未配置而静默少做一步
+bool ULab::CompileProtocol(const QList<ProtocolStep>& steps, CompiledProtocol* compiled)
+{
+    compiled->steps.clear();
+    compiled->steps.reserve(steps.size());
+    compiled->names.clear();
+    QStringList errors;
+
+    // 名称表：同名只存一份，步骤中保存下标
+    QHash<QString, int> nameIndex;
+    auto intern = [&](const QString& name) {
+        auto it = nameIndex.constFind(name);
+        if (it != nameIndex.constEnd()) {
+            return it.value();
+        }
+        compiled->names.append(name);
+        nameIndex.insert(name, compiled->names.size() - 1);
+        return compiled->names.size() - 1;
+    };
+
+    QByteArray signature;
+    for (int i = 0; i < steps.size(); ++i) {
+        const ProtocolStep& step = steps[i];
+        signature.append(ProtocolStepName(step).toUtf8()).append('\n');
+        QString where = QString("第%1步 %2").arg(i + 1).arg(ProtocolStepName(step));
+
+        CompiledStep out = {step.type, 0, 0, 0, 0, step.volume_ul, step.speed, 0.0, 0, 0, 0};
+        if (step.type == STEP_INITIAL_WASH) {
+            if (m_reagentConfigs.isEmpty() || m_sampleConfigs.isEmpty()) {
+                errors << QString("%1: 初始化冲洗至少需要配置一种试剂和一个样品").arg(where);
+            }
+            // 初始化冲洗覆盖所有已配置的通道，映射改变时指纹随之改变
+            for (auto it = m_reagentConfigs.constBegin(); it != m_reagentConfigs.constEnd(); ++it) {
+                signature.append(QString("R %1=%2\n").arg(it.key()).arg(it.value().valve_channel).toUtf8());
+            }
+            for (auto it = m_sampleConfigs.constBegin(); it != m_sampleConfigs.constEnd(); ++it) {
+                signature.append(QString("S %1=%2\n").arg(it.key()).arg(it.value().valve_channel).toUtf8());
+            }
+            compiled->steps.append(out);
+            continue;
+        }
+        if (step.type == STEP_WAIT) {
+            out.delay_ms = step.delay_sec * 1000;
+            compiled->steps.append(out);
+            continue;
+        }
+
+        auto reagent = m_reagentConfigs.constFind(step.reagent_name);
+        if (reagent == m_reagentConfigs.constEnd()) {
+            errors << QString("%1: 试剂 [%2] 未在配置中找到").arg(where, step.reagent_name);
+        } else if (reagent.value().valve_channel == 0) {
+            errors << QString("%1: 试剂 [%2] 的阀通道无效").arg(where, step.reagent_name);
+        } else {
+            out.reagent_channel = reagent.value().valve_channel;
+        }
+        auto sample = m_sampleConfigs.constFind(step.sample_name);
+        if (sample == m_sampleConfigs.constEnd()) {
+            errors << QString("%1: 样品 [%2] 未在配置中找到").arg(where, step.sample_name);
+        } else if (sample.value().valve_channel == 0) {
+            errors << QString("%1: 样品 [%2] 的阀通道无效").arg(where, step.sample_name);
+        } else {
+            out.sample_channel = sample.value().valve_channel;
+        }
+        out.reagent_name = intern(step.reagent_name);
+        out.sample_name = intern(step.sample_name);
+        signature.append(QString("-> %1/%2\n").arg(out.reagent_channel).arg(out.sample_channel).toUtf8());
+
+        if (step.type == STEP_ADD_LIQUID) {
+            // 根据速度枚举转换为实际流速值 (uL/s)
+            switch (step.speed) {
+                case SLOW:   out.flow_speed = 50.0;  break;  // 慢速：50 uL/s
+                case MEDIUM: out.flow_speed = 100.0; break;  // 中速：100 uL/s
+                case FAST:   out.flow_speed = 150.0; break;  // 快速：150 uL/s
+            }
+            if (out.flow_speed <= 0) {
+                errors << QString("%1: 流速输入有误，无法计算时长").arg(where);
+            }
+            if (step.volume_ul <= 0) {
+                errors << QString("%1: 加液体积必须大于0").arg(where);
+            }
+            if (out.flow_speed > 0) {
+                out.pump_ms = static_cast<uint>((step.volume_ul + DEAD_VOLUME) / out.flow_speed * 1000.0);
+                out.aspirate_ms = out.pump_ms + ASPIRATE_EXTRA_MS;
+            }
+            out.delay_ms = step.delay_sec * 1000;
+        } else {
+            out.flow_speed = WASH_SPEED;
+            out.pump_ms = WASH_DURATION_SEC * 1000;
+        }
+        compiled->steps.append(out);
+    }
+
+    // 流程指纹：步骤内容或试剂/样品的阀通道映射改变后旧断点自动失效，避免续跑到错误的步骤或通道。
+    // 续跑默认开启，用SHA-256而不是16位校验和，修改后的流程不会因碰撞续跑到旧断点
+    compiled->id = QString::fromLatin1(QCryptographicHash::hash(signature, QCryptographicHash::Sha256).toHex());
+
+    if (!errors.isEmpty()) {
+        emit SendMessage(QString("\n错误：实验流程校验失败，共 %1 处问题，流程未执行：").arg(errors.size()));
+        for (const QString& e : errors) {
+            emit SendMessage(QString("  - ") + e);
+        }
+        compiled->steps.clear();
+        return false;
+    }
+    return true;
+}
+
+bool ULab::RunProtocol(const QList<ProtocolStep>& steps, bool resume)
+{
+    CompiledProtocol compiled;
+    if (!CompileProtocol(steps, &compiled)) {
+        return false;
+    }
+
+    // 干运行不读写断点文件
+    int first = (resume && !m_dryRun) ? loadCheckpoint(compiled.id) : 0;
+    if (m_dryRun) {
+        m_pendingValves = 0;
+        m_valveState.clear();           // 每次干运行都从未知阀位开始
+        clearCmdQueue();
+        m_clock->StartTimeline();
+        m_timelineSteps.clear();
+        for (const ProtocolStep& step : steps) {
+            m_timelineSteps << ProtocolStepName(step);
+        }
+    }
+    if (first > 0) {
+        emit SendMessage(QString("\n从断点续跑：已完成 %1/%2 步，从第 %3 步 [%4] 开始")
+                             .arg(first).arg(steps.size()).arg(first + 1)
+                             .arg(first < steps.size() ? ProtocolStepName(steps[first]) : QString("无")));
+    }
+
+    for (int i = first; i < compiled.steps.size(); ++i) {
+        const CompiledStep& step = compiled.steps[i];
+        m_clock->SetTimelineStep(i);
+        emit SendMessage(QString("\n[步骤 %1/%2] %3").arg(i + 1).arg(steps.size()).arg(ProtocolStepName(steps[i])));
+        switch (step.type) {
+        case STEP_INITIAL_WASH:
+            InitialWashPipelines();
+            break;
+        case STEP_ADD_LIQUID:
+            executeAddLiquid(step, compiled.names);
+            break;
+        case STEP_WASH_PIPELINE:
+            executeWashPipeline(step, compiled.names);
+            break;
+        case STEP_WAIT:
+            executeWait(step);
+            break;
+        }
+
+        // 中止的步骤不算完成，下次从该步骤重新开始；跳过的步骤视为操作员确认完成
+        if (m_stopToken.IsCancelled()) {
+            emit SendMessage(QString("\n运行在第 %1 步中止，断点保留在已完成的 %2 步").arg(i + 1).arg(i));
+            return false;
+        }
+        if (!m_dryRun) {
+            saveCheckpoint(compiled.id, i + 1);
+        }
+    }
+
+    if (!m_dryRun) {
+        ClearCheckpoint();
+    }
+    return true;
+}
+
+void ULab::ClearCheckpoint()
+{
+    QString path = QCoreApplication::applicationDirPath() + "/" + CHECKPOINT_FILE;
+    if (QFile::exists(path)) {
+        QFile::remove(path);
+    }
+}
+
+// QSaveFile先写临时文件，commit时fsync后再重命名覆盖，断电或崩溃时磁盘上要么是旧断点要么是新断点
+bool ULab::saveCheckpoint(const QString& protocolId, int nextStep)
+{
+    QJsonArray valves;
+    for (auto it = m_valveState.constBegin(); it != m_valveState.constEnd(); ++it) {
+        QJsonObject valve;
+        valve["id"] = it.key() >> 8;
+        valve["addr"] = it.key() & 0xFF;
+        valve["channel"] = it.value();
+        valves.append(valve);
+    }
+    QJsonObject root;
+    root["protocol"] = protocolId;
+    root["next_step"] = nextStep;
+    root["valves"] = valves;
+
+    QSaveFile file(QCoreApplication::applicationDirPath() + "/" + CHECKPOINT_FILE);
+    if (!file.open(QIODevice::WriteOnly)) {
+        emit SendMessage(QString("断点写入失败: %1").arg(file.errorString()));
+        return false;
+    }
+    file.write(QJsonDocument(root).toJson(QJsonDocument::Compact));
+    if (!file.commit()) {
+        emit SendMessage(QString("断点写入失败: %1").arg(file.errorString()));
+        return false;
+    }
+    return true;
+}
+
+// 读取断点并恢复阀位；流程指纹不一致或文件损坏时从头开始
+int ULab::loadCheckpoint(const QString& protocolId)
+{
+    QFile file(QCoreApplication::applicationDirPath() + "/" + CHECKPOINT_FILE);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return 0;
+    }
+    QJsonDocument doc = QJsonDocument::fromJson(file.readAll());
+    if (!doc.isObject()) {
+        emit SendMessage(QString("断点文件损坏，从头开始"));
+        return 0;
+    }
+    QJsonObject root = doc.object();
+    if (root["protocol"].toString() != protocolId) {
+        emit SendMessage(QString("实验流程已修改，忽略旧断点，从头开始"));
+        return 0;
+    }
+
+    // 阀门断电后保持位置，控制器复位后可能回到初始通道，续跑前按断点重新下发一次
+    for (const QJsonValue& v : root["valves"].toArray()) {
+        QJsonObject valve = v.toObject();
+        GotoChannel(valve["addr"].toInt(), valve["channel"].toInt(), valve["id"].toInt());
+    }
+    return qMax(0, root["next_step"].toInt());
+}
+
+
+// ******************************************************************************
+
+// ******************************* 协议文件 *************************************
+
+// 协议文件格式 (JSON):
+// {
+//   "reagents": { "PBS": 1, "固定液": 2 },                 试剂名称 -> 试剂阀通道
+//   "samples":  { "废液缸": 1, "样品1": 2 },                样品名称 -> 样品阀通道
+//   "steps": [
+//     { "action": "InitialWash" },
+//     { "action": "AddLiquid", "reagent": "PBS", "volume_ul": 200, "speed": "MEDIUM", "sample": "样品1", "delay_sec": 1 },
+//     { "action": "WashPipeline", "reagent": "PBS", "sample": "废液缸" },
+//     { "action": "Wait", "seconds": 600 }
+//   ]
+// }
+// 文件通过 QFile::map 映射后直接解析，不做额外拷贝
+
+static bool readChannelMap(const QJsonObject& root, const QString& key, QMap<QString, uint8_t>* out, QStringList* errors)
+{
+    if (!root.contains(key)) {
+        errors->append(QString("缺少 \"%1\"").arg(key));
+        return false;
+    }
+    if (!root[key].isObject()) {
+        errors->append(QString("\"%1\" 必须是 名称->通道号 的对象").arg(key));
+        return false;
+    }
+    QJsonObject map = root[key].toObject();
+    for (auto it = map.constBegin(); it != map.constEnd(); ++it) {
+        int channel = it.value().toInt(-1);
+        if (!it.value().isDouble() || channel < 1 || channel > 255) {
+            errors->append(QString("\"%1\" 中 [%2] 的通道号无效").arg(key, it.key()));
+            continue;
+        }
+        out->insert(it.key(), static_cast<uint8_t>(channel));
+    }
+    return true;
+}
+
+bool LoadProtocolFile(const QString& path, ProtocolFile* protocol, QStringList* errors)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        errors->append(QString("无法打开协议文件 %1: %2").arg(path, file.errorString()));
+        return false;
+    }
+
+    // 映射失败(如空文件或特殊文件系统)时退回到一次性读取
+    qint64 size = file.size();
+    uchar* mapped = size > 0 ? file.map(0, size) : nullptr;
+    QByteArray content = mapped ? QByteArray::fromRawData(reinterpret_cast<const char*>(mapped), static_cast<int>(size))
+                                : file.readAll();
+    QJsonParseError parseError;
+    QJsonDocument doc = QJsonDocument::fromJson(content, &parseError);
+    if (doc.isNull()) {
+        int line = 1 + content.left(parseError.offset).count('\n');
+        errors->append(QString("协议文件第 %1 行解析失败: %2").arg(line).arg(parseError.errorString()));
+    }
+    if (mapped) {
+        file.unmap(mapped);
+    }
+    if (doc.isNull()) {
+        return false;
+    }
+    if (!doc.isObject()) {
+        errors->append(QString("协议文件顶层必须是对象"));
+        return false;
+    }
+
+    QJsonObject root = doc.object();
+    // 本程序只控制切换阀和蠕动泵，含位移台内容的协议需要在带位移台的程序中运行
+    for (const QString& key : {QString("plates"), QString("plate_map"), QString("stage")}) {
+        if (root.contains(key)) {
+            errors->append(QString("\"%1\": 免疫荧光程序没有位移台控制，不支持板位/位移台配置").arg(key));
+        }
+    }
+
+    QMap<QString, uint8_t> reagents, samples;
+    readChannelMap(root, "reagents", &reagents, errors);
+    readChannelMap(root, "samples", &samples, errors);
+    for (auto it = reagents.constBegin(); it != reagents.constEnd(); ++it) {
+        protocol->reagents[it.key()] = {it.key(), it.value()};
+    }
+    for (auto it = samples.constBegin(); it != samples.constEnd(); ++it) {
+        protocol->samples[it.key()] = {it.key(), it.value()};
+    }
+
+    if (!root["steps"].isArray()) {
+        errors->append(QString("缺少 \"steps\" 数组"));
+        return false;
+    }
+    QJsonArray steps = root["steps"].toArray();
+    for (int i = 0; i < steps.size(); ++i) {
+        QJsonObject step = steps[i].toObject();
+        QString action = step["action"].toString();
+        QString where = QString("steps[%1] (%2)").arg(i).arg(action.isEmpty() ? QString("无action") : action);
+
+        if (action == "InitialWash") {
+            protocol->steps << StepInitialWash();
+        } else if (action == "AddLiquid") {
+            QString speedName = step["speed"].toString("MEDIUM").toUpper();
+            FluidSpeed speed = MEDIUM;
+            if (speedName == "SLOW") {
+                speed = SLOW;
+            } else if (speedName == "FAST") {
+                speed = FAST;
+            } else if (speedName != "MEDIUM") {
+                errors->append(QString("%1: speed 只能是 SLOW/MEDIUM/FAST").arg(where));
+            }
+            if (!step["reagent"].isString() || !step["sample"].isString() || !step["volume_ul"].isDouble()) {
+                errors->append(QString("%1: 需要 reagent、sample 和 volume_ul").arg(where));
+                continue;
+            }
+            protocol->steps << StepAddLiquid(step["reagent"].toString(), step["volume_ul"].toDouble(), speed,
+                                             step["sample"].toString(), static_cast<uint>(qMax(0, step["delay_sec"].toInt(1))));
+        } else if (action == "WashPipeline") {
+            if (!step["reagent"].isString() || !step["sample"].isString()) {
+                errors->append(QString("%1: 需要 reagent 和 sample").arg(where));
+                continue;
+            }
+            protocol->steps << StepWashPipeline(step["reagent"].toString(), step["sample"].toString());
+        } else if (action == "Wait") {
+            if (!step["seconds"].isDouble() || step["seconds"].toInt() < 0) {
+                errors->append(QString("%1: 需要非负的 seconds").arg(where));
+                continue;
+            }
+            protocol->steps << StepWait(static_cast<uint>(step["seconds"].toInt()));
+        } else if (action == "MoveStage" || action == "RunTrajectory") {
+            errors->append(QString("%1: 免疫荧光程序没有位移台控制，不支持该步骤").arg(where));
+        } else {
+            errors->append(QString("%1: 未知的步骤类型").arg(where));
+        }
+    }
+    return errors->isEmpty();
+}
+
+
+// ******************************************************************************
+
+// ******************************* 干运行估算 ***********************************
+
+// 干运行换用自动推进的FakeClock：执行与实际运行相同的代码路径，等待不实际延时，
+// 串口发送任务照常按CMD_INTERVAL节拍出队，时间线由时钟在每次等待结束时记录
+void ULab::SetDryRun(bool enable)
+{
+    if (enable == m_dryRun) {
+        return;
+    }
+    if (pPort->isOpen()) {
+        emit SendMessage(QString("串口已连接，不能切换干运行模式"));
+        return;
+    }
+    m_dryRun = enable;
+    if (enable) {
+        if (!m_dryClock) {
+            m_dryClock = new FakeClock(this);
+            m_dryClock->SetAutoAdvance(true);
+        }
+        SetClock(m_dryClock);
+        m_portTask = m_clock->StartPeriodic(CMD_INTERVAL, [this]() { RefreshPort(); });
+        m_clock->StartTimeline();
+    } else {
+        m_clock->StopPeriodic(m_portTask);
+        m_portTask = -1;
+        m_clock->StopTimeline();
+        SetClock(nullptr);
+    }
+    emit SendMessage(enable ? QString("干运行模式：不连接设备，时间按虚拟时钟推进") : QString("干运行模式已关闭"));
+}
+
+void ULab::fixedDelay(uint msec)
+{
+    QEventLoop loop;
+    m_clock->Wait(loop, msec, WaitNote(TIME_SLEEP, "固定延时"));
+}
+
+static QString formatDuration(qint64 ms)
+{
+    return QString("%1:%2:%3.%4").arg(ms / 3600000).arg(ms / 60000 % 60, 2, 10, QChar('0'))
+            .arg(ms / 1000 % 60, 2, 10, QChar('0')).arg(ms % 1000, 3, 10, QChar('0'));
+}
+
+QString ULab::DryRunReport() const
+{
+    static const char* categoryNames[TIME_CATEGORY_COUNT] = {"阀切换", "固定延时", "泵运行", "指令排队"};
+
+    const QVector<TimelineEvent>& timeline = m_clock->Timeline();
+    qint64 totalMs = m_clock->TimelineMs();
+    QStringList lines;
+    lines << QString("\n================ 干运行时间线 ================");
+    for (const TimelineEvent& e : timeline) {
+        lines << QString("%1  +%2 ms  [%3%4] 步骤%5 %6").arg(formatDuration(e.start_ms)).arg(e.duration_ms, 7)
+                 .arg(categoryNames[e.category]).arg(e.background ? QString("/后台") : QString(""))
+                 .arg(e.step + 1).arg(e.what);
+    }
+
+    // 逐步分解
+    int stepCount = m_timelineSteps.size();
+    QVector<qint64> stepStart(stepCount, -1);
+    QVector<QVector<qint64>> stepTime(stepCount, QVector<qint64>(TIME_CATEGORY_COUNT, 0));
+    QVector<qint64> total(TIME_CATEGORY_COUNT, 0);
+    // 后台事件与前台重叠，不计入串行路径的分解
+    for (const TimelineEvent& e : timeline) {
+        if (e.step < 0 || e.step >= stepCount || e.background) {
+            continue;
+        }
+        if (stepStart[e.step] < 0) {
+            stepStart[e.step] = e.start_ms;
+        }
+        stepTime[e.step][e.category] += e.duration_ms;
+        total[e.category] += e.duration_ms;
+    }
+
+    lines << QString("\n================ 逐步耗时 (ms) ================");
+    lines << QString("步骤  开始           合计      阀切换    固定延时  泵运行    指令排队  名称");
+    QVector<qint64> stepTotal(stepCount, 0);
+    for (int i = 0; i < stepCount; ++i) {
+        for (int c = 0; c < TIME_CATEGORY_COUNT; ++c) {
+            stepTotal[i] += stepTime[i][c];
+        }
+        lines << QString("%1  %2  %3  %4  %5  %6  %7  %8").arg(i + 1, 4)
+                 .arg(formatDuration(qMax<qint64>(0, stepStart[i])), 12).arg(stepTotal[i], 8)
+                 .arg(stepTime[i][TIME_VALVE], 8).arg(stepTime[i][TIME_SLEEP], 8)
+                 .arg(stepTime[i][TIME_PUMP], 8).arg(stepTime[i][TIME_QUEUE], 8).arg(m_timelineSteps[i]);
+    }
+    lines << QString("总时长 %1 (%2 ms)：阀切换 %3 ms，固定延时 %4 ms，泵运行 %5 ms，指令排队 %6 ms")
+             .arg(formatDuration(totalMs)).arg(totalMs).arg(total[TIME_VALVE]).arg(total[TIME_SLEEP])
+             .arg(total[TIME_PUMP]).arg(total[TIME_QUEUE]);
+
+    // 关键路径：流程在单线程上串行执行，没有并行分支，关键路径即整条时间线；
+    // 按耗时列出贡献最大的步骤，缩短它们才能缩短总时长
+    QVector<int> order(stepCount);
+    for (int i = 0; i < stepCount; ++i) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&stepTotal](int a, int b) { return stepTotal[a] > stepTotal[b]; });
+    lines << QString("\n================ 关键路径 ================");
+    lines << QString("串行流程，关键路径为全部 %1 步；耗时最多的步骤：").arg(stepCount);
+    for (int k = 0; k < qMin(5, stepCount); ++k) {
+        int i = order[k];
+        lines << QString("  步骤%1 %2：%3 ms (%4%)").arg(i + 1).arg(m_timelineSteps[i]).arg(stepTotal[i])
+                 .arg(totalMs > 0 ? 100.0 * stepTotal[i] / totalMs : 0.0, 0, 'f', 1);
+    }
+    return lines.join("\n");
+}
+
+
+// ******************************************************************************
+
+// ******************************* 离散事件仿真 *********************************
+
+// 仿真直接运行真实的流程代码，所有等待按模型抽样后推进虚拟时钟，
+// 一次6小时的流程只需处理几百个事件，蒙特卡洛数百次也在秒级以内
+
+double ULab::sampleDuration(double mean, double sd)
+{
+    if (sd <= 0 || !m_simRng) {
+        return mean;
+    }
+    // Box-Muller
+    double u1 = qMax(m_simRng->generateDouble(), 1e-12);
+    double u2 = m_simRng->generateDouble();
+    double z = qSqrt(-2.0 * qLn(u1)) * qCos(2.0 * M_PI * u2);
+    return qMax(0.0, mean + sd * z);
+}
+
+// 泵的启停由时间控制，流速偏差在仿真中体现为达到同样体积需要的时长变化
+qint64 ULab::modelPumpMs(qint64 ms)
+{
+    return m_simModel ? qRound64(ms * sampleDuration(m_simModel->pump_time_scale, m_simModel->pump_time_sd)) : ms;
+}
+
+qint64 ULab::modelValveMs(qint64 ms)
+{
+    return m_simModel ? qRound64(sampleDuration(m_simModel->valve_switch_ms, m_simModel->valve_switch_sd)) : ms;
+}
+
+SimulationResult ULab::Simulate(const QList<ProtocolStep>& steps, const SimulationModel& model)
+{
+    SimulationResult result = {model.name, 0, 0.0, 0.0, 0.0, 0.0, {0.0}};
+
+    // 先校验一次并报告错误，之后的重复运行屏蔽消息输出
+    CompiledProtocol compiled;
+    if (!CompileProtocol(steps, &compiled) || model.runs <= 0) {
+        return result;
+    }
+
+    bool wasDryRun = m_dryRun;
+    bool wasBlocked = blockSignals(true);
+    SetDryRun(true);
+    if (!m_dryRun) {
+        blockSignals(wasBlocked);
+        emit SendMessage(QString("串口已连接，不能仿真"));
+        return result;
+    }
+    QRandomGenerator rng(model.seed);
+    m_simModel = &model;
+    m_simRng = &rng;
+
+    QVector<double> durations;
+    durations.reserve(model.runs);
+    double busy[SIM_RESOURCE_COUNT] = {0.0};
+    for (int run = 0; run < model.runs; ++run) {
+        if (!RunProtocol(steps, false)) {
+            break;
+        }
+        durations << m_clock->TimelineMs();
+        for (const TimelineEvent& e : m_clock->Timeline()) {
+            for (int r = 0; r < SIM_RESOURCE_COUNT; ++r) {
+                if (e.resources & (1u << r)) {
+                    busy[r] += e.duration_ms;
+                }
+            }
+        }
+    }
+
+    m_simRng = nullptr;
+    m_simModel = nullptr;
+    SetDryRun(wasDryRun);
+    blockSignals(wasBlocked);
+
+    if (durations.isEmpty()) {
+        return result;
+    }
+    std::sort(durations.begin(), durations.end());
+    double sum = 0.0;
+    for (double d : durations) {
+        sum += d;
+    }
+    result.runs = durations.size();
+    result.mean_ms = sum / durations.size();
+    result.p5_ms = durations[static_cast<int>(0.05 * (durations.size() - 1))];
+    result.p95_ms = durations[static_cast<int>(0.95 * (durations.size() - 1))];
+    // 单台设备串行执行，班次内可完成的流程数
+    result.runs_per_shift = result.mean_ms > 0 ? model.shift_hours * 3600000.0 / result.mean_ms : 0.0;
+    for (int r = 0; r < SIM_RESOURCE_COUNT; ++r) {
+        result.utilization[r] = sum > 0 ? busy[r] / sum : 0.0;
+    }
+    return result;
+}
+
+QString FormatSimulationResults(const QList<SimulationResult>& results)
+{
+    static const char* resourceNames[SIM_RESOURCE_COUNT] = {"试剂阀", "样品阀", "抽液阀", "加液泵", "抽液泵"};
+
+    QStringList lines;
+    lines << QString("\n================ 仿真结果 ================");
+    QString header = QString("%1  %2  %3  %4  %5  %6").arg("模型", -16).arg("次数", 6).arg("平均(min)", 10)
+            .arg("P5(min)", 10).arg("P95(min)", 10).arg("每班流程数", 10);
+    for (int r = 0; r < SIM_RESOURCE_COUNT; ++r) {
+        header += QString("  %1").arg(resourceNames[r], 8);
+    }
+    lines << header;
+    for (const SimulationResult& res : results) {
+        QString line = QString("%1  %2  %3  %4  %5  %6").arg(res.name, -16).arg(res.runs, 6)
+                .arg(res.mean_ms / 60000.0, 10, 'f', 2).arg(res.p5_ms / 60000.0, 10, 'f', 2)
+                .arg(res.p95_ms / 60000.0, 10, 'f', 2).arg(res.runs_per_shift, 10, 'f', 2);
+        for (int r = 0; r < SIM_RESOURCE_COUNT; ++r) {
+            line += QString("  %1%").arg(100.0 * res.utilization[r], 7, 'f', 1);
+        }
+        lines << line;
+    }
+    lines << QString("利用率 = 资源占用时间 / 流程总时长；阀占用按切换等待计，泵占用按运行时长计");
+    return lines.join("\n");
+}
@@ -7,8 +7,14 @@
 #include <QTime>
 #include <QEventLoop>
 #include <QMap>
+#include <QHash>
+#include <QVector>
+#include <QStringList>
 #include <QPoint>
 #include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <functional>
+#include <QRandomGenerator>
 //#include "CRC.h"
 
 #define CMD_INTERVAL            100             //发送串口指令间隔，单位：ms
@@ -20,8 +26,12 @@
 #define SAMPLE_VALVE_ADDR       1      // 第二个切换阀地址 (连接样品)
 #define PUMP_IN_ID              1      // 第一个蠕动泵ID (加液)
 #define PUMP_OUT_ID             8      // 第一个蠕动泵ID (抽液)
+#define ASPIRATE_VALVE_ID       8      // 抽液切换阀的设备ID (与抽液泵ID数值相同，但含义不同)
 #define VALVE_SWITCH_DELAY_MS   5000   // 切换阀通道切换延时
 #define DEAD_VOLUME             500    // 管路死体积
+#define ASPIRATE_EXTRA_MS       5000   // 抽液比加液多抽的时长，保证抽干 (与计时精度无关)
+
+#define CHECKPOINT_FILE         "immunofluorescence_checkpoint.json"   // 断点续跑文件，每完成一步原子写入
 
 // 冲洗管路
 #define WASH_SPEED                150.0    // 冲洗速度 (uL/s)
@@ -78,16 +88,299 @@ struct SampleConfig
     uint8_t valve_channel;
 };
 
-void MSleep(uint msec);                                      //阻塞延时
-void MSleepInterruptible(uint msec);                         //可中断的延时
+// 初始化冲洗中的一次冲洗
+struct WashFlush
+{
+    uint8_t reagent_channel;
+    uint8_t sample_channel;
+    bool aspirate;                      // 样品通道不是废液缸时需要抽液
+};
+
+enum PROTOCOL_STEP_TYPE
+{
+    STEP_INITIAL_WASH,
+    STEP_ADD_LIQUID,
+    STEP_WASH_PIPELINE,
+    STEP_WAIT,
+};
+
+// 实验流程中的一步，由RunProtocol按顺序执行，完成后写入断点
+struct ProtocolStep
+{
+    PROTOCOL_STEP_TYPE type;
+    QString reagent_name;
+    double volume_ul;
+    FluidSpeed speed;
+    QString sample_name;
+    uint delay_sec;
+};
+
+// 编译后的步骤：名称已解析为阀通道，时长已算好，执行时不再查表
+struct CompiledStep
+{
+    PROTOCOL_STEP_TYPE type;
+    uint8_t reagent_channel;
+    uint8_t sample_channel;
+    int reagent_name;                   // CompiledProtocol::names 下标，仅用于日志
+    int sample_name;
+    double volume_ul;
+    FluidSpeed speed;
+    double flow_speed;                  // uL/s
+    uint pump_ms;                       // 加液/冲洗泵运行时长
+    uint aspirate_ms;                   // 抽液泵运行时长
+    uint delay_ms;                      // 加液与抽液之间的间隔
+};
+
+struct CompiledProtocol
+{
+    QVector<CompiledStep> steps;
+    QStringList names;
+    QString id;                         // 流程指纹 (SHA-256十六进制)，用于断点校验
+};
+
+ProtocolStep StepInitialWash();
+ProtocolStep StepAddLiquid(const QString& reagent_name, double volume_ul, FluidSpeed speed, const QString& sample_name, uint delay_sec = 1);
+ProtocolStep StepWashPipeline(const QString& reagent_name, const QString& sample_name);
+ProtocolStep StepWait(uint delay_sec);
+QString ProtocolStepName(const ProtocolStep& step);
+
+// 干运行时间分类：阀切换等待、固定延时、泵运行、指令排队
+enum TIME_CATEGORY
+{
+    TIME_VALVE,
+    TIME_SLEEP,
+    TIME_PUMP,
+    TIME_QUEUE,
+    TIME_CATEGORY_COUNT,
+};
+
+// 干运行时间线上的一段
+struct TimelineEvent
+{
+    qint64 start_ms;                    // 虚拟时刻
+    qint64 duration_ms;
+    TIME_CATEGORY category;
+    int step;                           // 所属步骤序号
+    QString what;
+    uint resources;                     // 占用的资源 (SIM_RESOURCE 位掩码)
+    bool background;                    // 后台事件，与前台时间重叠
+};
+
+// 等待在时间线上的标注
+struct WaitNote
+{
+    WaitNote(TIME_CATEGORY category = TIME_SLEEP, const QString& what = QString("延时"), uint resources = 0)
+        : category(category), what(what), resources(resources) {}
+    TIME_CATEGORY category;
+    QString what;
+    uint resources;                     // 占用的资源 (SIM_RESOURCE 位掩码)
+};
+
+// 仿真中统计利用率的资源
+enum SIM_RESOURCE
+{
+    RES_REAGENT_VALVE = 0x01,
+    RES_SAMPLE_VALVE = 0x02,
+    RES_ASPIRATE_VALVE = 0x04,
+    RES_PUMP_IN = 0x08,
+    RES_PUMP_OUT = 0x10,
+};
+#define SIM_RESOURCE_COUNT      5
+
+// 仿真模型：时长按截断正态分布抽样，标准差为0时为定值
+struct SimulationModel
+{
+    QString name;
+    double valve_switch_ms;             // 阀切换等待时长，替代VALVE_SWITCH_DELAY_MS
+    double valve_switch_sd;
+    double pump_time_scale;             // 泵实际运行时长相对设定值的比例(流速偏差)
+    double pump_time_sd;
+    double shift_hours;                 // 班次时长，用于计算每班可完成的流程数
+    int runs;                           // 蒙特卡洛次数
+    quint32 seed;
+};
+
+struct SimulationResult
+{
+    QString name;
+    int runs;
+    double mean_ms;
+    double p5_ms;
+    double p95_ms;
+    double runs_per_shift;
+    double utilization[SIM_RESOURCE_COUNT];     // 各资源占用时间 / 流程总时长
+};
+
+QString FormatSimulationResults(const QList<SimulationResult>& results);
+
+// 对数线性直方图(HDR风格)：按2的幂分段，每段再等分LATENCY_SUB_BUCKETS格，相对误差约1/LATENCY_SUB_BUCKETS，单位us
+#define LATENCY_SUB_BUCKET_BITS     4
+#define LATENCY_SUB_BUCKETS         (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_INFLIGHT        16     // 每种指令最多保留的待回复记录，超出视为无回复丢弃最早一条
+
+struct LatencyHistogram
+{
+    QVector<quint32> buckets;
+    quint64 count{0};
+    qint64 min_us{0};
+    qint64 max_us{0};
+    qint64 sum_us{0};
+
+    void Record(qint64 us);
+    qint64 Percentile(double p) const;                  // p取0~100，返回所在格的上界
+    QString Summary() const;                            // n / p50 / p90 / p99 / max
+};
+
+// 每种指令(设备码, 指令码)的三段延时：排队(入队->写串口)、设备响应(写串口->解析到回复)、分发(解析->信号处理完毕)
+struct CommandLatency
+{
+    LatencyHistogram queueWait;
+    LatencyHistogram response;
+    LatencyHistogram dispatch;
+    quint32 unanswered{0};                              // 超出待回复上限被丢弃的写入
+    quint32 unmatched{0};                               // 找不到对应写入的回复
+};
+
+// 协议文件内容：试剂/样品映射和步骤序列
+struct ProtocolFile
+{
+    QMap<QString, ReagentConfig> reagents;
+    QMap<QString, SampleConfig> samples;
+    QList<ProtocolStep> steps;
+};
+
+bool LoadProtocolFile(const QString& path, ProtocolFile* protocol, QStringList* errors);  //读取JSON协议文件，格式或内容错误时逐条写入errors
+
+// 取消令牌：原子标志 + cancelled信号。等待中的事件循环连接cancelled信号，取消时立即退出，无需轮询
+class CancelToken : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CancelToken(QObject *parent = nullptr) : QObject(parent) {}
+
+    bool IsCancelled() const { return m_cancelled.loadAcquire() != 0; }
+    void Cancel()
+    {
+        if (m_cancelled.testAndSetOrdered(0, 1))
+        {
+            emit cancelled();
+        }
+    }
+    void Reset() { m_cancelled.storeRelease(0); }
+
+signals:
+    void cancelled();
+
+private:
+    QAtomicInt m_cancelled{0};
+};
+
+// 时钟与定时器接口：ULab中的计时、延时、等待和串口周期任务都经过它。
+// 实际运行用RealClock；测试时换成手动推进的FakeClock，超时和重试路径无需真实等待
+class Clock : public QObject
+{
+    Q_OBJECT
+public:
+    explicit Clock(QObject *parent = nullptr) : QObject(parent) {}
+    virtual qint64 NowNs() const = 0;
+    // 运行loop直到被已连接的唤醒信号退出或满msec毫秒(msec<0不限时)，超时退出返回true。
+    // 记录时间线时，最外层的等待结束后按note记一段实际等待时长；嵌套等待已包含在外层之内，不重复记录
+    bool Wait(QEventLoop& loop, qint64 msec, const WaitNote& note = WaitNote());
+    // 周期任务，返回任务编号
+    virtual int StartPeriodic(int msec, std::function<void()> task) = 0;
+    virtual void StopPeriodic(int id) = 0;
+
+    void StartTimeline();                                       //清空时间线并以当前时刻为零点开始记录
+    void StopTimeline() { m_recording = false; }
+    void SetTimelineStep(int step) { m_step = step; }           //之后记录的事件所属步骤
+    void AddTimelineEvent(qint64 startNs, qint64 duration_ms, const WaitNote& note, bool background); //记录不经过Wait的一段(如后台泵)
+    qint64 TimelineMs() const { return (NowNs() - m_originNs) / 1000000; }
+    const QVector<TimelineEvent>& Timeline() const { return m_timeline; }
+
+protected:
+    virtual bool waitFor(QEventLoop& loop, qint64 msec) = 0;
+
+private:
+    bool m_recording{false};
+    qint64 m_originNs{0};
+    int m_step{-1};
+    int m_depth{0};                                             //Wait嵌套层数
+    QVector<TimelineEvent> m_timeline;
+};
+
+class RealClock : public Clock
+{
+    Q_OBJECT
+public:
+    explicit RealClock(QObject *parent = nullptr);
+    qint64 NowNs() const override { return m_elapsed.nsecsElapsed(); }
+    int StartPeriodic(int msec, std::function<void()> task) override;
+    void StopPeriodic(int id) override;
+
+protected:
+    bool waitFor(QEventLoop& loop, qint64 msec) override;
+
+private:
+    QElapsedTimer m_elapsed;
+    QMap<int, QTimer*> m_tasks;
+    int m_nextId{1};
+};
+
+// 手动推进的时钟：Wait只登记截止时刻并进入事件循环，时间只在Advance时前进。
+// 测试在waitStarted信号(在等待的事件循环中发出，可直连)或投递的事件中调用Advance，依次触发到期的等待和周期任务。
+// 自动推进模式(干运行)：限时等待直接推进到截止时刻，不限时等待逐个触发周期任务直到被唤醒；
+// 限时等待在截止前被其他事件唤醒时时钟仍推进到截止，只适用于没有外部唤醒的场景。
+// 注意ULab析构时StopAllDevices仍会等待，销毁前先SetClock(nullptr)换回真实时钟
+class FakeClock : public Clock
+{
+    Q_OBJECT
+public:
+    explicit FakeClock(QObject *parent = nullptr) : Clock(parent) {}
+    qint64 NowNs() const override { return m_nowNs; }
+    int StartPeriodic(int msec, std::function<void()> task) override;
+    void StopPeriodic(int id) override;
+
+    void Advance(qint64 msec);                                  //推进时间，按时间顺序触发到期事件
+    int PendingWaits() const { return m_waits.size(); }
+    void SetAutoAdvance(bool enable) { m_autoAdvance = enable; }
+
+signals:
+    void waitStarted(qint64 deadlineNs);                        //deadlineNs<0 表示不限时等待
+
+protected:
+    bool waitFor(QEventLoop& loop, qint64 msec) override;
+
+private:
+    struct PendingWait { qint64 deadlineNs; QEventLoop* loop; bool* timedOut; quint64 serial; };
+    struct PeriodicTask { qint64 periodNs; qint64 nextNs; std::function<void()> task; };
+    bool isPending(quint64 serial) const;
+    bool fireNext(qint64 limitNs);                              //触发不晚于limitNs的最早一个事件，没有时返回false
+    void advanceTo(qint64 targetNs);
+    void autoStep(quint64 serial, qint64 deadlineNs);
+    qint64 m_nowNs{0};
+    QList<PendingWait> m_waits;
+    quint64 m_nextWait{0};
+    QMap<int, PeriodicTask> m_tasks;
+    int m_nextId{1};
+    bool m_autoAdvance{false};
+};
+
+Clock* DefaultClock();                                                          //进程内共享的RealClock
+
+void MSleep(uint msec, Clock* clock = nullptr);                                 //阻塞延时，clock为空时用DefaultClock
+bool MSleepInterruptible(uint msec, const CancelToken* token, Clock* clock = nullptr); //可中断的延时，被取消时返回false
 
 class ULab : public QObject
 {
     Q_OBJECT
+    friend class TestULab;                                                                  // tests/tst_ulab.cpp 直接检查冲洗计划
 public:
     explicit ULab(QObject *parent = nullptr);
     ~ULab();
 
+    void SetClock(Clock* clock);                                                            //替换时钟(不转移所有权)，须在InitPort之前调用，传nullptr恢复默认
+    Clock* GetClock() const { return m_clock; }
+
     bool InitPort(QString portName);
     void ClosePort();
 
@@ -123,6 +416,7 @@ public:
 
     void Pump_in(const Setconfig_Pump_in& config);
     void Pump_Peristaltic(uint8_t id, bool direction, double flow_speed, double volume_ul);
+    double TimedRotate(uint8_t id, bool direction, uint on_ms);                             //精确定时出液，返回实际出液时长(ms)
     
     void AddLiquid(const QString& reagent_name, double volume_ul, FluidSpeed speed, const QString& sample_name, uint delay_sec = 1);
     
@@ -133,8 +427,32 @@ public:
     void performWash(uint8_t reagentChannel, uint8_t sampleChannel, uint8_t wasteChannel);
     
     void StopAllDevices();
+
+    // 按步骤执行实验流程，每完成一步写入断点；resume为true时从上次完成的步骤之后继续
+    bool RunProtocol(const QList<ProtocolStep>& steps, bool resume = true);
+    bool CompileProtocol(const QList<ProtocolStep>& steps, CompiledProtocol* compiled);    //解析并校验整个流程，有错误时逐条报告并返回false
+    void ClearCheckpoint();
+
+    // 干运行：不连接串口，换用自动推进的FakeClock，所有等待不实际延时，用于估算流程时长；须在串口关闭时切换
+    void SetDryRun(bool enable);
+    bool IsDryRun() const { return m_dryRun; }
+    QString DryRunReport() const;                                                           //时间线、逐步耗时分解和关键路径
+    SimulationResult Simulate(const QList<ProtocolStep>& steps, const SimulationModel& model); //按模型抽样时长，蒙特卡洛重复干运行
     
     void WaitForUserInput(const QString& message);
+    CancelToken* StopToken() { return &m_stopToken; }                                       //停止令牌，取消后所有等待立即返回
+
+    // 运行控制：暂停时停泵、保持阀位，继续后补齐剩余时长；跳过只结束当前步骤；中止后停泵，后续步骤全部跳过
+    void PauseRun();
+    void ResumeRun();
+    void SkipStep();
+    void AbortRun();
+    bool IsPaused() const { return m_paused; }
+    QString RunStatus() const;                                                              //当前运行状态和步骤
+    QString LatencyReport() const;                                                          //各指令排队、响应、分发延时分布
+    void ResetLatencyStats();
+    QByteArray EmergencyStopFrames();                                                       //预生成的停泵指令帧(加液泵+抽液泵)，供信号处理快速通道使用
+    QSerialPort::Handle PortHandle() const;                                                 //串口底层句柄(Unix为fd)，串口未打开时无效
     
     void SetReagentConfig(const QMap<QString, ReagentConfig>& config);
     void SetSampleConfig(const QMap<QString, SampleConfig>& config);
@@ -151,6 +469,11 @@ signals:
 
     void EmergencyStopTriggered();
     void UserInputReceived(QString input);                                                  //用户输入
+    void CmdQueueEmpty();                                                                   //指令队列最后一条指令已写入串口
+    void UserInputAccepted();                                                               //等待中的用户输入已确认
+    void BackgroundPumpDone();                                                              //后台泵运行结束
+    void RunPaused();                                                                       //运行已暂停
+    void RunResumed();                                                                      //运行已继续
 
 private slots:
     void RefreshPort();
@@ -186,18 +509,75 @@ private:
     QByteArray GenCMD(uint8_t code, uint8_t id, uint8_t contentH, uint8_t contentL);
     bool CheckCMD(QByteArray cmd);
     QString portName;
-    QTimer *pPortTimer;
-    QTimer *pParseTimer;
+    int m_portTask{-1};                                                                     // 串口发送周期任务编号
+    int m_parseTask{-1};                                                                    // 串口解析周期任务编号
     QTimer *pReadTimer;
     QTimer *pGetFlowTimer;
     QList<QByteArray> wrtCmdList;
+    QList<qint64> wrtCmdTimes;                                                              // 与wrtCmdList一一对应的入队时刻(ns)
+    void enqueueCmd(const QByteArray& cmd);                                                 // 指令入队并记录入队时刻
+    void clearCmdQueue();
+    QHash<quint16, CommandLatency> m_latency;                                               // 键为 (设备码 << 8) | 指令码
+    QHash<quint16, QList<qint64>> m_inFlight;                                               // 已写出待回复的写入时刻(ns)，按FIFO匹配回复
+    void recordWrite(const QByteArray& frame, qint64 enqueuedNs);                           // enqueuedNs<0表示绕过队列
     QByteArray readBuffer;
+    Clock* m_clock;                                                                         // 所有计时和等待使用的时钟
+    RealClock* m_realClock;                                                                 // 默认时钟
+    qint64 m_lastWriteNs{-1};                                                               // 最近一次写串口的时刻(ns)
+    qint64 m_lastDirectWriteNs{-1};                                                         // 最近一次绕过队列写串口的时刻(ns)
+    int m_directWritesWaiting{0};                                                           // 正在等CMD_INTERVAL间隔的直接写入数
+    qint64 WriteFrameNow(const QByteArray& frame);                                          // 绕过队列写串口(先满足CMD_INTERVAL间隔)，返回写入时刻(ns)
+    bool WaitCmdQueueDrained();                                                             // 等待队列清空并满足CMD_INTERVAL间隔
     QMap<DEVICE_CODE, QPoint> m_currentPos;
     QAtomicInt m_emergencyFlag{0};                                                          // 原子操作的急停标志
     QMap<QString, ReagentConfig> m_reagentConfigs;                                          // 试剂配置映射
     QMap<QString, SampleConfig> m_sampleConfigs;                                            // 样品配置映射
     uint m_pumpInterval;                                                                    // 加液和抽液之间的时间间隔(ms)
-    QAtomicInt m_shouldStop{0};                                                             // 停止标志，用于中断长时间操作
+    CancelToken m_stopToken;                                                                // 停止令牌，用于中断长时间操作
+    CancelToken m_skipToken;                                                                // 跳过令牌，只中断当前步骤，每步开始时重置
+    bool m_paused{false};                                                                   // 是否处于暂停状态
+    QString m_currentStep;                                                                  // 当前执行的步骤名称
+    QMap<int, uint8_t> m_valveState;                                                        // 切换阀当前通道，键为 (id << 8) | addr
+    void executeAddLiquid(const CompiledStep& step, const QStringList& names);
+    void executeWashPipeline(const CompiledStep& step, const QStringList& names);
+    void executeWait(const CompiledStep& step);
+    bool saveCheckpoint(const QString& protocolId, int nextStep);                           // 原子写入断点(写临时文件+fsync+重命名)
+    int loadCheckpoint(const QString& protocolId);                                          // 返回可续跑的步骤序号，无有效断点返回0
+    bool beginStep(const QString& name);                                                    // 步骤开始：已中止返回false，暂停中则等待继续
+    bool stepCancelled() const;                                                             // 当前步骤是否被跳过或中止
+    bool waitWhilePaused();                                                                 // 暂停期间阻塞，被跳过或中止时返回false
+    bool stepWait(uint msec, TIME_CATEGORY category = TIME_SLEEP);                          // 受运行控制的延时：暂停时冻结剩余时长
+    void fixedDelay(uint msec);                                                             // 不可中断的短延时
+
+    bool m_dryRun{false};                                                                   // 干运行模式
+    FakeClock* m_dryClock{nullptr};                                                         // 干运行时钟(自动推进)，时间线记录在其上
+    QStringList m_timelineSteps;                                                            // 干运行各步骤名称
+    QVector<WashFlush> planInitialWash(const QList<uint8_t>& reagents, const QList<uint8_t>& samples, uint8_t waste);
+    bool setValve(uint8_t addr, uint8_t channel, uint8_t id);                               // 阀已在目标通道时不切换，返回是否需要等待
+
+    // 后台泵：与前台的阀切换、加液重叠执行
+    struct BackgroundPump
+    {
+        bool active{false};
+        bool pending{false};                                                                // 被暂停，继续后补齐剩余时长
+        uint8_t id{0};
+        QByteArray startFrame;
+        QByteArray stopFrame;
+        qint64 startNs{0};
+        qint64 remaining_ms{0};
+        int task{-1};
+    } m_bgPump;
+    void startBackgroundPump(uint8_t id, bool direction, uint on_ms);
+    void runBackgroundPump(qint64 on_ms);
+    void stopBackgroundPump(bool pause);
+    bool waitBackgroundPump();
+
+    uint m_pendingValves{0};                                                                // 已下发切换但尚未等待到位的阀 (SIM_RESOURCE)
+    const SimulationModel* m_simModel{nullptr};                                             // 仿真时的时长模型，为空时按设定值
+    QRandomGenerator* m_simRng{nullptr};
+    double sampleDuration(double mean, double sd);                                          // 截断正态抽样
+    qint64 modelPumpMs(qint64 ms);                                                          // 仿真时按模型抽样泵运行时长，否则原样返回
+    qint64 modelValveMs(qint64 ms);                                                         // 仿真时按模型抽样阀切换时长，否则原样返回
     
     bool m_waitingForInput{false};                                                          // 是否正在等待用户输入
     QString m_userInput;                                                                    // 存储用户输入
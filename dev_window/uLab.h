@@ -8,7 +8,12 @@
 #include <QEventLoop>
 #include <QMap>
 #include <QPoint>
+#include <QStringList>
+#include <QVector>
+#include <QHash>
+#include <QSet>
 #include <QAtomicInteger>
+#include <QElapsedTimer>
 //#include "CRC.h"
 
 #define CMD_INTERVAL    100             //发送串口指令间隔，单位：ms
@@ -17,6 +22,18 @@
 #define FLOW_INTERVAL   6000           //发送查询气压和流量指令间隔，单位：ms
 #define Z_AXIS_TRAVEL_MM 30            // Z轴移动距离 (mm)
 #define Z_AXIS_DWELL_MS  1000          // Z轴在底部停留时间 (ms)
+#define Z_AXIS_CLEARANCE_MM 10         // 流水线模式下Z轴在孔位间上升到的高度，即底部以上的距离 (mm)
+#define Z_AXIS_SAFE_MM      5          // Z轴离开底部超过此高度即已出孔，X/Y可以移动 (mm)
+
+#define CALIBRATION_FILE     "stage_calibration.ini"   // 位移台标定数据，启动时自动加载
+#define STAGE_STATE_FILE     "stage_state.ini"         // 位移台可信状态，跨进程保留
+#define PLATE_MAX_ROWS       52        // 孔板最多行数 (A-Z, AA-AZ)
+
+#define POS_TOLERANCE_UM     1000      // 位置确认容差 (µm)
+#define POS_EXACT_UM         10        // 读数与目标相差在此范围内直接认为已到位 (µm)
+#define POS_SETTLE_DELTA_UM  20        // 相邻两次读数变化小于此值认为已停止 (µm)
+#define POS_POLL_FAST_MS     CMD_INTERVAL // 预计到达前后的密集查询间隔 (ms)，查询与指令共用写串口间隔，不能更快
+#define POS_POLL_LEAD_MS     150       // 提前多久开始密集查询 (ms)
 
 enum DEVICE_CODE
 {
@@ -34,7 +51,7 @@ enum AXIS
 };
 
 struct StageParams {
-    int rows;
+    int rows;           // 默认孔板行数，可用SetPlateFormat切换孔板
     int cols;
     int x_step_um;      // X轴孔间距 (µm)
     int y_step_um;      // Y轴孔间距 (µm)
@@ -44,16 +61,121 @@ struct StageParams {
     int initial_offset_x_um; // 从位移台原点到A1孔的X方向距离(µm)
     int initial_offset_y_um; // 从位移台原点到A1孔的Y方向距离
     DEVICE_CODE code;
+    int xy_accel_mm_s2; // X/Y轴加速度 (mm/s²)，梯形速度曲线
+    int z_accel_mm_s2;  // Z轴加速度 (mm/s²)
+    int settle_ms;      // 到位后的稳定时间 (ms)
+    int pos_unit_um;    // 位置指令/回复中每个计数对应的µm，行程 = 65535 * pos_unit_um。必须等于控制板固件的设置：
+                        // 协议无法查询该值，回复按同一单位缩放也无法自检，改固件后用实测移动距离核对再修改此处
+};
+
+struct PlateFormat {
+    QString name;
+    int rows;
+    int cols;
+    int x_step_um;      // 行间距，沿X轴 (µm)
+    int y_step_um;      // 列间距，沿Y轴 (µm)
+    int a1_dx_um;       // A1相对位移台A1标定位置(initial_offset)的偏移 (µm)
+    int a1_dy_um;
+};
+
+// 孔板坐标表：按 row*cols+col 连续存放，遍历、命名和查找时不再逐孔计算
+struct PlateLayout {
+    PlateFormat format;
+    QVector<QPoint> pos_um;         // 各孔位的位移台绝对坐标 (µm)
+    QStringList names;              // 各孔位名称
+    QStringList row_names;          // 行名 (A, B, ... AA, AB)
+    QHash<QString, int> index;      // 孔位名 -> 下标
+    QVector<int> serpentine;        // 蛇形遍历顺序 (下标)
+};
+
+// 参考孔位标定点：在pos_um处指令移动后，位置读数与指令坐标的偏差
+struct CalibrationPoint {
+    QPoint pos_um;      // 指令坐标 (µm)
+    QPoint bias_um;     // 读数 - 指令 (µm)
+};
+
+struct CalibrationFit {
+    int terms;          // 0: 无标定，1: 常数，3: 平面，4: 双线性
+    double coef_x[4];
+    double coef_y[4];
+};
+
+enum STAGE_STATE_REASON
+{
+    STATE_VALID = 0,
+    STATE_NEVER_HOMED,          // 从未归位
+    STATE_IN_MOTION,            // 运动流程进行中 (异常退出时保留此状态)
+    STATE_EMERGENCY_STOP,       // 急停
+    STATE_TIMEOUT,              // 位置确认超时
+    STATE_POSITION_MISMATCH,    // 读数与记录不一致，如控制板断电重启
+};
+
+// 位移台可信状态：有效时运动前跳过归位和校准
+struct StageState {
+    bool homed;
+    QPoint xy_um;               // 最后确认的X/Y位置 (µm)
+    int z_um;                   // 最后的Z轴位置 (µm)
+    QPoint well;                // 最后的逻辑孔位 (m_currentPos)
+    STAGE_STATE_REASON reason;  // 失效原因，STATE_VALID为有效
+};
+
+enum WAYPOINT_ACTION
+{
+    WAYPOINT_PASS,      // 途经：不确认到位，预计到达后直接驶向下一个航点
+    WAYPOINT_STOP,      // 停靠：确认到位后停留dwell_ms
+    WAYPOINT_DIP,       // 加液：确认到位后Z轴下降、停留、上升，再停留dwell_ms
+};
+
+struct Waypoint {
+    QPoint pos_um;          // 位移台坐标 (µm)
+    WAYPOINT_ACTION action;
+    int dwell_ms;
+    QString label;          // 消息中显示的名称，如孔位名
+};
+
+struct LiquidExchangeJob {
+    uint8_t pump_id;     // 蠕动泵ID (切换阀与蠕动泵在同一控制板上，共用此ID)
+    uint8_t valve_addr;  // 切换阀地址
+    uint8_t channel;     // 目标通道
+    double volume_ul;    // 出液体积 (uL)
 };
 
 QByteArray CRCMDBS_GetValue(QByteArray msg);
 QString GetAxisName(AXIS axis);
+QString PlateRowName(int row);
+QString StageStateReasonName(STAGE_STATE_REASON reason);
+
+// 取消令牌：原子标志 + cancelled信号。等待中的事件循环连接cancelled信号，取消时立即退出，无需轮询
+class CancelToken : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CancelToken(QObject *parent = nullptr) : QObject(parent) {}
+
+    bool IsCancelled() const { return m_cancelled.loadAcquire() != 0; }
+    void Cancel()
+    {
+        if (m_cancelled.testAndSetOrdered(0, 1))
+        {
+            emit cancelled();
+        }
+    }
+    void Reset() { m_cancelled.storeRelease(0); }
+
+signals:
+    void cancelled();
+
+private:
+    QAtomicInt m_cancelled{0};
+};
 
 void MSleep(uint msec);             //非阻塞延时
+bool MSleepInterruptible(uint msec, const CancelToken* token); //可中断的延时，被取消时返回false
 
 class ULab : public QObject
 {
     Q_OBJECT
+    friend class TestULab;                                                                  // tests/tst_ulab.cpp 直接检查运动预测
 public:
     explicit ULab(QObject *parent = nullptr);
     ~ULab();
@@ -68,13 +190,14 @@ public:
 
     // xyz stages
     void Home(AXIS axis, DEVICE_CODE code = LOW_STAGE_CODE);
-    void Goto(AXIS axis, uint16_t pos, DEVICE_CODE code = LOW_STAGE_CODE);                   //unit of pos: um
+    bool Goto(AXIS axis, int pos, DEVICE_CODE code = LOW_STAGE_CODE);                        //unit of pos: um, 超出行程时返回false
     void SetSpeedStage(AXIS axis, uint16_t speed, DEVICE_CODE code = LOW_STAGE_CODE);        //unit of speed: 0.12 mm/s
     void SetTime(AXIS axis, uint16_t time, DEVICE_CODE code = LOW_STAGE_CODE);               //unit of time: ms
     void Go(AXIS axis, bool direction, DEVICE_CODE code = LOW_STAGE_CODE);
     void Enable(AXIS axis, bool enable, DEVICE_CODE code = LOW_STAGE_CODE);
     void GetPos(AXIS axis, DEVICE_CODE code = LOW_STAGE_CODE);
     void SetAxisEnable(AXIS axis, bool enable = false, DEVICE_CODE code = LOW_STAGE_CODE);
+    bool MoveXY(QPoint target_um, DEVICE_CODE code = LOW_STAGE_CODE, QPoint* last_pos = nullptr);   //X/Y同时移动并一起确认位置, unit: um
     void SetFluigentEnable(bool enable = false);
     void GetPressure();
     void GetFlow();
@@ -93,6 +216,10 @@ public:
                                uint pumping_duration_ms,
                                uint8_t valve_addr,
                                bool direction);
+    void PerformLiquidExchange(const QList<LiquidExchangeJob>& jobs,                       // 多泵并行换液
+                               uint16_t pump_speed,                                         // 控制板转速单位(与SetSpeed相同)，按标定换算为流量
+                               bool direction);
+    void SetPumpCalibration(uint8_t pump_id, double ul_per_s_per_unit);                     // 蠕动泵流量标定：每个转速单位对应的uL/s
 
     //低精度位移台运动控制
     void MoveStage(DEVICE_CODE stage_type,                                                  // 根据输入参数定向移动
@@ -107,9 +234,43 @@ public:
     void MoveStage(DEVICE_CODE stage_type,
                    int speed_x = -1,
                    int speed_y = -1,
-                   int dwell_ms = 1000);                                                       // 全板遍历
+                   int dwell_ms = 1000,
+                   bool pipelined = false,                                                     // 流水线模式：Z轴出孔即移动X/Y，X/Y到位前Z轴提前下降
+                   int z_clearance_mm = Z_AXIS_CLEARANCE_MM);                                  // 全板遍历
+
+    void MoveStage(DEVICE_CODE stage_type,                                                  // 任意孔位子集遍历，按移动时间优化访问顺序
+                   const QStringList& wells,
+                   int speed_x = -1,
+                   int speed_y = -1,
+                   int dwell_ms = 1000,
+                   bool pipelined = false);
+    // 孔板几何
+    bool LoadPlateFormats(const QString& path);                                             // 从ini文件加载自定义孔板
+    bool SetPlateFormat(DEVICE_CODE stage_type, const QString& name);                       // "6","24","48","96","384","1536","default"或自定义孔板
+    QStringList PlateFormatNames() const;
+    const PlateLayout& GetPlateLayout(DEVICE_CODE stage_type) const;
+
+    // 位移台状态
+    bool IsStageStateValid(DEVICE_CODE stage_type) const;
+    void InvalidateStageState(DEVICE_CODE stage_type, STAGE_STATE_REASON reason);
+
+    // 孔位标定
+    bool CalibrateWell(DEVICE_CODE stage_type, const QString& wellName);                    // 测量参考孔位的偏差
+    void SetCalibrationPoint(DEVICE_CODE stage_type, QPoint pos_um, QPoint bias_um);
+    void ClearCalibration(DEVICE_CODE stage_type);
+    bool SaveCalibration(const QString& path = CALIBRATION_FILE);
+    bool LoadCalibration(const QString& path = CALIBRATION_FILE);
+
+    static QStringList ParseWellList(const QString& text);                                  // "A1,A3,B7" -> 孔位列表
+    QStringList LoadPlateMap(const QString& path);                                          // 从孔位文件读取孔位列表
+
+    bool RunTrajectory(DEVICE_CODE stage_type,                                              // 航点轨迹
+                       const QList<Waypoint>& waypoints,
+                       int z_clearance_mm = -1);                                            // >=0: Z轴在航点间只升到安全高度
+    QList<Waypoint> WellWaypoints(DEVICE_CODE stage_type, const QStringList& wells, int dwell_ms = 1000);
 
     void EmergencyStop();
+    CancelToken* StopToken() { return &m_stopToken; }
     void SendData(const QByteArray &data);
 
 
@@ -162,17 +323,68 @@ private:
     QList<QByteArray> wrtCmdList;
     QByteArray readBuffer;
     QMap<DEVICE_CODE, QPoint> m_currentPos;
-    QAtomicInt m_emergencyFlag{0}; // 原子操作的急停标志
+    CancelToken m_stopToken;       // 急停令牌，取消后所有等待立即返回
+
+
+    bool waitForPosition(DEVICE_CODE stage_type, AXIS axis, int target_pos, int& last_pos, int timeout_ms = 10000);
+    bool waitForPositionXY(DEVICE_CODE stage_type, int target_x, int target_y, int& last_x, int& last_y, int timeout_ms = 10000);
+    bool waitForAxes(DEVICE_CODE stage_type, const QList<AXIS>& axes, const QList<int>& targets, QList<int>& last_pos, int timeout_ms);
+    int travelMs(DEVICE_CODE stage_type, AXIS axis, int distance_um);                      // 梯形速度曲线估算移动时间(含稳定时间)
+    int travelPartialMs(DEVICE_CODE stage_type, AXIS axis, int distance_um, int partial_um); // 移动distance_um时走过前partial_um所需时间(不含稳定时间)
+    bool motionProfile(DEVICE_CODE stage_type, AXIS axis, double& v, double& a);            // 当前最高速度(µm/ms)和加速度(µm/ms²)
+    int crossingMs(DEVICE_CODE stage_type, AXIS axis, int from_um, int threshold_um);       // 当前移动还需多久越过threshold_um，未知时为-1
+    void waitForMove(DEVICE_CODE stage_type, AXIS axis, int target_pos, int fallback_ms);  // 按预测时间等待，起点未知时等待fallback_ms
+    void trackMove(DEVICE_CODE stage_type, AXIS axis, int target_pos, bool immediate = false); // 记录指令目标，预测到达时刻
+    int remainingMoveMs(DEVICE_CODE stage_type, AXIS axis, int target_pos);                 // 距预计到达还剩多久，未知时为0
+    bool pollPosNow(AXIS axis, DEVICE_CODE code);                                           // 绕过定时器查询位置(遵守写入间隔)，急停时返回false
+    QSet<int> m_pollPending;                                                                // 正在等写入间隔的位置查询
+    bool visitWell(DEVICE_CODE stage_type, const QString& wellName, int dwell_ms, int z_retract_pos_um, int z_fallback_ms,
+                   bool pipelined = false);                                                 // 孔位Z轴下降、停留、上升
+    bool pipelinedMoveXY(DEVICE_CODE stage_type, QPoint from_um, QPoint target_um,
+                         int z_retract_pos_um, QPoint* last_pos);                           // 流水线换孔：X/Y移动与Z轴下降重叠
+    bool wellPosition(DEVICE_CODE stage_type, const QString& wellName, QPoint& pos_um);     // 孔位名 -> 位移台坐标 (µm)
+    int xyTravelMs(DEVICE_CODE stage_type, QPoint from_um, QPoint to_um);                   // X/Y同时移动时间，取两轴中较慢者
+    int pathTravelMs(DEVICE_CODE stage_type, QPoint start_um, const QList<QPoint>& wells_um, const QList<int>& order);
+    QList<int> planWellOrder(DEVICE_CODE stage_type, QPoint start_um, const QList<QPoint>& wells_um); // 最近邻 + 2-opt
+
+    PlateFormat stageDefaultPlate(DEVICE_CODE stage_type) const;
+    bool buildPlateLayout(DEVICE_CODE stage_type, const PlateFormat& plate);
+    QMap<QString, PlateFormat> m_customPlates;                                              // 从文件加载的自定义孔板
+    QMap<DEVICE_CODE, PlateLayout> m_plateLayout;                                           // 各位移台当前孔板的坐标表
+
+    bool stageStateTrusted(DEVICE_CODE stage_type);                                         // 状态有效且当前读数与记录一致
+    void prepareStageZ(DEVICE_CODE stage_type, int fallback_ms);                            // 运动前Z轴归位，状态可信时跳过
+    void finishStageRun(DEVICE_CODE stage_type);                                            // 运动正常结束，记录位置
+    void saveStageState();
+    void loadStageState();
+    QMap<DEVICE_CODE, StageState> m_stageState;
 
+    void refitCalibration(DEVICE_CODE stage_type);
+    QPoint calibrationBias(DEVICE_CODE stage_type, QPoint target_um) const;                 // 目标处预期偏差(读数 - 指令)
+    bool gotoCompensated(DEVICE_CODE stage_type, AXIS axis, int target_um, int bias_um, bool immediate = false);
+    bool sendGoto(AXIS axis, int pos, DEVICE_CODE id, bool immediate);                      // immediate: 绕过队列直接写串口
+    bool writeFrameNow(const QByteArray& frame, bool cancellable = true);                   // 先写出队列中已有指令再立即写入，相邻写入间隔不小于CMD_INTERVAL
+    qint64 m_lastWriteMs{-1};                                                               // 最近一次写串口的时刻 (m_stageClock, ms)
+    qint64 m_lastDirectWriteMs{-1};                                                         // 最近一次绕过定时器写串口的时刻
+    QMap<DEVICE_CODE, QList<CalibrationPoint>> m_calibPoints;
+    QMap<DEVICE_CODE, CalibrationFit> m_calibFit;
+    QMap<uint8_t, double> m_pumpCal;                                                        // 蠕动泵流量标定 (uL/s 每转速单位)，未标定的泵不能按体积出液
 
-    bool waitForPosition(DEVICE_CODE stage_type, AXIS axis, uint16_t target_pos, int& last_pos, int timeout_ms = 10000);
+    int posUnitUm(DEVICE_CODE code) const;                                                  // 协议位置字段每个计数对应的µm
+    static int axisKey(DEVICE_CODE code, AXIS axis) { return (code << 8) | axis; }
+    QElapsedTimer m_stageClock;                                                             // 运动预测时间基准
+    QMap<int, int> m_axisPos;                                                               // 各轴最近一次读到的位置 (µm)
+    QMap<int, int> m_axisTarget;                                                            // 各轴最近一次指令目标 (µm)
+    QMap<int, qint64> m_axisArrival;                                                        // 各轴预计到达时刻 (m_stageClock, ms)，-1为未知
+    QMap<int, int> m_axisBias;                                                              // 补偿移动时预期读数与指令目标之差 (µm)
+    QMap<int, uint16_t> m_axisSpeed;                                                        // 各轴最近一次设置的速度 (0.12mm/s)
 
     // 设备参数配置
     const QMap<DEVICE_CODE, StageParams> STAGE_CONFIG =
     {
-        //                rows,cols, x_step, y_step, x_spd,y_spd,z_spd, offset_x, offset_y, code
-        {LOW_STAGE_CODE,  {8,   12,   4500,   4500,  20,   20,   100,   14000,    50000,    LOW_STAGE_CODE}},
-        {HIGH_STAGE_CODE, {8,   12,   450,    450,   20,   20,   20,    10000,    10000,    HIGH_STAGE_CODE}}
+        //                rows,cols, x_step, y_step, x_spd,y_spd,z_spd, offset_x, offset_y, code,            xy_acc, z_acc, settle, pos_unit
+        {LOW_STAGE_CODE,  {8,   12,   4500,   4500,  20,   20,   100,   14000,    50000,    LOW_STAGE_CODE,  50,     100,   150,    1}},
+        {HIGH_STAGE_CODE, {8,   12,   450,    450,   20,   20,   20,    10000,    10000,    HIGH_STAGE_CODE, 20,     20,    100,    1}}
     };
 
 
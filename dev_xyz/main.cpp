@@ -34,12 +34,36 @@ int main(int argc, char *argv[]) {
         controller.MoveStage(LOW_STAGE_CODE, 15, 15, 0);      // 指定速度
     });
     //  controller.MoveStage(LOW_STAGE_CODE);                    // 默认速度
+    //  controller.MoveStage(LOW_STAGE_CODE, 15, 15, 0, true);   // 流水线模式，Z轴在孔位间只升到安全高度
 
     //     参数说明：
     //     200           - X轴速度 (20 * 0.12 = 2.4mm/s)
     //     15            - Y轴速度 (15 * 0.12 = 1.8mm/s)
     //     500           - 每个孔位停留500ms
 
+    // 孔位子集遍历：按移动时间优化访问顺序
+    // QTimer::singleShot(1000, &controller, [&controller]() {
+    //     controller.MoveStage(LOW_STAGE_CODE, ULab::ParseWellList("A1,A3,B7,H12"), 15, 15, 500);
+    //     // controller.MoveStage(LOW_STAGE_CODE, controller.LoadPlateMap("plate_map.txt"));
+    //     // controller.LoadPlateFormats("plates.ini");              // 自定义孔板
+    //     // controller.SetPlateFormat(LOW_STAGE_CODE, "384");     // 切换孔板，坐标超出行程时拒绝
+    // });
+
+    // 孔位标定：测量四角参考孔的偏差并保存，之后所有孔位移动按双线性插值补偿，启动时自动加载
+    // QTimer::singleShot(1000, &controller, [&controller]() {
+    //     for (const QString& well : {"A1", "A12", "H1", "H12"}) {
+    //         controller.CalibrateWell(LOW_STAGE_CODE, well);
+    //     }
+    //     controller.SaveCalibration();
+    // });
+
+    // 航点轨迹：上一步确认后立即发出下一个目标，途经航点按运动模型不查询直接通过
+    // QTimer::singleShot(1000, &controller, [&controller]() {
+    //     QList<Waypoint> path = controller.WellWaypoints(LOW_STAGE_CODE, {"A1", "A6", "B6"}, 500);
+    //     path.insert(1, {QPoint(14000, 30000), WAYPOINT_PASS, 0, "避让点"});
+    //     controller.RunTrajectory(LOW_STAGE_CODE, path, Z_AXIS_CLEARANCE_MM);
+    // });
+
 
 
 
@@ -108,6 +132,25 @@ int main(int argc, char *argv[]) {
     */
 
 
+    // 多泵并行换液：互不冲突的任务(不同蠕动泵、不同切换阀)同时执行
+    // QTimer::singleShot(1000, &controller, [&controller]() {
+    //     qDebug() << "开始执行多泵并行换液测试...";
+
+    //     // 任务列表：{蠕动泵ID, 切换阀地址, 通道, 体积(uL)}
+    //     QList<LiquidExchangeJob> jobs = {
+    //         {0x01, 0x00, 1, 200.0},
+    //         {0x08, 0x00, 3, 200.0},
+    //         {0x01, 0x00, 5, 200.0},
+    //         {0x08, 0x00, 2, 200.0},
+    //     };
+
+    //     // 转速为控制板单位，体积按流量标定换算为出液时长；标定方法见SetPumpCalibration
+    //     controller.SetPumpCalibration(0x01, 1.0);
+    //     controller.SetPumpCalibration(0x08, 1.0);
+    //     controller.PerformLiquidExchange(jobs, 100, true);     // 转速100，正转
+    // });
+
+
     // *********************************************************************************
 
 
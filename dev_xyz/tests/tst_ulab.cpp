@@ -0,0 +1,69 @@
+#include <QtTest>
+#include "uLab.h"
+
+// 运动预测测试：不打开串口，移动指令只进入队列，直接检查预测的越过时刻
+class TestULab : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void partialDistanceIsDirectionless();
+    void upwardRetractCrossing();
+    void thresholdBehindStart();
+    void builtinPlateOutOfTravel();
+};
+
+// 上升(距离为负)与下降走过同样距离的时刻相同，且不为0
+void TestULab::partialDistanceIsDirectionless()
+{
+    ULab lab;
+    const int travel_um = Z_AXIS_CLEARANCE_MM * 1000;
+    const int safe_um = Z_AXIS_SAFE_MM * 1000;
+    int down_ms = lab.travelPartialMs(LOW_STAGE_CODE, AXIS_Z, travel_um, safe_um);
+    int up_ms = lab.travelPartialMs(LOW_STAGE_CODE, AXIS_Z, -travel_um, -safe_um);
+    QVERIFY(down_ms > 0);
+    QCOMPARE(up_ms, down_ms);
+    QVERIFY(up_ms < lab.travelMs(LOW_STAGE_CODE, AXIS_Z, -travel_um));
+}
+
+// 流水线模式的上升：Z轴从底部升到孔间高度，越过安全高度需要时间，dwell_ms为0时也不能立即移动X/Y
+void TestULab::upwardRetractCrossing()
+{
+    ULab lab;
+    const int z_down_um = Z_AXIS_TRAVEL_MM * 1000;
+    const int z_retract_um = z_down_um - Z_AXIS_CLEARANCE_MM * 1000;
+    const int z_safe_um = qMax(z_retract_um, z_down_um - Z_AXIS_SAFE_MM * 1000);
+
+    lab.m_axisPos[ULab::axisKey(LOW_STAGE_CODE, AXIS_Z)] = z_down_um;
+    lab.trackMove(LOW_STAGE_CODE, AXIS_Z, z_retract_um, true);
+
+    int cross_ms = lab.crossingMs(LOW_STAGE_CODE, AXIS_Z, z_down_um, z_safe_um);
+    QVERIFY2(cross_ms > 0, qPrintable(QString("crossing %1 ms").arg(cross_ms)));
+    QVERIFY(cross_ms <= lab.remainingMoveMs(LOW_STAGE_CODE, AXIS_Z, z_retract_um));
+    int expected_ms = lab.travelPartialMs(LOW_STAGE_CODE, AXIS_Z, z_retract_um - z_down_um, z_safe_um - z_down_um);
+    QVERIFY(qAbs(cross_ms - expected_ms) <= 20);
+}
+
+// 阈值在起点反方向(已经越过)时，开始移动即越过
+void TestULab::thresholdBehindStart()
+{
+    ULab lab;
+    const int z_down_um = Z_AXIS_TRAVEL_MM * 1000;
+    lab.m_axisPos[ULab::axisKey(LOW_STAGE_CODE, AXIS_Z)] = z_down_um;
+    lab.trackMove(LOW_STAGE_CODE, AXIS_Z, 0, true);
+    QCOMPARE(lab.crossingMs(LOW_STAGE_CODE, AXIS_Z, z_down_um, z_down_um + 1000), 0);
+}
+
+// 默认1 um单位下标准96孔板超出行程：拒绝而不是平移A1，原孔板保持不变
+void TestULab::builtinPlateOutOfTravel()
+{
+    ULab lab;
+    const QPoint a1 = lab.GetPlateLayout(LOW_STAGE_CODE).pos_um.value(0);
+    QVERIFY(!lab.SetPlateFormat(LOW_STAGE_CODE, "96"));
+    QCOMPARE(lab.GetPlateLayout(LOW_STAGE_CODE).format.name, QString("default"));
+    QCOMPARE(lab.GetPlateLayout(LOW_STAGE_CODE).pos_um.value(0), a1);
+}
+
+QTEST_GUILESS_MAIN(TestULab)
+
+#include "tst_ulab.moc"
@@ -0,0 +1,20 @@
+QT       += core serialport testlib
+QT       -= gui
+
+CONFIG += c++11 \
+          console \
+          testcase
+CONFIG -= app_bundle
+
+TARGET = tst_ulab
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+INCLUDEPATH += ..
+
+SOURCES += \
+    tst_ulab.cpp \
+    ../uLab.cpp
+
+HEADERS += \
+    ../uLab.h
@@ -1,17 +1,13 @@
 #include "uLab.h"
 #include <QCoreApplication>
 #include <QtMath>
-
-QString getWellName(int row, int col)
-{
-    if (row < 0 || row > 7 || col < 0 || col > 11) {
-        return "Unknown"; // 边界检查
-    }
-    // 'A' 的ASCII码加上行号 (0-7)，得到 'A'-'H'
-    QChar rowChar = QChar('A' + row);
-    // 列号 (0-11) + 1，得到 1-12
-    return QString("%1%2").arg(rowChar).arg(col + 1);
-}
+#include <QSet>
+#include <QFile>
+#include <QSettings>
+#include <QDateTime>
+#include <QTextStream>
+#include <algorithm>
+#include <functional>
 
 ULab::ULab(QObject *parent) : QObject(parent)
 {
@@ -22,6 +18,14 @@ ULab::ULab(QObject *parent) : QObject(parent)
     pGetFlowTimer = new QTimer(this);
     connect(pPortTimer, &QTimer::timeout, this, &ULab::RefreshPort);
     connect(pParseTimer, &QTimer::timeout, this, &ULab::ParsePort);
+    m_stageClock.start();
+    for (DEVICE_CODE stage : STAGE_CONFIG.keys()) {
+        buildPlateLayout(stage, stageDefaultPlate(stage));
+    }
+    if (QFile::exists(CALIBRATION_FILE)) {
+        LoadCalibration(CALIBRATION_FILE);
+    }
+    loadStageState();
     //    pCRC = new CRC();
 }
 
@@ -90,25 +94,57 @@ void ULab::GotoHole(uint8_t addr, uint8_t hole, uint8_t id)
 void ULab::Home(AXIS axis, DEVICE_CODE id)
 {
     wrtCmdList.append(GenCMD(axis, id, 0x00, 0x00));
+    trackMove(id, axis, 0);
     emit SendMessage(GetAxisName(axis) + " of low-precision table go back to home");
     m_currentPos[id] = QPoint(0,0);
 }
 
-void ULab::Goto(AXIS axis, uint16_t pos, DEVICE_CODE id)
+// 协议位置字段为16位，按位移台的pos_unit_um缩放：行程 = 0xFFFF * pos_unit_um。超出行程时拒绝，不再静默回绕
+bool ULab::Goto(AXIS axis, int pos, DEVICE_CODE id)
+{
+    return sendGoto(axis, pos, id, false);
+}
+
+// immediate为true时不等发送定时器，立即写串口，省去最多CMD_INTERVAL的排队时间；
+// 队列中已有的指令先按顺序写出，不会被超越
+bool ULab::sendGoto(AXIS axis, int pos, DEVICE_CODE id, bool immediate)
 {
-    //    if (pos >= (1<<17)-1)
-    //    {
-    //        emit SendMessage(GetAxisName(axis) + " of low-precision table's destination is out of range!");
-    //        return;
-    //    }
-    //    uint16_t pos_ = pos / 2;
-    wrtCmdList.append(GenCMD(1+axis, id, pos >> 8, pos & 0xff));
+    int unit = posUnitUm(id);
+    int counts = (pos + unit / 2) / unit;
+    if (pos < 0 || counts > 0xFFFF)
+    {
+        emit SendMessage(GetAxisName(axis) + QString(" destination %1 um is out of range (0 ~ %2 um)!").arg(pos).arg(0xFFFF * unit));
+        return false;
+    }
+    QByteArray frame = GenCMD(1+axis, id, counts >> 8, counts & 0xff);
+    immediate = immediate && pPort->isOpen();
+    if (immediate)
+    {
+        if (!writeFrameNow(frame))
+        {
+            return false;
+        }
+    }
+    else
+    {
+        wrtCmdList.append(frame);
+    }
+    trackMove(id, axis, pos, immediate);
     emit SendMessage(GetAxisName(axis) + " of " + (id == LOW_STAGE_CODE ? "low-precision" : "high-precision") + "table go to " + QString::number(pos));
+    return true;
+}
+
+// 位置单位只来自STAGE_CONFIG，不提供运行时修改：单位由控制板固件决定，协议无法查询，
+// 位置回复也按同一单位缩放，读数无法发现单位不一致。修改固件单位后须用实测移动距离核对，再同步修改pos_unit_um
+int ULab::posUnitUm(DEVICE_CODE code) const
+{
+    return STAGE_CONFIG.contains(code) ? qMax(1, STAGE_CONFIG[code].pos_unit_um) : 1;
 }
 
 void ULab::SetSpeedStage(AXIS axis, uint16_t speed, DEVICE_CODE id)
 {
     wrtCmdList.append(GenCMD(2+axis, id, speed >> 8, speed & 0xff));
+    m_axisSpeed[axisKey(id, axis)] = speed;
 }
 
 void ULab::SetTime(AXIS axis, uint16_t time, DEVICE_CODE id)
@@ -245,10 +281,50 @@ void ULab::SetSolenoidValve(uint8_t valves)
 
 void ULab::RefreshPort()
 {
+    // 刚有指令绕过定时器写出时本拍让出，保证相邻指令间隔不小于CMD_INTERVAL
+    if (m_lastDirectWriteMs >= 0 && m_stageClock.elapsed() - m_lastDirectWriteMs < CMD_INTERVAL)
+    {
+        return;
+    }
     if (!wrtCmdList.isEmpty())
     {
         pPort->write(wrtCmdList.takeFirst());
+        m_lastWriteMs = m_stageClock.elapsed();
+    }
+}
+
+// 待写指令排到队尾，由本函数按顺序把队列写空：每条与上一次写入间隔满CMD_INTERVAL再写，
+// 等待期间发送定时器也可能取走队首，两者都从队首按顺序写出，顺序不变。急停时返回false，未写出的本条指令撤回。
+// cancellable为false时间隔等待不响应急停，用于停泵等必须写出的指令
+bool ULab::writeFrameNow(const QByteArray& frame, bool cancellable)
+{
+    wrtCmdList.append(frame);
+    while (!wrtCmdList.isEmpty())
+    {
+        qint64 wait_ms = m_lastWriteMs < 0 ? 0 : m_lastWriteMs + CMD_INTERVAL - m_stageClock.elapsed();
+        if (wait_ms > 0)
+        {
+            if (!cancellable)
+            {
+                MSleep(static_cast<uint>(wait_ms));
+                continue;
+            }
+            if (!MSleepInterruptible(static_cast<uint>(wait_ms), &m_stopToken))
+            {
+                int index = wrtCmdList.lastIndexOf(frame);
+                if (index >= 0)
+                {
+                    wrtCmdList.removeAt(index);
+                }
+                return false;
+            }
+            continue;   // 重新计算间隔，等待期间定时器可能已写出一条
+        }
+        pPort->write(wrtCmdList.takeFirst());
+        m_lastWriteMs = m_stageClock.elapsed();
+        m_lastDirectWriteMs = m_lastWriteMs;
     }
+    return true;
 }
 
 void ULab::ParsePort()
@@ -275,7 +351,8 @@ void ULab::ParsePort()
             case LOW_STAGE_CODE:                //低精度位移台回复指令
             case HIGH_STAGE_CODE:               //高精度位移台回复指令
             {
-                uint pos = ((uint)(uint8_t)cmd.at(3) << 8) + cmd.at(4);
+                int pos = static_cast<int>(((uint)(uint8_t)cmd.at(3) << 8) + (uint8_t)cmd.at(4)) * posUnitUm((DEVICE_CODE)cmd.at(2));
+                m_axisPos[axisKey((DEVICE_CODE)cmd.at(2), (AXIS)(cmd.at(1)-7))] = pos;
                 emit UpdatePos((DEVICE_CODE)cmd.at(2), (AXIS)(cmd.at(1)-7), pos);
                 break;
             }
@@ -283,12 +360,12 @@ void ULab::ParsePort()
             {
                 if (cmd.at(1) == 0x24)
                 {
-                    uint pressure = ((uint)(uint8_t)cmd.at(3) << 8) + cmd.at(4);
+                    uint pressure = ((uint)(uint8_t)cmd.at(3) << 8) + (uint8_t)cmd.at(4);
                     emit UpdatePressure(pressure);
                 }
                 else if (cmd.at(1) == 0x23)
                 {
-                    uint flow = ((uint)(uint8_t)cmd.at(3) << 8) + cmd.at(4);
+                    uint flow = ((uint)(uint8_t)cmd.at(3) << 8) + (uint8_t)cmd.at(4);
                     emit UpdateFlow(flow);
                 }
                 break;
@@ -418,6 +495,588 @@ void MSleep(uint msec)
     loop.exec();
 }
 
+// 可中断的延时函数：令牌取消时立即返回false
+bool MSleepInterruptible(uint msec, const CancelToken* token)
+{
+    if (token && token->IsCancelled()) {
+        return false;
+    }
+    QEventLoop loop;
+    QTimer timer;
+    timer.setSingleShot(true);
+    timer.setTimerType(Qt::PreciseTimer);
+    QObject::connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
+    if (token) {
+        QObject::connect(token, &CancelToken::cancelled, &loop, &QEventLoop::quit);
+    }
+    timer.start(msec);
+    loop.exec();
+    return !(token && token->IsCancelled());
+}
+
+
+// ********************************* 孔板几何定义 **********************************
+
+// 标准孔板 (ANSI/SLAS 孔间距)。A1位置取位移台配置中标定的initial_offset，a1_dx/a1_dy为0；
+// 实际板的A1与标定位置不同时，在孔板定义文件中用同名分组写入实测的a1_dx_um/a1_dy_um覆盖。
+// 注意：默认位置单位1 um时行程为65535 um，这些孔板的Y跨度都超出行程，选用时会报错并给出所需的位置单位
+static const PlateFormat BUILTIN_PLATES[] =
+{
+    //  name,   rows, cols, x_step, y_step, a1_dx, a1_dy
+    {"6",       2,    3,    39120,  39120,  0,     0},
+    {"24",      4,    6,    19300,  19300,  0,     0},
+    {"48",      6,    8,    13080,  13080,  0,     0},
+    {"96",      8,    12,   9000,   9000,   0,     0},
+    {"384",     16,   24,   4500,   4500,   0,     0},
+    {"1536",    32,   48,   2250,   2250,   0,     0},
+};
+
+// 行名：A-Z，之后为AA、AB... (1536孔板为A-AF)
+QString PlateRowName(int row)
+{
+    if (row < 26) {
+        return QString(QChar('A' + row));
+    }
+    return QString(QChar('A' + row / 26 - 1)) + QChar('A' + row % 26);
+}
+
+QStringList ULab::PlateFormatNames() const
+{
+    QStringList names;
+    for (const PlateFormat& plate : BUILTIN_PLATES) {
+        names.append(plate.name);
+    }
+    for (const QString& name : m_customPlates.keys()) {
+        if (!names.contains(name)) {
+            names.append(name);
+        }
+    }
+    return names;
+}
+
+// 位移台默认孔板：沿用STAGE_CONFIG中的行列数和孔间距
+PlateFormat ULab::stageDefaultPlate(DEVICE_CODE stage_type) const
+{
+    const StageParams& params = STAGE_CONFIG[stage_type];
+    return {"default", params.rows, params.cols, params.x_step_um, params.y_step_um, 0, 0};
+}
+
+// 自定义孔板文件 (ini)，每个分组为一种孔板：
+//   [my_plate]
+//   rows=4
+//   cols=6
+//   x_step_um=19300
+//   y_step_um=19300
+//   a1_dx_um=0      ; 可选，实测A1相对位移台A1标定位置的偏移
+//   a1_dy_um=0
+// 分组名与内置孔板相同时覆盖内置定义，用于写入该板实测的A1偏移
+bool ULab::LoadPlateFormats(const QString& path)
+{
+    if (!QFile::exists(path)) {
+        emit SendMessage(QString("错误：孔板定义文件 %1 不存在").arg(path));
+        return false;
+    }
+    QSettings settings(path, QSettings::IniFormat);
+    if (settings.status() != QSettings::NoError) {
+        emit SendMessage(QString("错误：孔板定义文件 %1 格式错误").arg(path));
+        return false;
+    }
+
+    int loaded = 0;
+    for (const QString& group : settings.childGroups()) {
+        settings.beginGroup(group);
+        PlateFormat plate = {group,
+                             settings.value("rows").toInt(),
+                             settings.value("cols").toInt(),
+                             settings.value("x_step_um").toInt(),
+                             settings.value("y_step_um").toInt(),
+                             settings.value("a1_dx_um", 0).toInt(),
+                             settings.value("a1_dy_um", 0).toInt()};
+        settings.endGroup();
+
+        if (plate.rows <= 0 || plate.rows > PLATE_MAX_ROWS || plate.cols <= 0 ||
+            plate.x_step_um <= 0 || plate.y_step_um <= 0) {
+            emit SendMessage(QString("错误：孔板 %1 定义无效，已忽略").arg(group));
+            continue;
+        }
+        m_customPlates[group] = plate;
+        loaded++;
+    }
+    emit SendMessage(QString("已加载 %1 种自定义孔板").arg(loaded));
+    return loaded > 0;
+}
+
+bool ULab::SetPlateFormat(DEVICE_CODE stage_type, const QString& name)
+{
+    if (!STAGE_CONFIG.contains(stage_type)) {
+        emit SendMessage("错误：未知设备类型!");
+        return false;
+    }
+    if (name == "default") {
+        return buildPlateLayout(stage_type, stageDefaultPlate(stage_type));
+    }
+    if (m_customPlates.contains(name)) {
+        return buildPlateLayout(stage_type, m_customPlates[name]);      // 自定义(含实测A1)优先于内置
+    }
+    for (const PlateFormat& plate : BUILTIN_PLATES) {
+        if (plate.name == name) {
+            return buildPlateLayout(stage_type, plate);
+        }
+    }
+    emit SendMessage(QString("错误：未知孔板 %1").arg(name));
+    return false;
+}
+
+// 预先计算整块板的位移台绝对坐标、孔位名和蛇形遍历顺序，遍历和查找时只查表。
+// 行 (A, B...) 沿X轴正方向，列 (1, 2...) 沿Y轴负方向，与位移台安装方向一致。
+// A1固定放在实测位置 (initial_offset + a1_dx/a1_dy)，不自动平移：平移后的坐标上没有真实的孔。
+// 整板超出行程时拒绝，并给出需要的位置单位或需要重新测量的A1。
+bool ULab::buildPlateLayout(DEVICE_CODE stage_type, const PlateFormat& plate)
+{
+    const StageParams& params = STAGE_CONFIG[stage_type];
+    const int span_x = (plate.rows - 1) * plate.x_step_um;
+    const int span_y = (plate.cols - 1) * plate.y_step_um;
+    const int max_um = 0xFFFF * posUnitUm(stage_type);
+    if (span_x > max_um || span_y > max_um) {
+        int unit_um = (qMax(span_x, span_y) + 0xFFFF - 1) / 0xFFFF;
+        emit SendMessage(QString("错误：孔板 %1 跨度 (X: %2 um, Y: %3 um) 超出位移台行程 %4 um，位置单位至少需要 %5 um (控制板固件与STAGE_CONFIG的pos_unit_um须同时修改)")
+                             .arg(plate.name).arg(span_x).arg(span_y).arg(max_um).arg(unit_um));
+        return false;
+    }
+    const int a1_x = params.initial_offset_x_um + plate.a1_dx_um;
+    const int a1_y = params.initial_offset_y_um + plate.a1_dy_um;
+    const int last_x = a1_x + span_x;
+    const int last_y = a1_y - span_y;
+    if (a1_x < 0 || last_x > max_um || last_y < 0 || a1_y > max_um) {
+        emit SendMessage(QString("错误：孔板 %1 在实测A1 (%2, %3) um 处超出位移台行程 0~%4 um (X: %5~%6 um, Y: %7~%8 um)。"
+                                 "请确认板的放置，重新测量该板A1并在孔板定义文件中写入a1_dx_um/a1_dy_um")
+                             .arg(plate.name).arg(a1_x).arg(a1_y).arg(max_um)
+                             .arg(a1_x).arg(last_x).arg(last_y).arg(a1_y));
+        return false;
+    }
+
+    PlateLayout layout;
+    layout.format = plate;
+    const int count = plate.rows * plate.cols;
+    layout.pos_um.reserve(count);
+    layout.names.reserve(count);
+    layout.serpentine.reserve(count);
+    for (int row = 0; row < plate.rows; ++row) {
+        layout.row_names.append(PlateRowName(row));
+        for (int col = 0; col < plate.cols; ++col) {
+            layout.pos_um.append(QPoint(a1_x + row * plate.x_step_um, a1_y - col * plate.y_step_um));
+            layout.names.append(layout.row_names[row] + QString::number(col + 1));
+            layout.index.insert(layout.names.last(), row * plate.cols + col);
+        }
+        // 偶数行 (A, C, E...) 列号从小到大，奇数行从大到小
+        for (int k = 0; k < plate.cols; ++k) {
+            int col = (row % 2 == 0) ? k : plate.cols - 1 - k;
+            layout.serpentine.append(row * plate.cols + col);
+        }
+    }
+
+    m_plateLayout[stage_type] = layout;
+    emit SendMessage(QString("[%1] 孔板：%2 (%3x%4)")
+                         .arg(stage_type == LOW_STAGE_CODE ? "低精度" : "高精度")
+                         .arg(plate.name).arg(plate.rows).arg(plate.cols));
+    return true;
+}
+
+const PlateLayout& ULab::GetPlateLayout(DEVICE_CODE stage_type) const
+{
+    static const PlateLayout empty = PlateLayout();
+    auto it = m_plateLayout.find(stage_type);
+    return it != m_plateLayout.end() ? *it : empty;
+}
+
+// ********************************* 孔位标定 **********************************
+
+// 标定模型：偏差(读数 - 指令) 在位移台坐标上的双线性拟合 b = c0 + c1*x + c2*y + c3*x*y (x, y单位mm)。
+// 参考点不足4个或共线时依次退化为平面拟合和常数偏差。terms为使用的基函数个数 (4, 3 或 1)。
+static bool fitCalibration(const QList<CalibrationPoint>& points, int terms, double coef_x[4], double coef_y[4])
+{
+    double a[4][6] = {};   // 法方程增广矩阵：[A^T A | A^T bx | A^T by]
+    for (const CalibrationPoint& p : points) {
+        double x = p.pos_um.x() / 1000.0, y = p.pos_um.y() / 1000.0;
+        double basis[4] = {1.0, x, y, x * y};
+        for (int i = 0; i < terms; ++i) {
+            for (int j = 0; j < terms; ++j) {
+                a[i][j] += basis[i] * basis[j];
+            }
+            a[i][terms] += basis[i] * p.bias_um.x();
+            a[i][terms + 1] += basis[i] * p.bias_um.y();
+        }
+    }
+
+    // 列主元高斯消元
+    for (int col = 0; col < terms; ++col) {
+        int pivot = col;
+        for (int row = col + 1; row < terms; ++row) {
+            if (qAbs(a[row][col]) > qAbs(a[pivot][col])) pivot = row;
+        }
+        if (qAbs(a[pivot][col]) < 1e-9) {
+            return false;
+        }
+        for (int k = 0; k < terms + 2; ++k) {
+            std::swap(a[col][k], a[pivot][k]);
+        }
+        for (int row = 0; row < terms; ++row) {
+            if (row == col) continue;
+            double f = a[row][col] / a[col][col];
+            for (int k = col; k < terms + 2; ++k) {
+                a[row][k] -= f * a[col][k];
+            }
+        }
+    }
+
+    for (int i = 0; i < 4; ++i) {
+        coef_x[i] = i < terms ? a[i][terms] / a[i][i] : 0.0;
+        coef_y[i] = i < terms ? a[i][terms + 1] / a[i][i] : 0.0;
+    }
+    return true;
+}
+
+void ULab::refitCalibration(DEVICE_CODE stage_type)
+{
+    const QList<CalibrationPoint>& points = m_calibPoints[stage_type];
+    CalibrationFit fit = {};
+    const int n = points.size();
+    for (int terms : {4, 3, 1}) {
+        if (n >= terms && fitCalibration(points, terms, fit.coef_x, fit.coef_y)) {
+            fit.terms = terms;
+            break;
+        }
+    }
+    m_calibFit[stage_type] = fit;
+}
+
+// 目标位置处的预期偏差(读数 - 指令)，没有标定数据时为0
+QPoint ULab::calibrationBias(DEVICE_CODE stage_type, QPoint target_um) const
+{
+    auto it = m_calibFit.find(stage_type);
+    if (it == m_calibFit.end() || (*it).terms == 0) {
+        return QPoint(0, 0);
+    }
+    const CalibrationFit& fit = *it;
+    double x = target_um.x() / 1000.0, y = target_um.y() / 1000.0;
+    double basis[4] = {1.0, x, y, x * y};
+    double bx = 0, by = 0;
+    for (int i = 0; i < 4; ++i) {
+        bx += fit.coef_x[i] * basis[i];
+        by += fit.coef_y[i] * basis[i];
+    }
+    return QPoint(qRound(bx), qRound(by));
+}
+
+// 按偏差补偿发出移动指令：指令坐标 = 目标 - 偏差，位置确认时的预期读数仍为目标
+bool ULab::gotoCompensated(DEVICE_CODE stage_type, AXIS axis, int target_um, int bias_um, bool immediate)
+{
+    int command_um = target_um - bias_um;
+    if (!sendGoto(axis, command_um, STAGE_CONFIG[stage_type].code, immediate)) {
+        return false;
+    }
+    if (bias_um != 0) {
+        m_axisBias[axisKey(stage_type, axis)] = bias_um;
+    }
+    return true;
+}
+
+void ULab::SetCalibrationPoint(DEVICE_CODE stage_type, QPoint pos_um, QPoint bias_um)
+{
+    QList<CalibrationPoint>& points = m_calibPoints[stage_type];
+    for (int i = 0; i < points.size(); ++i) {
+        if (points[i].pos_um == pos_um) {
+            points.removeAt(i);
+            break;
+        }
+    }
+    points.append({pos_um, bias_um});
+    refitCalibration(stage_type);
+    emit SendMessage(QString("标定点 (%1, %2) 偏差 (%3, %4) um，共 %5 个标定点")
+                         .arg(pos_um.x()).arg(pos_um.y()).arg(bias_um.x()).arg(bias_um.y()).arg(points.size()));
+}
+
+void ULab::ClearCalibration(DEVICE_CODE stage_type)
+{
+    m_calibPoints.remove(stage_type);
+    m_calibFit.remove(stage_type);
+}
+
+// 不补偿地移动到参考孔位，读数稳定后记录 读数 - 指令 作为该处偏差
+bool ULab::CalibrateWell(DEVICE_CODE stage_type, const QString& wellName)
+{
+    QPoint nominal;
+    if (!STAGE_CONFIG.contains(stage_type) || !wellPosition(stage_type, wellName, nominal)) {
+        emit SendMessage(QString("错误：无法标定孔位 %1").arg(wellName));
+        return false;
+    }
+    DEVICE_CODE code = STAGE_CONFIG[stage_type].code;
+    emit SendMessage(QString("标定孔位 %1 ...").arg(wellName));
+    if (!Goto(AXIS_X, nominal.x(), code) || !Goto(AXIS_Y, nominal.y(), code)) {
+        return false;
+    }
+    waitForMove(stage_type, AXIS_X, nominal.x(), 3000);
+    waitForMove(stage_type, AXIS_Y, nominal.y(), 3000);
+
+    const int key_x = axisKey(stage_type, AXIS_X), key_y = axisKey(stage_type, AXIS_Y);
+    QPoint prev(-1, -1);
+    for (int i = 0; i < 20; ++i) {
+        if (!pollPosNow(AXIS_X, code) || !pollPosNow(AXIS_Y, code) ||
+            !MSleepInterruptible(POS_POLL_LEAD_MS, &m_stopToken)) {
+            emit SendMessage(QString("孔位 %1 标定被急停中断").arg(wellName));
+            return false;
+        }
+        QPoint reading(m_axisPos.value(key_x, -1), m_axisPos.value(key_y, -1));
+        if (reading.x() >= 0 && reading.y() >= 0 && prev.x() >= 0 &&
+            qAbs(reading.x() - prev.x()) <= POS_SETTLE_DELTA_UM && qAbs(reading.y() - prev.y()) <= POS_SETTLE_DELTA_UM) {
+            SetCalibrationPoint(stage_type, nominal, QPoint(reading.x() - nominal.x(), reading.y() - nominal.y()));
+            return true;
+        }
+        prev = reading;
+    }
+    emit SendMessage(QString("错误：孔位 %1 位置读数不稳定，标定失败").arg(wellName));
+    return false;
+}
+
+static QString stageKey(DEVICE_CODE stage_type)
+{
+    return stage_type == LOW_STAGE_CODE ? "LOW_STAGE" : "HIGH_STAGE";
+}
+
+bool ULab::SaveCalibration(const QString& path)
+{
+    QSettings settings(path, QSettings::IniFormat);
+    for (DEVICE_CODE stage : STAGE_CONFIG.keys()) {
+        const QList<CalibrationPoint> points = m_calibPoints.value(stage);
+        settings.remove(stageKey(stage));
+        settings.beginWriteArray(stageKey(stage), points.size());
+        for (int i = 0; i < points.size(); ++i) {
+            settings.setArrayIndex(i);
+            settings.setValue("x_um", points[i].pos_um.x());
+            settings.setValue("y_um", points[i].pos_um.y());
+            settings.setValue("bias_x_um", points[i].bias_um.x());
+            settings.setValue("bias_y_um", points[i].bias_um.y());
+        }
+        settings.endArray();
+    }
+    settings.remove("pumps");
+    settings.beginWriteArray("pumps", m_pumpCal.size());
+    int index = 0;
+    for (uint8_t id : m_pumpCal.keys()) {
+        settings.setArrayIndex(index++);
+        settings.setValue("id", id);
+        settings.setValue("ul_per_s_per_unit", m_pumpCal.value(id));
+    }
+    settings.endArray();
+    settings.sync();
+    if (settings.status() != QSettings::NoError) {
+        emit SendMessage(QString("错误：标定数据保存失败 %1").arg(path));
+        return false;
+    }
+    return true;
+}
+
+bool ULab::LoadCalibration(const QString& path)
+{
+    if (!QFile::exists(path)) {
+        emit SendMessage(QString("错误：标定文件 %1 不存在").arg(path));
+        return false;
+    }
+    QSettings settings(path, QSettings::IniFormat);
+    for (DEVICE_CODE stage : STAGE_CONFIG.keys()) {
+        QList<CalibrationPoint> points;
+        int n = settings.beginReadArray(stageKey(stage));
+        for (int i = 0; i < n; ++i) {
+            settings.setArrayIndex(i);
+            points.append({QPoint(settings.value("x_um").toInt(), settings.value("y_um").toInt()),
+                           QPoint(settings.value("bias_x_um").toInt(), settings.value("bias_y_um").toInt())});
+        }
+        settings.endArray();
+        m_calibPoints[stage] = points;
+        refitCalibration(stage);
+        emit SendMessage(QString("[%1] 已加载 %2 个标定点").arg(stage == LOW_STAGE_CODE ? "低精度" : "高精度").arg(n));
+    }
+    m_pumpCal.clear();
+    int pumps = settings.beginReadArray("pumps");
+    for (int i = 0; i < pumps; ++i) {
+        settings.setArrayIndex(i);
+        double cal = settings.value("ul_per_s_per_unit").toDouble();
+        if (cal > 0) {
+            m_pumpCal[static_cast<uint8_t>(settings.value("id").toUInt())] = cal;
+        }
+    }
+    settings.endArray();
+    if (!m_pumpCal.isEmpty()) {
+        emit SendMessage(QString("已加载 %1 个蠕动泵流量标定").arg(m_pumpCal.size()));
+    }
+    return true;
+}
+
+// ********************************* 位移台状态 **********************************
+
+// 可信状态：Z轴归位后记录，每次运动流程正常结束时更新最后确认的位置并写入文件。
+// 运动流程进行中、急停、位置确认超时或读数与记录不一致(如控制板断电重启)时状态失效，下次运动前重新归位。
+
+QString StageStateReasonName(STAGE_STATE_REASON reason)
+{
+    switch (reason)
+    {
+    case STATE_VALID:             return "有效";
+    case STATE_NEVER_HOMED:       return "未归位";
+    case STATE_IN_MOTION:         return "上次运动未正常结束";
+    case STATE_EMERGENCY_STOP:    return "急停";
+    case STATE_TIMEOUT:           return "位置确认超时";
+    case STATE_POSITION_MISMATCH: return "读数与记录不一致(可能断电重启)";
+    default:                      return "未知";
+    }
+}
+
+bool ULab::IsStageStateValid(DEVICE_CODE stage_type) const
+{
+    const StageState state = m_stageState.value(stage_type);
+    return state.homed && state.reason == STATE_VALID;
+}
+
+void ULab::InvalidateStageState(DEVICE_CODE stage_type, STAGE_STATE_REASON reason)
+{
+    StageState& state = m_stageState[stage_type];
+    if (state.reason == reason) {
+        return;
+    }
+    state.reason = reason;
+    saveStageState();
+    emit SendMessage(QString("[%1] 位移台状态失效：%2")
+                         .arg(stage_type == LOW_STAGE_CODE ? "低精度" : "高精度").arg(StageStateReasonName(reason)));
+}
+
+// 状态有效时再查询一次三轴读数，与记录一致才信任
+bool ULab::stageStateTrusted(DEVICE_CODE stage_type)
+{
+    if (!IsStageStateValid(stage_type)) {
+        return false;
+    }
+    const StageState state = m_stageState[stage_type];
+    DEVICE_CODE code = STAGE_CONFIG[stage_type].code;
+    const QList<AXIS> axes = {AXIS_X, AXIS_Y, AXIS_Z};
+    const QList<int> expected = {state.xy_um.x(), state.xy_um.y(), state.z_um};
+    for (AXIS axis : axes) {
+        m_axisPos.remove(axisKey(stage_type, axis));
+        if (!pollPosNow(axis, code)) {
+            return false;
+        }
+    }
+    if (!MSleepInterruptible(POS_POLL_LEAD_MS, &m_stopToken)) {
+        return false;
+    }
+    for (int i = 0; i < axes.size(); ++i) {
+        int reading = m_axisPos.value(axisKey(stage_type, axes[i]), -1);
+        if (reading < 0 || qAbs(reading - expected[i]) > POS_TOLERANCE_UM) {
+            InvalidateStageState(stage_type, STATE_POSITION_MISMATCH);
+            return false;
+        }
+    }
+    return true;
+}
+
+// 运动前准备Z轴：状态可信时跳过归位，只把Z轴移回原位；否则Z轴归位。
+// 之后状态标记为运动中，流程异常中断时下次运动会重新归位。
+void ULab::prepareStageZ(DEVICE_CODE stage_type, int fallback_ms)
+{
+    DEVICE_CODE code = STAGE_CONFIG[stage_type].code;
+    StageState& state = m_stageState[stage_type];
+    bool trusted = stageStateTrusted(stage_type);
+    if (m_stopToken.IsCancelled()) {
+        return; // 急停时不归位，状态保持原样
+    }
+    if (trusted) {
+        emit SendMessage("位移台状态有效，跳过Z轴归位");
+        if (qAbs(state.z_um) > POS_EXACT_UM) {
+            Goto(AXIS_Z, 0, code);
+            waitForMove(stage_type, AXIS_Z, 0, fallback_ms);
+        }
+    } else {
+        emit SendMessage(QString("开始Z轴归位 (位移台状态：%1)...").arg(StageStateReasonName(state.reason)));
+        Home(AXIS_Z, code);
+        waitForMove(stage_type, AXIS_Z, 0, fallback_ms);
+        state.homed = true;
+    }
+    state.reason = STATE_IN_MOTION;
+    saveStageState();
+}
+
+// 运动流程正常结束：三轴都按最后的指令目标重新查询确认，只记录确认过的读数，状态重新有效。
+// 定向移动等流程中单轴移动不确认位置，m_axisPos可能还是流程开始时的读数，不能直接记录。
+// 目标未知或确认失败时状态保持失效，下次运动前重新归位。
+void ULab::finishStageRun(DEVICE_CODE stage_type)
+{
+    if (m_stageState[stage_type].reason != STATE_IN_MOTION) {
+        return; // 运动过程中已失效
+    }
+    const QList<AXIS> axes = {AXIS_X, AXIS_Y, AXIS_Z};
+    QList<int> targets;
+    for (AXIS axis : axes) {
+        int key = axisKey(stage_type, axis);
+        if (m_axisTarget.value(key, -1) < 0) {
+            InvalidateStageState(stage_type, STATE_NEVER_HOMED);
+            return;
+        }
+        targets.append(m_axisTarget[key] + m_axisBias.value(key, 0));   // 补偿移动时按预期读数确认
+    }
+    QList<int> last;
+    if (!waitForAxes(stage_type, axes, targets, last, 3000)) {
+        if (m_stopToken.IsCancelled()) {
+            InvalidateStageState(stage_type, STATE_EMERGENCY_STOP);
+        }
+        return; // 超时已由waitForAxes置为STATE_TIMEOUT
+    }
+
+    StageState& state = m_stageState[stage_type];
+    state.xy_um = QPoint(last[0], last[1]);
+    state.z_um = last[2];
+    state.well = m_currentPos.value(stage_type, QPoint(-1, -1));
+    state.reason = STATE_VALID;
+    saveStageState();
+}
+
+void ULab::saveStageState()
+{
+    QSettings settings(STAGE_STATE_FILE, QSettings::IniFormat);
+    for (DEVICE_CODE stage : m_stageState.keys()) {
+        const StageState& state = m_stageState[stage];
+        settings.beginGroup(stageKey(stage));
+        settings.setValue("homed", state.homed);
+        settings.setValue("reason", static_cast<int>(state.reason));
+        settings.setValue("x_um", state.xy_um.x());
+        settings.setValue("y_um", state.xy_um.y());
+        settings.setValue("z_um", state.z_um);
+        settings.setValue("well_x", state.well.x());
+        settings.setValue("well_y", state.well.y());
+        settings.setValue("updated", QDateTime::currentDateTime().toString(Qt::ISODate));
+        settings.endGroup();
+    }
+    settings.sync();
+}
+
+void ULab::loadStageState()
+{
+    QSettings settings(STAGE_STATE_FILE, QSettings::IniFormat);
+    for (DEVICE_CODE stage : STAGE_CONFIG.keys()) {
+        StageState state = {false, QPoint(-1, -1), 0, QPoint(-1, -1), STATE_NEVER_HOMED};
+        if (settings.childGroups().contains(stageKey(stage))) {
+            settings.beginGroup(stageKey(stage));
+            state.homed = settings.value("homed", false).toBool();
+            state.reason = static_cast<STAGE_STATE_REASON>(settings.value("reason", STATE_NEVER_HOMED).toInt());
+            state.xy_um = QPoint(settings.value("x_um", -1).toInt(), settings.value("y_um", -1).toInt());
+            state.z_um = settings.value("z_um", 0).toInt();
+            state.well = QPoint(settings.value("well_x", -1).toInt(), settings.value("well_y", -1).toInt());
+            settings.endGroup();
+        }
+        m_stageState[stage] = state;
+        if (state.reason == STATE_VALID) {
+            m_currentPos[stage] = state.well;
+        }
+    }
+}
 
 // ******************************* 低精度位移台运动控制 *********************************
 
@@ -433,7 +1092,7 @@ void ULab::MoveStage(DEVICE_CODE stage_type,
                      int speed_y,
                      int dwell_ms) // dwell_ms 是X/Y轴的停留时间
 {
-    m_emergencyFlag.storeRelaxed(0);
+    m_stopToken.Reset();
 
     if(!STAGE_CONFIG.contains(stage_type))
     {
@@ -441,15 +1100,16 @@ void ULab::MoveStage(DEVICE_CODE stage_type,
         return;
     }
     auto params = STAGE_CONFIG[stage_type];
+    const PlateFormat& plate = m_plateLayout[stage_type].format;
 
     emit SendMessage("开始Z轴归位/回到初始安全位置...");
-    Home(AXIS_Z, params.code);
+    prepareStageZ(stage_type, 5000);
 
     // 检查是否需要移动到起始位置
     QPoint current_pos_xy = m_currentPos.value(stage_type, QPoint(-1,-1)); // 仅用于X, Y
     if(current_pos_xy != target_start_pos)
     {
-        if(m_emergencyFlag.loadRelaxed())
+        if(m_stopToken.IsCancelled())
         {
             emit SendMessage("急停激活，校准取消");
             return;
@@ -459,18 +1119,34 @@ void ULab::MoveStage(DEVICE_CODE stage_type,
                              .arg(current_pos_xy.x()).arg(current_pos_xy.y())
                              .arg(target_start_pos.x()).arg(target_start_pos.y()));
 
-        // X轴校准
-        if(target_start_pos.x() != current_pos_xy.x())
+        int target_x_um = target_start_pos.x() * plate.x_step_um;
+        int target_y_um = target_start_pos.y() * plate.y_step_um;
+        if(target_start_pos.x() != current_pos_xy.x() && target_start_pos.y() != current_pos_xy.y())
         {
-            Goto(AXIS_X, static_cast<uint16_t>(target_start_pos.x() * params.x_step_um), params.code);
-            MSleep(1500); // 等待X轴移动
+            // X/Y轴同时校准
+            if(!MoveXY(QPoint(target_x_um, target_y_um), params.code))
+            {
+                emit SendMessage("起始位置校准失败，流程中止");
+                return;
+            }
         }
-
-        // Y轴校准
-        if(target_start_pos.y() != current_pos_xy.y())
+        else if(target_start_pos.x() != current_pos_xy.x())
+        {
+            // X轴校准
+            if (!Goto(AXIS_X, target_x_um, params.code)) {
+                emit SendMessage("起始位置超出行程，流程中止");
+                return;
+            }
+            waitForMove(stage_type, AXIS_X, target_x_um, 1500); // 等待X轴移动
+        }
+        else
         {
-            Goto(AXIS_Y, static_cast<uint16_t>(target_start_pos.y() * params.y_step_um), params.code);
-            MSleep(1500); // 等待Y轴移动
+            // Y轴校准
+            if (!Goto(AXIS_Y, target_y_um, params.code)) {
+                emit SendMessage("起始位置超出行程，流程中止");
+                return;
+            }
+            waitForMove(stage_type, AXIS_Y, target_y_um, 1500); // 等待Y轴移动
         }
         m_currentPos[stage_type] = target_start_pos; // 更新X,Y当前位置
     }
@@ -485,9 +1161,9 @@ void ULab::MoveStage(DEVICE_CODE stage_type,
     MSleep(100); // 等待速度设置指令发送
 
     // 假设Z轴的初始/原点位置为0um。如果不是，需要调整。
-    const uint16_t z_original_pos_um = 0;
-    const uint16_t z_travel_um = Z_AXIS_TRAVEL_MM * 1000;
-    const uint16_t z_down_pos_um = z_original_pos_um + z_travel_um;
+    const int z_original_pos_um = 0;
+    const int z_travel_um = Z_AXIS_TRAVEL_MM * 1000;
+    const int z_down_pos_um = z_original_pos_um + z_travel_um;
 
 
     // 计算Z轴移动所需时间 (ms)
@@ -514,7 +1190,7 @@ void ULab::MoveStage(DEVICE_CODE stage_type,
     // 分步移动
     for(int step = 0; step < total_steps; ++step)
     {
-        if(m_emergencyFlag.loadAcquire())
+        if(m_stopToken.IsCancelled())
         {
             emit SendMessage("移动被急停中断");
             return;
@@ -535,18 +1211,21 @@ void ULab::MoveStage(DEVICE_CODE stage_type,
             return;
         }
 
-        if(new_xy_pos.x() < 0 || new_xy_pos.x() >= params.cols ||
-            new_xy_pos.y() < 0 || new_xy_pos.y() >= params.rows)
+        if(new_xy_pos.x() < 0 || new_xy_pos.x() >= plate.cols ||
+            new_xy_pos.y() < 0 || new_xy_pos.y() >= plate.rows)
         {
             emit SendMessage("移动超出孔板范围!");
             return;
         }
 
         // 执行X或Y轴单步移动
-        uint16_t target_xy_pos_um = (direction == AXIS_X ? static_cast<uint16_t>(new_xy_pos.x() * params.x_step_um)
-                                                         : static_cast<uint16_t>(new_xy_pos.y() * params.y_step_um));
-        Goto(direction, target_xy_pos_um, params.code);
-        MSleep(800); // 等待X或Y轴移动完成 (这个延时需要根据实际情况调整)
+        int target_xy_pos_um = (direction == AXIS_X ? new_xy_pos.x() * plate.x_step_um
+                                                    : new_xy_pos.y() * plate.y_step_um);
+        if (!Goto(direction, target_xy_pos_um, params.code)) {
+            emit SendMessage(QString("步骤%1目标超出行程，移动中止").arg(step + 1));
+            return;
+        }
+        waitForMove(stage_type, direction, target_xy_pos_um, 800); // 等待X或Y轴移动完成
 
         m_currentPos[stage_type] = new_xy_pos; // 更新X,Y当前位置
         emit SendMessage(QString("[%1] X/Y轴已到达步骤%2/%3 - 位置(%4,%5)")
@@ -555,42 +1234,42 @@ void ULab::MoveStage(DEVICE_CODE stage_type,
                              .arg(new_xy_pos.x()).arg(new_xy_pos.y()));
 
         // --- Z轴操作开始 ---
-        if(m_emergencyFlag.loadAcquire())
+        if(m_stopToken.IsCancelled())
         { emit SendMessage("Z轴操作前急停"); return; }
         emit SendMessage(QString("Z轴开始向下移动 %1 mm").arg(Z_AXIS_TRAVEL_MM));
-        Goto(AXIS_Z, z_down_pos_um, params.code);
-        MSleep(z_move_duration_ms + 200); // 等待Z轴向下移动完成，额外200ms缓冲
+        if (!Goto(AXIS_Z, z_down_pos_um, params.code)) {
+            emit SendMessage("Z轴下降目标超出行程，移动中止");
+            return;
+        }
+        waitForMove(stage_type, AXIS_Z, z_down_pos_um, z_move_duration_ms + 200); // 等待Z轴向下移动完成
 
-        if(m_emergencyFlag.loadAcquire())
+        if(m_stopToken.IsCancelled())
         { emit SendMessage("Z轴向下移动后急停"); return; }
         emit SendMessage(QString("Z轴在底部停留 %1 ms").arg(Z_AXIS_DWELL_MS));
-        MSleep(Z_AXIS_DWELL_MS);
+        MSleepInterruptible(Z_AXIS_DWELL_MS, &m_stopToken);
 
-        if(m_emergencyFlag.loadAcquire())
+        if(m_stopToken.IsCancelled())
         { emit SendMessage("Z轴停留后急停"); return; }
         emit SendMessage("Z轴开始向上移动到原位");
-        Goto(AXIS_Z, z_original_pos_um, params.code);
-        MSleep(z_move_duration_ms + 200); // 等待Z轴向上移动完成，额外200ms缓冲
+        if (!Goto(AXIS_Z, z_original_pos_um, params.code)) {
+            emit SendMessage("Z轴上升目标超出行程，移动中止");
+            return;
+        }
+        waitForMove(stage_type, AXIS_Z, z_original_pos_um, z_move_duration_ms + 200); // 等待Z轴向上移动完成
         // --- Z轴操作结束 ---
 
         // X/Y轴的停留时间
         if (dwell_ms > 0) {
-            if(m_emergencyFlag.loadAcquire()) { emit SendMessage("X/Y停留前急停"); return; }
+            if(m_stopToken.IsCancelled()) { emit SendMessage("X/Y停留前急停"); return; }
             emit SendMessage(QString("X/Y轴在位置(%1,%2)停留 %3 ms").arg(new_xy_pos.x()).arg(new_xy_pos.y()).arg(dwell_ms));
-                // 使用循环和processEvents允许在长延时期间响应急停
-            for(int i = 0; i < dwell_ms / 100; ++i) {
-                if(m_emergencyFlag.loadAcquire()) {
-                    emit SendMessage("X/Y停留期间触发急停");
-                    return;
-                }
-                MSleep(100);
-                QCoreApplication::processEvents();
-            }
-            if (dwell_ms % 100 > 0) { // 处理余下的延时
-                MSleep(dwell_ms % 100);
+            // 急停令牌取消时立即结束停留
+            if (!MSleepInterruptible(dwell_ms, &m_stopToken)) {
+                emit SendMessage("X/Y停留期间触发急停");
+                return;
             }
         }
     }
+    finishStageRun(stage_type);
     emit SendMessage(QString("[%1] 定向移动完成").arg(stage_type == LOW_STAGE_CODE ? "低精度" : "高精度"));
 }
 
@@ -599,9 +1278,9 @@ void ULab::MoveStage(DEVICE_CODE stage_type,
 // ********************************* 全板遍历运动控制 **********************************
 
 
-void ULab::MoveStage(DEVICE_CODE stage_type, int speed_x, int speed_y, int dwell_ms) // dwell_ms,停留时间，即加液时间
+void ULab::MoveStage(DEVICE_CODE stage_type, int speed_x, int speed_y, int dwell_ms, bool pipelined, int z_clearance_mm) // dwell_ms,停留时间，即加液时间
 {
-    m_emergencyFlag.storeRelaxed(0); // 重置急停标志
+    m_stopToken.Reset(); // 重置急停标志
 
     if(!STAGE_CONFIG.contains(stage_type)) {
         emit SendMessage("错误：未知设备类型!");
@@ -625,15 +1304,13 @@ void ULab::MoveStage(DEVICE_CODE stage_type, int speed_x, int speed_y, int dwell
     // emit SendMessage("开始Y轴归位...");
     // Home(AXIS_Y, params.code);
     // MSleep(5000);
-    emit SendMessage("开始Z轴归位...");
-    Home(AXIS_Z, params.code);
-    MSleep(5000);
+    prepareStageZ(stage_type, 5000);
 
-    m_currentPos[stage_type] = QPoint(-1,-1); // 归位后，逻辑孔位为-1,-1 (在A1之前)
+    m_currentPos[stage_type] = QPoint(-1,-1); // 遍历开始前，逻辑孔位为-1,-1 (在A1之前)
 
-    const uint16_t z_original_pos_um = 0; // 假设Z轴归位后为0um
-    const uint16_t z_travel_um = Z_AXIS_TRAVEL_MM * 1000;
-    const uint16_t z_down_pos_um = z_original_pos_um + z_travel_um;
+    const int z_original_pos_um = 0; // 假设Z轴归位后为0um
+    const int z_travel_um = Z_AXIS_TRAVEL_MM * 1000;
+    const int z_down_pos_um = z_original_pos_um + z_travel_um;
 
     int z_move_duration_ms = 0;
     if (actual_z_speed > 0 && params.code != PUMP_CODE) {
@@ -656,8 +1333,9 @@ void ULab::MoveStage(DEVICE_CODE stage_type, int speed_x, int speed_y, int dwell
     bool y_ok = false;         // 初始化Y轴成功标志
     int last_x = -1, last_y = -1; // 定义变量以接收当前坐标
 
-    uint16_t a1_target_x = params.initial_offset_x_um;
-    uint16_t a1_target_y = params.initial_offset_y_um;
+    const PlateLayout layout = m_plateLayout[stage_type]; // 遍历期间孔板不随SetPlateFormat改变
+    int a1_target_x = layout.pos_um[0].x();
+    int a1_target_y = layout.pos_um[0].y();
 
     // 进入重试循环，直到成功或达到最大次数
     while (retry_count < max_retries) {
@@ -667,15 +1345,11 @@ void ULab::MoveStage(DEVICE_CODE stage_type, int speed_x, int speed_y, int dwell
             emit SendMessage(QString("    当前 -> X: %1, Y: %2").arg(last_x).arg(last_y));
         }
 
-        // 每次重试都重新发送移动指令
-        Goto(AXIS_X, a1_target_x, params.code);
-        MSleep(5000);
-        Goto(AXIS_Y, a1_target_y, params.code);
-        MSleep(5000);
-
-        // 调用函数进行位置确认
-        x_ok = waitForPosition(stage_type, AXIS_X, a1_target_x, last_x);
-        y_ok = waitForPosition(stage_type, AXIS_Y, a1_target_y, last_y);
+        // 每次重试都重新发送移动指令，X/Y两轴同时移动并一起确认位置
+        QPoint last_xy;
+        x_ok = y_ok = MoveXY(QPoint(a1_target_x, a1_target_y), params.code, &last_xy);
+        last_x = last_xy.x();
+        last_y = last_xy.y();
 
         // 如果两轴都已到位，则成功，跳出重试循环
         if (x_ok && y_ok) {
@@ -684,7 +1358,7 @@ void ULab::MoveStage(DEVICE_CODE stage_type, int speed_x, int speed_y, int dwell
 
         // 如果失败，增加计数器，准备下一次重试
         retry_count++;
-        MSleep(500); // 重试前短暂延时
+        if (!MSleepInterruptible(500, &m_stopToken)) { emit SendMessage("定位A1被急停中断"); return; } // 重试前短暂延时
     }
 
     // 在循环结束后，最终检查是否成功。如果不成功，则说明所有重试都已失败。
@@ -697,83 +1371,525 @@ void ULab::MoveStage(DEVICE_CODE stage_type, int speed_x, int speed_y, int dwell
 
     // --- A1点的特殊处理逻辑 ---
     emit SendMessage("已成功到达A1点，1秒后开始加液遍历运动");
-    MSleep(1000);
-
+    if (!MSleepInterruptible(1000, &m_stopToken)) { emit SendMessage("遍历被急停中断"); return; }
+
+    // 流水线模式下Z轴只上升到底部以上z_clearance_mm，越过安全高度(Z_AXIS_SAFE_MM)即发出下一次X/Y移动，
+    // Z轴下降按X/Y预计到达时刻提前发出，与X/Y移动末段重叠，见pipelinedMoveXY。
+    const int z_clearance_um = qBound(0, z_clearance_mm, (int)Z_AXIS_TRAVEL_MM) * 1000;
+    const int z_retract_pos_um = pipelined ? z_down_pos_um - z_clearance_um : z_original_pos_um;
+    if (pipelined) {
+        emit SendMessage(QString("流水线模式：Z轴在孔位之间只上升 %1 mm").arg(z_clearance_mm));
+    }
     // A1点的加液操作 (Z轴)
-    emit SendMessage(QString("Z轴下降加液..."));
-    Goto(AXIS_Z, z_down_pos_um, params.code);
-    MSleep(z_move_duration_ms + 200);
+    if (!visitWell(stage_type, "A1", dwell_ms, z_retract_pos_um, z_move_duration_ms + 200, pipelined)) { emit SendMessage("遍历被急停中断"); return; }
+
+
+    // 蛇形遍历：按坐标表中预先排好的蛇形顺序访问，行 (A, B, C...) 对应X轴，列 (1, 2, 3...) 对应Y轴
+    // 换行时先移动X轴并确认，行内只移动Y轴
+    int current_x_um = a1_target_x;
+    int current_y_um = a1_target_y;
+    for(int k = 1; k < layout.serpentine.size(); ++k) {
+        if(m_stopToken.IsCancelled()) { emit SendMessage("遍历被急停中断"); return; }
+
+        const int idx = layout.serpentine[k];
+        const QPoint& target_um = layout.pos_um[idx];
+        const QString& wellName = layout.names[idx];
+
+        if (pipelined) {
+            QPoint last_xy;
+            if (!pipelinedMoveXY(stage_type, QPoint(current_x_um, current_y_um), target_um, z_retract_pos_um, &last_xy)) {
+                emit SendMessage(QString("!!! 定位%1失败，流程中止 (当前 X: %2, Y: %3)").arg(wellName).arg(last_xy.x()).arg(last_xy.y()));
+                return;
+            }
+            current_x_um = target_um.x();
+            current_y_um = target_um.y();
+            emit SendMessage(QString("已运动到%1点，开始加液").arg(wellName));
+            if (!visitWell(stage_type, wellName, dwell_ms, z_retract_pos_um, z_move_duration_ms + 200, true)) { emit SendMessage("遍历被急停中断"); return; }
+            continue;
+        }
+
+        // 1. 每换一行，先移动X轴到目标行的位置
+        if (target_um.x() != current_x_um) {
+            QCoreApplication::processEvents();
+            int target_x_um = target_um.x();
+            emit SendMessage(QString("移动到第 %1 行 (X坐标: %2 um)").arg(layout.row_names[idx / layout.format.cols]).arg(target_x_um));
+            gotoCompensated(stage_type, AXIS_X, target_x_um, calibrationBias(stage_type, target_um).x());
+            if (!waitForPosition(stage_type, AXIS_X, target_x_um, last_x)) return; // 每次换行都确认X轴位置
+            current_x_um = target_um.x();
+        }
+
+        // 2. Y轴定位到当前列
+        int target_y_um = target_um.y();
+        gotoCompensated(stage_type, AXIS_Y, target_y_um, calibrationBias(stage_type, target_um).y());
+        if (!waitForPosition(stage_type, AXIS_Y, target_y_um, last_y)) return; // 每次换列都确认Y轴位置
+        current_y_um = target_y_um;
+
+        emit SendMessage(QString("已运动到%1点，开始加液").arg(wellName));
+
+        // 3. Z轴操作 (加液) 和停留
+        if (!visitWell(stage_type, wellName, dwell_ms, z_retract_pos_um, z_move_duration_ms + 200)) { emit SendMessage("遍历被急停中断"); return; }
+    }
+
+    // 流水线模式下最后一个孔位之后Z轴还在安全高度，回到原位
+    if (pipelined) {
+        emit SendMessage(QString("Z轴上升到原位..."));
+        Goto(AXIS_Z, z_original_pos_um, params.code);
+        waitForMove(stage_type, AXIS_Z, z_original_pos_um, z_move_duration_ms + 200);
+    }
+    finishStageRun(stage_type);
+    emit SendMessage(QString("[%1] 全板遍历完成").arg(stage_type == LOW_STAGE_CODE ? "低精度" : "高精度"));
+}
+
+
+
+// **************************************************************************
+
+// ********************************* 孔位子集遍历运动控制 **********************************
+
+
+// 孔位Z轴操作：下降加液、底部停留、上升到z_retract_pos_um、孔位停留
+// 流水线模式下Z轴下降可能已由pipelinedMoveXY提前发出；上升时不等到位，孔位停留后Z轴越过安全高度即返回
+bool ULab::visitWell(DEVICE_CODE stage_type, const QString& wellName, int dwell_ms, int z_retract_pos_um, int z_fallback_ms, bool pipelined)
+{
+    DEVICE_CODE code = STAGE_CONFIG[stage_type].code;
+    const int z_down_pos_um = Z_AXIS_TRAVEL_MM * 1000;
+
+    if (!pipelined || m_axisTarget.value(axisKey(stage_type, AXIS_Z), -1) != z_down_pos_um) {
+        emit SendMessage(QString("Z轴下降加液..."));
+        Goto(AXIS_Z, z_down_pos_um, code);
+    }
+    waitForMove(stage_type, AXIS_Z, z_down_pos_um, z_fallback_ms);
     emit SendMessage(QString("Z轴在底部停留 %1 ms").arg(Z_AXIS_DWELL_MS));
-    MSleep(Z_AXIS_DWELL_MS);
-    emit SendMessage(QString("Z轴上升..."));
-    Goto(AXIS_Z, z_original_pos_um, params.code);
-    MSleep(z_move_duration_ms + 200);
+    if (!MSleepInterruptible(Z_AXIS_DWELL_MS, &m_stopToken)) {
+        return false;
+    }
+    emit SendMessage(z_retract_pos_um > 0 ? QString("Z轴上升到安全高度...") : QString("Z轴上升..."));
+    if (pipelined) {
+        sendGoto(AXIS_Z, z_retract_pos_um, code, true);
+    } else {
+        Goto(AXIS_Z, z_retract_pos_um, code);
+        waitForMove(stage_type, AXIS_Z, z_retract_pos_um, z_fallback_ms);
+    }
+    if (m_stopToken.IsCancelled()) {
+        return false;
+    }
 
-    // A1点的停留
+    // 孔位停留
     if (dwell_ms > 0) {
-        emit SendMessage(QString("在孔位 A1 等待 %2 ms").arg(dwell_ms));
-        MSleep(dwell_ms);
+        emit SendMessage(QString("在孔位 %1 等待 %2 ms").arg(wellName).arg(dwell_ms));
+        if (!MSleepInterruptible(dwell_ms, &m_stopToken)) {
+            return false;
+        }
+    }
+    if (pipelined) {
+        const int z_safe_pos_um = qMax(z_retract_pos_um, z_down_pos_um - Z_AXIS_SAFE_MM * 1000);
+        int cross_ms = crossingMs(stage_type, AXIS_Z, z_down_pos_um, z_safe_pos_um);
+        if (cross_ms < 0) {
+            waitForMove(stage_type, AXIS_Z, z_retract_pos_um, z_fallback_ms); // 起点未知，等上升结束
+        } else if (cross_ms > 0 && !MSleepInterruptible(cross_ms, &m_stopToken)) {
+            return false;
+        }
     }
+    return !m_stopToken.IsCancelled();
+}
 
+// 流水线换孔：调用时Z轴正在上升且已越过安全高度，X/Y移动指令立即发出；
+// Z轴下降指令按X/Y预计到达时刻提前发出，使Z轴在X/Y到位时恰好下降到安全高度，
+// 随后在Z轴继续下降期间确认X/Y位置，确认失败时Z轴立即升回原位。
+// 任一移动轴的预计到达时刻未知时，不提前下降，先确认X/Y再下降。
+bool ULab::pipelinedMoveXY(DEVICE_CODE stage_type, QPoint from_um, QPoint target_um, int z_retract_pos_um, QPoint* last_pos)
+{
+    DEVICE_CODE code = STAGE_CONFIG[stage_type].code;
+    const int z_down_pos_um = Z_AXIS_TRAVEL_MM * 1000;
+    const int z_safe_pos_um = qMax(z_retract_pos_um, z_down_pos_um - Z_AXIS_SAFE_MM * 1000);
+    const QPoint bias = calibrationBias(stage_type, target_um);
+
+    QList<AXIS> axes;
+    QList<int> targets;
+    if (target_um.x() != from_um.x()) {
+        if (!gotoCompensated(stage_type, AXIS_X, target_um.x(), bias.x(), true)) return false;
+        axes << AXIS_X;
+        targets << target_um.x();
+    }
+    if (target_um.y() != from_um.y()) {
+        if (!gotoCompensated(stage_type, AXIS_Y, target_um.y(), bias.y(), true)) return false;
+        axes << AXIS_Y;
+        targets << target_um.y();
+    }
 
-    // 蛇形遍历算法
-    // 外层循环控制X轴，对应孔板的“行” (A, B, C...)
-    for(int row = 0; row < params.rows; ++row) {
-        if(m_emergencyFlag.loadAcquire()) { emit SendMessage("遍历被急停中断"); return; }
-        QCoreApplication::processEvents();
+    bool predicted = true;
+    int xy_ms = 0;
+    for (int i = 0; i < axes.size(); ++i) {
+        predicted = predicted && m_axisArrival.value(axisKey(stage_type, axes[i]), -1) >= 0;
+        xy_ms = qMax(xy_ms, remainingMoveMs(stage_type, axes[i], targets[i]));
+    }
 
-        // 1. 每换一行，先移动X轴到目标行的位置
-        uint16_t target_x_um = params.initial_offset_x_um + (row * params.x_step_um);
-        emit SendMessage(QString("移动到第 %1 行 (X坐标: %2 um)").arg(QChar('A' + row)).arg(target_x_um));
-        Goto(AXIS_X, target_x_um, params.code);
-        if (!waitForPosition(stage_type, AXIS_X, target_x_um, last_x)) return; // 每次换行都确认X轴位置
+    QList<int> last;
+    bool xy_ok = true;
+    if (!predicted) {
+        xy_ok = waitForAxes(stage_type, axes, targets, last, 10000);
+        if (xy_ok) {
+            sendGoto(AXIS_Z, z_down_pos_um, code, true);
+        }
+    } else {
+        // Z轴从上升目标下降到安全高度所需时间，这段可以与X/Y移动的末段重叠
+        int z_lead_ms = travelPartialMs(stage_type, AXIS_Z, z_down_pos_um - z_retract_pos_um, z_safe_pos_um - z_retract_pos_um);
+        int delay_ms = qMax(remainingMoveMs(stage_type, AXIS_Z, z_retract_pos_um), xy_ms - z_lead_ms);
+        if (delay_ms > 0 && !MSleepInterruptible(delay_ms, &m_stopToken)) {
+            return false;
+        }
+        emit SendMessage(QString("X/Y预计 %1 ms后到位，Z轴提前下降").arg(qMax(0, xy_ms - delay_ms)));
+        sendGoto(AXIS_Z, z_down_pos_um, code, true);
+        xy_ok = axes.isEmpty() || waitForAxes(stage_type, axes, targets, last, 10000);
+        if (!xy_ok) {
+            sendGoto(AXIS_Z, 0, code, true); // X/Y未到位，Z轴不能继续下降
+        }
+    }
 
-        // 2. 根据行的奇偶，决定内层Y轴循环的方向
-        bool left_to_right = (row % 2 == 0); // 偶数行 (A, C, E...) 的列号从小到大
+    if (last_pos) {
+        *last_pos = QPoint(axes.contains(AXIS_X) && !last.isEmpty() ? last[axes.indexOf(AXIS_X)] : from_um.x(),
+                           axes.contains(AXIS_Y) && !last.isEmpty() ? last[axes.indexOf(AXIS_Y)] : from_um.y());
+    }
+    return xy_ok && !m_stopToken.IsCancelled();
+}
 
-        // 内层循环控制Y轴，对应孔板的“列” (1, 2, 3...)
-        int col_start = left_to_right ? 0 : params.cols - 1;
-        int col_end = left_to_right ? params.cols : -1;
-        int col_step = left_to_right ? 1 : -1;
+// "A1,A3,B7 H12" -> {"A1","A3","B7","H12"}，逗号、分号、空白均可分隔，重复孔位只保留第一次
+QStringList ULab::ParseWellList(const QString& text)
+{
+    QString normalized = text.toUpper();
+    for (int i = 0; i < normalized.size(); ++i) {
+        if (!normalized.at(i).isLetterOrNumber()) {
+            normalized[i] = QChar(' ');
+        }
+    }
 
-        // 对第一行 (A行) 的特殊处理，使其从A2 (col=1) 开始
-        if (row == 0) {
-            col_start = 1;
+    QStringList wells;
+    for (const QString& name : normalized.simplified().split(QChar(' '))) {
+        if (!name.isEmpty() && !wells.contains(name)) {
+            wells.append(name);
         }
+    }
+    return wells;
+}
 
-        for(int col = col_start; col != col_end; col += col_step) {
-            if(m_emergencyFlag.loadAcquire()) { emit SendMessage("遍历被急停中断"); return; }
-            // QCoreApplication::processEvents();
+// 孔位文件：每行一个或多个孔位，'#'之后为注释
+QStringList ULab::LoadPlateMap(const QString& path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        emit SendMessage(QString("错误：无法打开孔位文件 %1").arg(path));
+        return QStringList();
+    }
 
-            // 2.1. Y轴定位到当前列
-            uint16_t target_y_um = params.initial_offset_y_um - (col * params.y_step_um);
-            Goto(AXIS_Y, target_y_um, params.code);
-            if (!waitForPosition(stage_type, AXIS_Y, target_y_um, last_y)) return; // 每次换列都确认Y轴位置
+    QStringList lines;
+    QTextStream in(&file);
+    while (!in.atEnd()) {
+        QString line = in.readLine();
+        int comment = line.indexOf(QChar('#'));
+        lines.append(comment >= 0 ? line.left(comment) : line);
+    }
+    return ParseWellList(lines.join(","));
+}
 
-            // 2.2. 发送消息和处理特殊延时
-            QString wellName = getWellName(row, col);
-            emit SendMessage(QString("已运动到%1点，开始加液").arg(wellName));
+// 孔位名转换为位移台坐标，直接查当前孔板的坐标表
+bool ULab::wellPosition(DEVICE_CODE stage_type, const QString& wellName, QPoint& pos_um)
+{
+    const PlateLayout& layout = m_plateLayout[stage_type];
+    int idx = layout.index.value(wellName, -1);
+    if (idx < 0) {
+        return false;
+    }
+    pos_um = layout.pos_um[idx];
+    return true;
+}
+
+// X/Y两轴同时移动，移动时间取两轴中较慢的一个
+int ULab::xyTravelMs(DEVICE_CODE stage_type, QPoint from_um, QPoint to_um)
+{
+    return qMax(travelMs(stage_type, AXIS_X, to_um.x() - from_um.x()),
+                travelMs(stage_type, AXIS_Y, to_um.y() - from_um.y()));
+}
 
-            // 2.3. Z轴操作 (加液)
-            emit SendMessage(QString("Z轴下降加液..."));
-            Goto(AXIS_Z, z_down_pos_um, params.code);
-            MSleep(z_move_duration_ms + 200);
+int ULab::pathTravelMs(DEVICE_CODE stage_type, QPoint start_um, const QList<QPoint>& wells_um, const QList<int>& order)
+{
+    int total = 0;
+    QPoint cur = start_um;
+    for (int idx : order) {
+        total += xyTravelMs(stage_type, cur, wells_um[idx]);
+        cur = wells_um[idx];
+    }
+    return total;
+}
 
-            emit SendMessage(QString("Z轴在底部停留 %1 ms").arg(Z_AXIS_DWELL_MS));
-            MSleep(Z_AXIS_DWELL_MS);
+// 访问顺序规划：先按最近邻(移动时间最短)构造路径，再用2-opt反转路径片段，直到总移动时间不再缩短。
+// 起点固定为当前位置，终点不需要返回。
+QList<int> ULab::planWellOrder(DEVICE_CODE stage_type, QPoint start_um, const QList<QPoint>& wells_um)
+{
+    const int n = wells_um.size();
+    QList<int> order;
+    QList<bool> visited;
+    for (int i = 0; i < n; ++i) {
+        visited.append(false);
+    }
 
-            emit SendMessage(QString("Z轴上升..."));
-            Goto(AXIS_Z, z_original_pos_um, params.code);
-            MSleep(z_move_duration_ms + 200);
+    QPoint cur = start_um;
+    for (int k = 0; k < n; ++k) {
+        int best = -1;
+        int best_ms = 0;
+        for (int j = 0; j < n; ++j) {
+            if (visited[j]) continue;
+            int ms = xyTravelMs(stage_type, cur, wells_um[j]);
+            if (best < 0 || ms < best_ms) {
+                best = j;
+                best_ms = ms;
+            }
+        }
+        visited[best] = true;
+        order.append(best);
+        cur = wells_um[best];
+    }
 
-            // 2.4. 停留
-            if (dwell_ms > 0) {
-                emit SendMessage(QString("在孔位 %1 等待 %2 ms").arg(wellName).arg(dwell_ms));
-                MSleep(dwell_ms);
+    // 2-opt：反转order[i..j]只改变两端的两段移动，a->b ... c->d 变为 a->c ... b->d
+    auto point = [&](int k) { return k < 0 ? start_um : wells_um[order[k]]; };
+    const int max_passes = 50;
+    bool improved = true;
+    for (int pass = 0; improved && pass < max_passes; ++pass) {
+        improved = false;
+        for (int i = 0; i < n - 1; ++i) {
+            for (int j = i + 1; j < n; ++j) {
+                QPoint a = point(i - 1), b = point(i), c = point(j);
+                int before = xyTravelMs(stage_type, a, b);
+                int after = xyTravelMs(stage_type, a, c);
+                if (j + 1 < n) {
+                    QPoint d = point(j + 1);
+                    before += xyTravelMs(stage_type, c, d);
+                    after += xyTravelMs(stage_type, b, d);
+                }
+                if (after < before) {
+                    std::reverse(order.begin() + i, order.begin() + j + 1);
+                    improved = true;
+                }
             }
         }
     }
-    emit SendMessage(QString("[%1] 全板遍历完成").arg(stage_type == LOW_STAGE_CODE ? "低精度" : "高精度"));
+    return order;
+}
+
+void ULab::MoveStage(DEVICE_CODE stage_type, const QStringList& wells, int speed_x, int speed_y, int dwell_ms, bool pipelined)
+{
+    m_stopToken.Reset(); // 重置急停标志
+
+    if(!STAGE_CONFIG.contains(stage_type)) {
+        emit SendMessage("错误：未知设备类型!");
+        return;
+    }
+    auto params = STAGE_CONFIG[stage_type];
+
+    // 孔位全部合法才开始运动
+    QList<QPoint> wells_um;
+    for (const QString& name : wells) {
+        QPoint pos;
+        if (!wellPosition(stage_type, name, pos)) {
+            const PlateFormat& plate = m_plateLayout[stage_type].format;
+            emit SendMessage(QString("错误：孔位 %1 不在 %2 孔板 (%3x%4) 范围内，流程中止").arg(name).arg(plate.name).arg(plate.rows).arg(plate.cols));
+            return;
+        }
+        wells_um.append(pos);
+    }
+    if (wells_um.isEmpty()) {
+        emit SendMessage("错误：孔位列表为空");
+        return;
+    }
+
+    if (speed_x > 0) SetSpeedStage(AXIS_X, static_cast<uint16_t>(speed_x), params.code);
+    if (speed_y > 0) SetSpeedStage(AXIS_Y, static_cast<uint16_t>(speed_y), params.code);
+    SetSpeedStage(AXIS_Z, params.z_speed, params.code);
+    MSleep(100); // 等待速度设置指令发送
+
+    prepareStageZ(stage_type, 5000);
+
+    int z_move_duration_ms = 3000;
+    if (params.z_speed > 0) {
+        z_move_duration_ms = qMax(500, qCeil(Z_AXIS_TRAVEL_MM / (params.z_speed * 0.12) * 1000.0));
+    }
+    const int z_down_pos_um = Z_AXIS_TRAVEL_MM * 1000;
+    const int z_retract_pos_um = pipelined ? z_down_pos_um - Z_AXIS_CLEARANCE_MM * 1000 : 0;
+
+    // 起点取X/Y当前读数，未知时先查询一次，仍未知则按A1估算
+    int key_x = axisKey(stage_type, AXIS_X), key_y = axisKey(stage_type, AXIS_Y);
+    if (!m_axisPos.contains(key_x) || !m_axisPos.contains(key_y)) {
+        if (!pollPosNow(AXIS_X, params.code) || !pollPosNow(AXIS_Y, params.code) ||
+            !MSleepInterruptible(POS_POLL_LEAD_MS, &m_stopToken)) {
+            emit SendMessage("孔位遍历被急停中断");
+            return;
+        }
+    }
+    QPoint a1_um = m_plateLayout[stage_type].pos_um[0];
+    QPoint start_um(m_axisPos.value(key_x, a1_um.x()),
+                    m_axisPos.value(key_y, a1_um.y()));
+
+    QList<int> naive_order;
+    for (int i = 0; i < wells_um.size(); ++i) {
+        naive_order.append(i);
+    }
+    QList<int> order = planWellOrder(stage_type, start_um, wells_um);
+    int naive_ms = pathTravelMs(stage_type, start_um, wells_um, naive_order);
+    int planned_ms = pathTravelMs(stage_type, start_um, wells_um, order);
+
+    QStringList planned_names;
+    for (int idx : order) {
+        planned_names.append(wells[idx]);
+    }
+    emit SendMessage(QString("--- 孔位子集遍历：%1 个孔位 ---").arg(order.size()));
+    emit SendMessage(QString("访问顺序：%1").arg(planned_names.join(" -> ")));
+    emit SendMessage(QString("预计X/Y移动时间：原始顺序 %1 ms，优化顺序 %2 ms").arg(naive_ms).arg(planned_ms));
+
+    int achieved_ms = 0;
+    bool first_well = true;
+    QPoint current_um = start_um;
+    for (int idx : order) {
+        if(m_stopToken.IsCancelled()) { emit SendMessage("遍历被急停中断"); return; }
+        QCoreApplication::processEvents();
+
+        const QString& wellName = wells[idx];
+        QElapsedTimer move_timer;
+        move_timer.start();
+        QPoint last_xy;
+        // 流水线模式从第二个孔位开始与Z轴重叠，第一个孔位Z轴在原位，按普通方式定位
+        bool moved = (pipelined && !first_well)
+                         ? pipelinedMoveXY(stage_type, current_um, wells_um[idx], z_retract_pos_um, &last_xy)
+                         : MoveXY(wells_um[idx], params.code, &last_xy);
+        first_well = false;
+        current_um = wells_um[idx];
+        if (!moved) {
+            emit SendMessage(QString("!!! 定位%1失败，流程中止 (目标 X: %2, Y: %3 | 当前 X: %4, Y: %5)")
+                                 .arg(wellName).arg(wells_um[idx].x()).arg(wells_um[idx].y())
+                                 .arg(last_xy.x()).arg(last_xy.y()));
+            return;
+        }
+        achieved_ms += static_cast<int>(move_timer.elapsed());
+        emit SendMessage(QString("已运动到%1点，开始加液").arg(wellName));
+
+        if (!visitWell(stage_type, wellName, dwell_ms, z_retract_pos_um, z_move_duration_ms + 200, pipelined)) { emit SendMessage("遍历被急停中断"); return; }
+    }
+
+    if (pipelined) {
+        emit SendMessage(QString("Z轴上升到原位..."));
+        Goto(AXIS_Z, 0, params.code);
+        waitForMove(stage_type, AXIS_Z, 0, z_move_duration_ms + 200);
+    }
+
+    finishStageRun(stage_type);
+    emit SendMessage(QString("[%1] 孔位子集遍历完成").arg(stage_type == LOW_STAGE_CODE ? "低精度" : "高精度"));
+    emit SendMessage(QString("X/Y移动时间：预计 %1 ms，实际 %2 ms (原始顺序预计 %3 ms)")
+                         .arg(planned_ms).arg(achieved_ms).arg(naive_ms));
+}
+
+
+
+// ********************************* 航点轨迹运动控制 **********************************
+
+
+// 按顺序经过各航点。与逐孔Goto-查询-Goto相比：
+//  - 所有移动指令绕过指令队列直接写串口，上一步确认后立即发出下一个目标；
+//  - WAYPOINT_PASS航点不查询确认，按运动模型等到预计到达时刻即发出下一个目标；
+//  - z_clearance_mm >= 0 时Z轴在航点之间只升到安全高度，< 0 时完全升起。
+bool ULab::RunTrajectory(DEVICE_CODE stage_type, const QList<Waypoint>& waypoints, int z_clearance_mm)
+{
+    m_stopToken.Reset(); // 重置急停标志
+
+    if(!STAGE_CONFIG.contains(stage_type)) {
+        emit SendMessage("错误：未知设备类型!");
+        return false;
+    }
+    auto params = STAGE_CONFIG[stage_type];
+    if (waypoints.isEmpty()) {
+        emit SendMessage("错误：航点列表为空");
+        return false;
+    }
+
+    SetSpeedStage(AXIS_Z, params.z_speed, params.code);
+    MSleep(100); // 等待速度设置指令发送
+    prepareStageZ(stage_type, 5000);
+
+    int z_fallback_ms = 3000;
+    if (params.z_speed > 0) {
+        z_fallback_ms = qMax(500, qCeil(Z_AXIS_TRAVEL_MM / (params.z_speed * 0.12) * 1000.0)) + 200;
+    }
+    const int z_down_pos_um = Z_AXIS_TRAVEL_MM * 1000;
+    const int z_retract_pos_um = z_clearance_mm >= 0 ? z_down_pos_um - qMin(z_clearance_mm, (int)Z_AXIS_TRAVEL_MM) * 1000 : 0;
+
+    emit SendMessage(QString("--- 航点轨迹：%1 个航点 ---").arg(waypoints.size()));
+    QElapsedTimer run_timer;
+    run_timer.start();
+
+    for (int i = 0; i < waypoints.size(); ++i) {
+        if(m_stopToken.IsCancelled()) { emit SendMessage("轨迹被急停中断"); return false; }
+        QCoreApplication::processEvents();
+
+        const Waypoint& wp = waypoints[i];
+        const QString label = wp.label.isEmpty() ? QString("航点%1").arg(i + 1) : wp.label;
+        QPoint bias = calibrationBias(stage_type, wp.pos_um);
+        if (!gotoCompensated(stage_type, AXIS_X, wp.pos_um.x(), bias.x(), true) ||
+            !gotoCompensated(stage_type, AXIS_Y, wp.pos_um.y(), bias.y(), true)) {
+            emit SendMessage(QString("错误：%1 超出行程，轨迹中止").arg(label));
+            return false;
+        }
+
+        // 途经航点：不确认到位，预计到达后直接发出下一个目标 (最后一个航点仍需确认)
+        if (wp.action == WAYPOINT_PASS && i + 1 < waypoints.size()) {
+            MSleepInterruptible(qMax(remainingMoveMs(stage_type, AXIS_X, wp.pos_um.x()),
+                                     remainingMoveMs(stage_type, AXIS_Y, wp.pos_um.y())), &m_stopToken);
+            continue;
+        }
+
+        QList<int> last;
+        if (!waitForAxes(stage_type, {AXIS_X, AXIS_Y}, {wp.pos_um.x(), wp.pos_um.y()}, last, 10000)) {
+            emit SendMessage(QString("!!! 定位%1失败，轨迹中止").arg(label));
+            return false;
+        }
+        emit SendMessage(QString("已运动到%1").arg(label));
+
+        if (wp.action == WAYPOINT_DIP) {
+            sendGoto(AXIS_Z, z_down_pos_um, params.code, true);
+            waitForMove(stage_type, AXIS_Z, z_down_pos_um, z_fallback_ms);
+            if (!MSleepInterruptible(Z_AXIS_DWELL_MS, &m_stopToken)) { emit SendMessage("轨迹被急停中断"); return false; }
+            sendGoto(AXIS_Z, z_retract_pos_um, params.code, true);
+            waitForMove(stage_type, AXIS_Z, z_retract_pos_um, z_fallback_ms);
+        }
+        if (wp.dwell_ms > 0) {
+            emit SendMessage(QString("在%1等待 %2 ms").arg(label).arg(wp.dwell_ms));
+            if (!MSleepInterruptible(wp.dwell_ms, &m_stopToken)) { emit SendMessage("轨迹被急停中断"); return false; }
+        }
+    }
+
+    if (z_retract_pos_um != 0) {
+        emit SendMessage(QString("Z轴上升到原位..."));
+        sendGoto(AXIS_Z, 0, params.code, true);
+        waitForMove(stage_type, AXIS_Z, 0, z_fallback_ms);
+    }
+
+    finishStageRun(stage_type);
+    qint64 total_ms = run_timer.elapsed();
+    emit SendMessage(QString("[%1] 航点轨迹完成，共 %2 ms，平均每个航点 %3 ms")
+                         .arg(stage_type == LOW_STAGE_CODE ? "低精度" : "高精度")
+                         .arg(total_ms).arg(total_ms / waypoints.size()));
+    return true;
+}
+
+// 孔位列表转换为航点，每个孔位执行Z轴加液后停留dwell_ms
+QList<Waypoint> ULab::WellWaypoints(DEVICE_CODE stage_type, const QStringList& wells, int dwell_ms)
+{
+    QList<Waypoint> waypoints;
+    for (const QString& name : wells) {
+        QPoint pos;
+        if (!wellPosition(stage_type, name, pos)) {
+            emit SendMessage(QString("错误：未知孔位 %1").arg(name));
+            return QList<Waypoint>();
+        }
+        waypoints.append({pos, WAYPOINT_DIP, dwell_ms, name});
+    }
+    return waypoints;
 }
 
 
@@ -790,7 +1906,10 @@ void ULab::SendData(const QByteArray &data)
 }
 
 void ULab::EmergencyStop() {
-    m_emergencyFlag.storeRelaxed(1); // 设置急停标志
+    // 先清空未发出的指令，再取消令牌：取消时同步执行的回调(如并行换液)写出的停泵指令
+    // 以及下面的禁用轴指令都排在清空之后，不会被丢弃，也不会把排队的运动指令一并写出
+    wrtCmdList.clear();
+    m_stopToken.Cancel(); // 取消急停令牌，所有等待立即返回
 
     // 发送急停指令到所有设备
     QStringList stopCommands;
@@ -810,7 +1929,8 @@ void ULab::EmergencyStop() {
     SetAxisEnable(AXIS_X, false, HIGH_STAGE_CODE);
     SetAxisEnable(AXIS_Y, false, HIGH_STAGE_CODE);
 
-    wrtCmdList.clear();
+    InvalidateStageState(LOW_STAGE_CODE, STATE_EMERGENCY_STOP);
+    InvalidateStageState(HIGH_STAGE_CODE, STATE_EMERGENCY_STOP);
 
     // 立即刷新串口
     if(pPort->isOpen())
@@ -823,53 +1943,274 @@ void ULab::EmergencyStop() {
 }
 
 
-bool ULab::waitForPosition(DEVICE_CODE stage_type, AXIS axis, uint16_t target_pos, int& last_pos, int timeout_ms)
+// 梯形速度曲线：加速到最高速、匀速、减速；距离太短达不到最高速时为三角形曲线。
+// 最高速度取最近一次SetSpeedStage设置的速度，加速度和稳定时间来自StageParams。
+bool ULab::motionProfile(DEVICE_CODE stage_type, AXIS axis, double& v, double& a)
+{
+    if (!STAGE_CONFIG.contains(stage_type)) {
+        return false;
+    }
+    const StageParams& params = STAGE_CONFIG[stage_type];
+    uint16_t default_speed = axis == AXIS_X ? params.x_speed : (axis == AXIS_Y ? params.y_speed : params.z_speed);
+    uint16_t speed = m_axisSpeed.value(axisKey(stage_type, axis), default_speed);
+    int accel_mm_s2 = axis == AXIS_Z ? params.z_accel_mm_s2 : params.xy_accel_mm_s2;
+    if (speed == 0 || accel_mm_s2 <= 0) {
+        return false;
+    }
+    v = speed * 0.12;                                       // 0.12 mm/s = 0.12 µm/ms
+    a = accel_mm_s2 / 1000.0;                               // 1 mm/s² = 0.001 µm/ms²
+    return true;
+}
+
+int ULab::travelMs(DEVICE_CODE stage_type, AXIS axis, int distance_um)
+{
+    double v = 0, a = 0;
+    if (distance_um == 0 || !motionProfile(stage_type, axis, v, a)) {
+        return 0;
+    }
+
+    double d = qAbs(distance_um);
+    double t = 0;
+    if (d >= v * v / a) {                                   // 加速段+减速段距离 = v²/a
+        t = d / v + v / a;
+    } else {
+        t = 2.0 * qSqrt(d / a);
+    }
+    return static_cast<int>(qCeil(t)) + STAGE_CONFIG[stage_type].settle_ms;
+}
+
+// 同一条梯形(或三角形)速度曲线上，从起点走过partial_um的时刻：加速段、匀速段、减速段分段求解。
+// 距离按绝对值计算，向上(坐标减小)的移动与向下相同
+int ULab::travelPartialMs(DEVICE_CODE stage_type, AXIS axis, int distance_um, int partial_um)
+{
+    double v = 0, a = 0;
+    if (distance_um == 0 || partial_um == 0 || !motionProfile(stage_type, axis, v, a)) {
+        return 0;
+    }
+    double d = qAbs(distance_um);
+    double p = qMin<double>(qAbs(partial_um), d);
+    double t = 0;
+    if (d >= v * v / a) {
+        double accel_um = v * v / (2.0 * a);
+        if (p <= accel_um) {
+            t = qSqrt(2.0 * p / a);
+        } else if (p <= d - accel_um) {
+            t = v / a + (p - accel_um) / v;
+        } else {
+            t = d / v + v / a - qSqrt(2.0 * (d - p) / a);
+        }
+    } else {
+        t = p <= d / 2.0 ? qSqrt(2.0 * p / a) : 2.0 * qSqrt(d / a) - qSqrt(2.0 * (d - p) / a);
+    }
+    return static_cast<int>(qCeil(t));
+}
+
+// 按该轴最近一次移动的预计开始时刻和速度曲线，计算越过threshold_um的时刻。
+// 沿运动方向量取走过的距离：Z轴上升时坐标减小，threshold_um - from_um为负，取绝对值；
+// threshold_um在起点或起点之后(反方向)时视为开始移动即已越过
+int ULab::crossingMs(DEVICE_CODE stage_type, AXIS axis, int from_um, int threshold_um)
+{
+    int key = axisKey(stage_type, axis);
+    int target = m_axisTarget.value(key, -1);
+    qint64 arrival_ms = m_axisArrival.value(key, -1);
+    if (target < 0 || arrival_ms < 0) {
+        return -1;
+    }
+    const int distance_um = target - from_um;
+    const int partial_um = threshold_um - from_um;
+    const int along_um = (distance_um >= 0) == (partial_um >= 0) ? qAbs(partial_um) : 0;
+    qint64 begin_ms = arrival_ms - travelMs(stage_type, axis, distance_um);
+    qint64 cross_ms = begin_ms + travelPartialMs(stage_type, axis, distance_um, along_um);
+    return static_cast<int>(qMax<qint64>(0, cross_ms - m_stageClock.elapsed()));
+}
+
+void ULab::waitForMove(DEVICE_CODE stage_type, AXIS axis, int target_pos, int fallback_ms)
+{
+    int key = axisKey(stage_type, axis);
+    bool known = m_axisTarget.value(key, -1) == target_pos && m_axisArrival.value(key, -1) >= 0;
+    MSleepInterruptible(known ? remainingMoveMs(stage_type, axis, target_pos) : fallback_ms, &m_stopToken);
+}
+
+// 发出移动指令时调用：起点取上一条指令的目标(没有则取最近读数)，
+// 开始时刻取指令出队时刻与上一段移动结束时刻中较晚者
+void ULab::trackMove(DEVICE_CODE stage_type, AXIS axis, int target_pos, bool immediate)
+{
+    int key = axisKey(stage_type, axis);
+    int from = m_axisTarget.value(key, m_axisPos.value(key, -1));
+    m_axisTarget[key] = target_pos;
+    m_axisBias.remove(key);
+    if (from < 0) {
+        m_axisArrival[key] = -1;
+        return;
+    }
+    qint64 dequeue_ms = m_stageClock.elapsed() + (immediate ? 0 : wrtCmdList.size() * CMD_INTERVAL);
+    qint64 begin_ms = qMax(dequeue_ms, m_axisArrival.value(key, -1));
+    m_axisArrival[key] = begin_ms + travelMs(stage_type, axis, target_pos - from);
+}
+
+int ULab::remainingMoveMs(DEVICE_CODE stage_type, AXIS axis, int target_pos)
+{
+    int key = axisKey(stage_type, axis);
+    int expected = m_axisTarget.value(key, -1) + m_axisBias.value(key, 0);   // 补偿移动时按预期读数比较
+    if (m_axisTarget.value(key, -1) < 0 || expected != target_pos || m_axisArrival.value(key, -1) < 0) {
+        return 0;
+    }
+    return static_cast<int>(qMax<qint64>(0, m_axisArrival[key] - m_stageClock.elapsed()));
+}
+
+// 查询经writeFrameNow写出，与其他指令同样遵守CMD_INTERVAL间隔；同一轴的查询还在等间隔时不重复发出。
+// 急停时返回false
+bool ULab::pollPosNow(AXIS axis, DEVICE_CODE code)
+{
+    if (!pPort->isOpen()) {
+        return !m_stopToken.IsCancelled();
+    }
+    const int key = axisKey(code, axis);
+    if (m_pollPending.contains(key)) {
+        return true;
+    }
+    m_pollPending.insert(key);
+    bool ok = writeFrameNow(GenCMD(7+axis, code, 1+axis, 0x00));
+    m_pollPending.remove(key);
+    return ok;
+}
+
+bool ULab::waitForPosition(DEVICE_CODE stage_type, AXIS axis, int target_pos, int& last_pos, int timeout_ms)
+{
+    QList<int> last;
+    bool ok = waitForAxes(stage_type, {axis}, {target_pos}, last, timeout_ms);
+    last_pos = last.first();
+    return ok;
+}
+
+bool ULab::waitForPositionXY(DEVICE_CODE stage_type, int target_x, int target_y, int& last_x, int& last_y, int timeout_ms)
+{
+    QList<int> last;
+    bool ok = waitForAxes(stage_type, {AXIS_X, AXIS_Y}, {target_x, target_y}, last, timeout_ms);
+    last_x = last[0];
+    last_y = last[1];
+    return ok;
+}
+
+// 位置确认：预计到达前不查询，临近预计到达时刻开始密集查询；
+// 读数与目标一致，或在容差内且相邻两次读数不再变化(已停稳)时确认该轴到位，所有轴到位后返回。
+bool ULab::waitForAxes(DEVICE_CODE stage_type, const QList<AXIS>& axes, const QList<int>& targets, QList<int>& last_pos, int timeout_ms)
 {
-    emit SendMessage(QString("正在确认 %1... 目标: %2").arg(GetAxisName(axis)).arg(target_pos));
+    const int n = axes.size();
+    int predicted_ms = 0;
+    QStringList names;
+    for (int i = 0; i < n; ++i) {
+        predicted_ms = qMax(predicted_ms, remainingMoveMs(stage_type, axes[i], targets[i]));
+        names << QString("%1 -> %2").arg(GetAxisName(axes[i])).arg(targets[i]);
+    }
+    int quiet_ms = qMax(0, predicted_ms - POS_POLL_LEAD_MS);
+    // 长距离移动的预计时间可能超过默认超时，超时至少留出预计时间之外的余量
+    timeout_ms = qMax(timeout_ms, predicted_ms + 2000);
+
+    emit SendMessage(QString("正在确认 %1 (预计 %2 ms)").arg(names.join(", ")).arg(predicted_ms));
 
     QEventLoop loop;
     QTimer timer;
     timer.setSingleShot(true);
     // 连接超时信号，如果超时，循环将以状态码1退出
     connect(&timer, &QTimer::timeout, &loop, [&](){ loop.exit(1); });
-
-    bool position_reached = false;
-    last_pos = -1; // 初始化为-1，表示尚未收到任何位置信息
+    // 急停令牌取消时以状态码2立即退出
+    connect(&m_stopToken, &CancelToken::cancelled, &loop, [&](){ loop.exit(2); });
+
+    last_pos.clear();
+    QList<int> prev_pos;
+    QList<bool> reached;
+    for (int i = 0; i < n; ++i) {
+        last_pos.append(-1); // -1表示尚未收到任何位置信息
+        prev_pos.append(-1);
+        reached.append(false);
+    }
+    int reached_count = 0;
     // 连接位置更新信号
     auto conn = connect(this, &ULab::UpdatePos, this,
                         [&](DEVICE_CODE id, AXIS a, int pos) {
         // 检查是否是我们关心的设备和轴
-        if (id == stage_type && a == axis) {
-            last_pos = pos;    // 无论是否到达，都更新最后的位置
-            // 检查坐标是否在目标1000微米的容差范围内
-            if (qAbs(pos - target_pos) < 1000) {
-                position_reached = true;
-                loop.exit(0); // 成功，以返回码 0 退出
+        int i = axes.indexOf(a);
+        if (id != stage_type || i < 0) {
+            return;
+        }
+        prev_pos[i] = last_pos[i];
+        last_pos[i] = pos;    // 无论是否到达，都更新最后的位置
+        int error = qAbs(pos - targets[i]);
+        bool settled = prev_pos[i] >= 0 && qAbs(pos - prev_pos[i]) <= POS_SETTLE_DELTA_UM;
+        if (!reached[i] && (error <= POS_EXACT_UM || (error < POS_TOLERANCE_UM && settled))) {
+            reached[i] = true;
+            if (++reached_count == n) {
+                loop.exit(0); // 所有轴都到位，以返回码 0 退出
             }
         }
     });
 
-    // 创建一个定时器，周期性地发送查询位置的指令
+    // 密集查询定时器，预计到达前保持安静；每拍只查询一个尚未到位的轴，轮流进行，
+    // 查询与其他指令共用CMD_INTERVAL间隔，一拍查询多轴只会在写串口处排队
     QTimer pollTimer;
-    connect(&pollTimer, &QTimer::timeout, this, [this, axis, stage_type](){
-        GetPos(axis, stage_type);
+    pollTimer.setTimerType(Qt::PreciseTimer);
+    int next_axis = 0;
+    auto poll = [&]() {
+        for (int k = 0; k < n; ++k) {
+            int i = (next_axis + k) % n;
+            if (!reached[i]) {
+                next_axis = i + 1;
+                pollPosNow(axes[i], stage_type);
+                return;
+            }
+        }
+    };
+    connect(&pollTimer, &QTimer::timeout, this, poll);
+    QTimer quietTimer;
+    quietTimer.setSingleShot(true);
+    connect(&quietTimer, &QTimer::timeout, this, [&](){
+        poll();
+        pollTimer.start(POS_POLL_FAST_MS);
     });
 
-    pollTimer.start(250); // 每250毫秒查询一次位置
+    quietTimer.start(quiet_ms);
     timer.start(timeout_ms); // 启动总超时定时器
 
-    int exit_code = loop.exec(); // 开始事件循环，程序会在这里“等待”
+    int exit_code = m_stopToken.IsCancelled() ? 2 : loop.exec(); // 开始事件循环，程序会在这里“等待”
 
+    quietTimer.stop();
     pollTimer.stop();
     disconnect(conn); // 清理信号连接
 
-    if (exit_code != 0) { // exit_code不为0，意味着超时失败
+    if (exit_code == 2) {
+        emit SendMessage("位置确认被急停中断");
+    } else if (exit_code != 0) { // exit_code为1，意味着超时失败
+        InvalidateStageState(stage_type, STATE_TIMEOUT);
         // 失败时，last_pos中保存的是超时前最后一次收到的坐标
-        emit SendMessage(QString("错误: %1 未能在 %2ms 内到达目标! (最后位置: %3)")
-                             .arg(GetAxisName(axis)).arg(timeout_ms).arg(last_pos));
+        for (int i = 0; i < n; ++i) {
+            if (!reached[i]) {
+                emit SendMessage(QString("错误: %1 未能在 %2ms 内到达目标! (最后位置: %3)")
+                                     .arg(GetAxisName(axes[i])).arg(timeout_ms).arg(last_pos[i]));
+            }
+        }
     }
 
-    return position_reached; // position_reached只在成功时为true
+    return exit_code == 0;
+}
+
+// X/Y两轴同时移动：两条Goto指令连续发出，两轴一起运动，只等待一次并同时确认两轴位置
+// 有标定数据时按标定偏差补偿指令坐标，确认时仍以目标坐标为准
+bool ULab::MoveXY(QPoint target_um, DEVICE_CODE code, QPoint* last_pos)
+{
+    int target_x = target_um.x();
+    int target_y = target_um.y();
+    QPoint bias = calibrationBias(code, target_um);
+    if (!gotoCompensated(code, AXIS_X, target_x, bias.x()) || !gotoCompensated(code, AXIS_Y, target_y, bias.y())) {
+        return false;
+    }
+
+    int last_x = -1, last_y = -1;
+    bool ok = waitForPositionXY(code, target_x, target_y, last_x, last_y);
+    if (last_pos) {
+        *last_pos = QPoint(last_x, last_y);
+    }
+    return ok;
 }
 
 // ******************************* 多通道换液流程 *********************************
@@ -893,12 +2234,15 @@ void ULab::PerformLiquidExchange(uint8_t id,
     // 1. 设置蠕动泵转速 (只需设置一次)
     emit SendMessage("设置蠕动泵转速为: " + QString::number(pump_speed));
     SetSpeed(pump_speed,id);
-    MSleep(100);
+    if (!MSleepInterruptible(100, &m_stopToken)) {
+        emit SendMessage("换液流程被急停中断。");
+        return;
+    }
 
     // 2. 循环遍历所有指定通道
     int current_step = 1;
     for (uint8_t channel : channels) {
-        if(m_emergencyFlag.loadAcquire())
+        if(m_stopToken.IsCancelled())
         {
             emit SendMessage("换液流程被急停中断。");
             return;
@@ -909,19 +2253,29 @@ void ULab::PerformLiquidExchange(uint8_t id,
         // 2.1. 切换到指定通道
         emit SendMessage("切换阀门到通道: " + QString::number(channel));
         GotoHole(valve_addr, channel, id);
-        MSleep(1000);
+        if (!MSleepInterruptible(1000, &m_stopToken)) {
+            emit SendMessage("换液流程被急停中断。");
+            return;
+        }
 
         // 2.2. 启动蠕动泵
         emit SendMessage(QString("启动蠕动泵，持续 %1 ms").arg(pumping_duration_ms));
         Rotate(true, direction, id); // 蠕动泵开始工作
 
-        // 2.3. 等待指定出液时长
-        MSleep(pumping_duration_ms);
+        // 2.3. 等待指定出液时长，急停时立即停泵
+        bool completed = MSleepInterruptible(pumping_duration_ms, &m_stopToken);
 
         // 2.4. 停止蠕动泵
         emit SendMessage("停止蠕动泵。");
         Rotate(false, direction, id); // 蠕动泵停止工作
-        MSleep(500);
+        if (!completed) {
+            emit SendMessage("换液流程被急停中断。");
+            return;
+        }
+        if (!MSleepInterruptible(500, &m_stopToken)) {
+            emit SendMessage("换液流程被急停中断。");
+            return;
+        }
 
         current_step++;
     }
@@ -929,4 +2283,153 @@ void ULab::PerformLiquidExchange(uint8_t id,
     emit SendMessage("换液流程全部完成。");
 }
 
+// 流量标定：以固定转速运行一段时间，称量出液体积，ul_per_s_per_unit = 体积(uL) / 时长(s) / 转速。
+// 控制板的转速单位与流量没有固定换算，换泵管或泵头后需要重新标定
+void ULab::SetPumpCalibration(uint8_t pump_id, double ul_per_s_per_unit)
+{
+    if (ul_per_s_per_unit <= 0) {
+        m_pumpCal.remove(pump_id);
+        emit SendMessage(QString("蠕动泵%1 流量标定已清除").arg(pump_id));
+        return;
+    }
+    m_pumpCal[pump_id] = ul_per_s_per_unit;
+    emit SendMessage(QString("蠕动泵%1 流量标定: %2 uL/s 每转速单位").arg(pump_id).arg(ul_per_s_per_unit));
+}
+
+// 并行换液：每个任务占用一个蠕动泵和一个切换阀，互不冲突的任务同时执行。
+// 任务按列表顺序调度，某个泵和阀都空闲时立即开始下一个可执行的任务。
+// 泵的启停指令绕过100ms队列直接写串口，停止时刻以启动指令的实际写入时刻为基准，
+// 出液时长只受相邻指令间隔(至多CMD_INTERVAL)影响，不随队列长度漂移；实际时长记录在消息中
+
+void ULab::PerformLiquidExchange(const QList<LiquidExchangeJob>& jobs,
+                                 uint16_t pump_speed,
+                                 bool direction)
+{
+    if (jobs.isEmpty()) {
+        emit SendMessage("换液流程错误：任务列表为空。");
+        return;
+    }
+    if (pump_speed == 0) {
+        emit SendMessage("换液流程错误：蠕动泵转速为0，无法计算出液时长。");
+        return;
+    }
+    for (const LiquidExchangeJob& job : jobs) {
+        if (!m_pumpCal.contains(job.pump_id)) {
+            emit SendMessage(QString("换液流程错误：蠕动泵%1 未做流量标定(SetPumpCalibration)，无法按体积计算出液时长。").arg(job.pump_id));
+            return;
+        }
+    }
+
+    m_stopToken.Reset();
+
+    // 切换阀按 (控制板ID, 地址) 区分
+    auto valveKey = [](const LiquidExchangeJob& job) { return (job.pump_id << 8) | job.valve_addr; };
+    auto durationMs = [this, pump_speed](const LiquidExchangeJob& job) {
+        return static_cast<uint>(job.volume_ul / (pump_speed * m_pumpCal.value(job.pump_id)) * 1000.0);
+    };
+    auto pumpFrame = [this, direction](uint8_t id, bool start) {
+        return GenCMD(0x0A, id, !direction ? 0x01 : 0x00, start ? 0x01 : 0x02);
+    };
+
+    QSet<int> pumps, valves;
+    uint serial_ms = 0;
+    for (const LiquidExchangeJob& job : jobs) {
+        pumps.insert(job.pump_id);
+        valves.insert(valveKey(job));
+        serial_ms += durationMs(job) + 1500;
+    }
+    emit SendMessage(QString("开始执行并行换液流程：%1 个任务，%2 个蠕动泵，%3 个切换阀，串行预计 %4 ms")
+                         .arg(jobs.size()).arg(pumps.size()).arg(valves.size()).arg(serial_ms));
+
+    // 每个用到的蠕动泵设置一次转速
+    for (int id : pumps) {
+        SetSpeed(pump_speed, id);
+    }
+
+    QList<int> pending;                  // 尚未开始的任务下标
+    for (int i = 0; i < jobs.size(); ++i) pending.append(i);
+    QSet<int> busyPumps, busyValves;     // 正在使用的泵和阀
+    QMap<int, qint64> runningPumps;      // 正在转动的泵及启动指令写出时刻，急停时需要停止
+    int finished = 0;
+    bool aborted = false;
+
+    QEventLoop loop;
+    QObject context;                     // 函数返回时销毁，未触发的定时器随之取消
+    QElapsedTimer wallClock;
+    wallClock.start();
+
+    std::function<void()> dispatch;
+    connect(&m_stopToken, &CancelToken::cancelled, &context, [&]() { dispatch(); });   // 急停时立即停泵退出
+    dispatch = [&]() {
+        if (aborted) return;
+        if (m_stopToken.IsCancelled()) {
+            aborted = true;
+            for (int id : runningPumps.keys()) writeFrameNow(pumpFrame(id, false), false);
+            emit SendMessage("换液流程被急停中断。");
+            loop.quit();
+            return;
+        }
+        if (finished == jobs.size()) {
+            loop.quit();
+            return;
+        }
+
+        for (int k = 0; k < pending.size(); ) {
+            int index = pending[k];
+            const LiquidExchangeJob job = jobs[index];
+            if (busyPumps.contains(job.pump_id) || busyValves.contains(valveKey(job))) {
+                ++k;
+                continue;
+            }
+            pending.removeAt(k);
+            busyPumps.insert(job.pump_id);
+            busyValves.insert(valveKey(job));
+            uint duration = durationMs(job);
+
+            emit SendMessage(QString("--- 任务 %1/%2: 泵%3 阀%4 通道%5, %6 uL (%7 ms) ---")
+                                 .arg(index + 1).arg(jobs.size()).arg(job.pump_id)
+                                 .arg(job.valve_addr).arg(job.channel).arg(job.volume_ul).arg(duration));
+
+            // 1. 切换阀门，等待1s
+            GotoHole(job.valve_addr, job.channel, job.pump_id);
+            QTimer::singleShot(1000, &context, [&, job, duration]() {
+                if (aborted) return;
+                if (m_stopToken.IsCancelled()) { dispatch(); return; }
+
+                // 2. 启动蠕动泵，持续出液时长；从启动指令写出时刻起计时
+                if (!writeFrameNow(pumpFrame(job.pump_id, true))) { dispatch(); return; }
+                qint64 startMs = m_lastWriteMs;
+                runningPumps.insert(job.pump_id, startMs);
+                int remaining = qMax<qint64>(0, duration - (m_stageClock.elapsed() - startMs));
+                QTimer::singleShot(remaining, Qt::PreciseTimer, &context, [&, job, duration, startMs]() {
+                    if (aborted) return;
+
+                    // 3. 停止蠕动泵，阀门释放；泵再等待500ms后释放
+                    writeFrameNow(pumpFrame(job.pump_id, false), false);
+                    runningPumps.remove(job.pump_id);
+                    emit SendMessage(QString("泵%1 出液 %2 ms (设定 %3 ms)")
+                                         .arg(job.pump_id).arg(m_lastWriteMs - startMs).arg(duration));
+                    busyValves.remove(valveKey(job));
+                    QTimer::singleShot(500, &context, [&, job]() {
+                        busyPumps.remove(job.pump_id);
+                        ++finished;
+                        dispatch();
+                    });
+                    dispatch();
+                });
+            });
+        }
+    };
+
+    dispatch();
+    if (!aborted && finished < jobs.size()) {
+        loop.exec();
+    }
+
+    if (!aborted) {
+        emit SendMessage(QString("并行换液流程全部完成，用时 %1 ms (串行预计 %2 ms)")
+                             .arg(wallClock.elapsed()).arg(serial_ms));
+    }
+}
+
 // ******************************************************************************
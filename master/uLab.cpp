@@ -8,8 +8,16 @@ ULab::ULab(QObject *parent)
     pParseTimer = new QTimer(this);
     pReadTimer = new QTimer(this);
     pGetFlowTimer = new QTimer(this);
+    pGateTimer = new QTimer(this);
+    pGateTimer->setSingleShot(true);
+    pGateTimer->setTimerType(Qt::PreciseTimer);
+    connect(pGateTimer, &QTimer::timeout, this, &ULab::FlushGated);
     connect(pPortTimer, &QTimer::timeout, this, &ULab::RefreshPort);
     connect(pParseTimer, &QTimer::timeout, this, &ULab::ParsePort);
+    connect(pPort, &QSerialPort::readyRead, this, &ULab::ParsePort); //有数据立即解析，样本时间戳更准确
+    pGetFlowTimer->setTimerType(Qt::PreciseTimer);
+    pGetFlowTimer->setInterval(FLOW_INTERVAL / 2); //默认与原来一致：每6s气压、流量各查询一次
+    connect(this, &ULab::TelemetrySampled, this, &ULab::ClosedLoopStep);
     //    pCRC = new CRC();
 }
 
@@ -20,6 +28,7 @@ ULab::~ULab()
     delete pParseTimer;
     delete pReadTimer;
     delete pGetFlowTimer;
+    delete pGateTimer;
     delete pPort;
     //    delete pCRC;
 }
@@ -34,7 +43,9 @@ bool ULab::InitPort(QString portName)
         pPortTimer->start(CMD_INTERVAL);
         pParseTimer->start(PARSE_INTERVAL);
         pReadTimer->start(READ_INTERVAL);
-        pGetFlowTimer->start(FLOW_INTERVAL);
+        pGetFlowTimer->start();
+        m_telemetryClock.start();
+        m_lastWrite_us = -1;
         emit SendMessage("Succeed in connecting " + portName);
         return true;
     } else {
@@ -48,6 +59,9 @@ void ULab::ClosePort()
     pPortTimer->stop();
     pParseTimer->stop();
     pReadTimer->stop();
+    pGetFlowTimer->stop();
+    pGateTimer->stop();
+    m_gatedFrames.clear();
     if (pPort->isOpen())
         pPort->close();
     emit SendMessage("Disconnect from " + portName);
@@ -184,13 +198,179 @@ void ULab::SetAxisEnable(AXIS axis, bool enable, DEVICE_CODE code)
 
 void ULab::SetFluigentEnable(bool enable)
 {
+    m_fluigentEnabled = enable;
     if (enable) {
-        connect(pGetFlowTimer, &QTimer::timeout, this, &ULab::GetPresAndFlow);
+        connect(pGetFlowTimer,
+                &QTimer::timeout,
+                this,
+                &ULab::GetPresAndFlow,
+                Qt::UniqueConnection);
     } else {
         disconnect(pGetFlowTimer, &QTimer::timeout, this, &ULab::GetPresAndFlow);
     }
 }
 
+void ULab::SetTelemetryRate(uint rate_hz)
+{
+    rate_hz = qBound<uint>(TELEMETRY_MIN_RATE_HZ, rate_hz, TELEMETRY_MAX_RATE_HZ);
+    // 每次定时器触发只查询一项，气压和流量交替，所以定时器频率即总查询频率
+    pGetFlowTimer->setInterval(1000 / rate_hz);
+    emit SendMessage("Telemetry sampling rate set to " + QString::number(rate_hz) + " Hz");
+}
+
+int ULab::ReadTelemetry(QVector<TelemetrySample> &out, quint32 &cursor) const
+{
+    return m_telemetry.Read(out, cursor);
+}
+
+bool ULab::LatestTelemetry(TELEMETRY_CHANNEL channel, TelemetrySample &sample) const
+{
+    return m_telemetry.Latest(sample, [channel](const TelemetrySample &s) {
+        return s.channel == channel;
+    });
+}
+
+PidParams ULab::DefaultPidParams(CONTROL_MODE mode)
+{
+    // 默认参数偏保守，换气泵或管路后需要重新整定
+    if (mode == CONTROL_FLOW) {
+        //   kp,  ki,  kd,  kff, out_min, out_max, band, samples
+        return {0.4, 1.0, 0.0, 0.5, 0, 5000, 20, 10};
+    }
+    return {0.8, 0.5, 0.0, 0.0, 0, 1000, 25, 10};
+}
+
+void ULab::StartClosedLoop(CONTROL_MODE mode, uint target)
+{
+    StartClosedLoop(mode, target, DefaultPidParams(mode));
+}
+
+void ULab::StartClosedLoop(CONTROL_MODE mode, uint target, const PidParams &params)
+{
+    if (mode == CONTROL_OFF) {
+        StopClosedLoop();
+        return;
+    }
+    if (m_loopMode == CONTROL_OFF) {
+        //切换模式时不覆盖，停止时恢复到最初的采样设置
+        m_loopPrevInterval = pGetFlowTimer->interval();
+        m_loopPrevFluigent = m_fluigentEnabled;
+    }
+    m_loopMode = mode;
+    m_pid = params;
+    m_loopTarget = target;
+    m_loopLastOutput = -1;
+    m_loopIntegral = 0;             //新闭环不继承上次(或另一模式)的积分和微分历史
+    m_loopLastMeasure = 0;
+    ResetClosedLoop();
+
+    // 闭环需要高频采样，采样默认开到最高
+    SetFluigentEnable(true);
+    SetTelemetryRate(TELEMETRY_MAX_RATE_HZ);
+    emit SendMessage(QString("Closed loop %1 control started, target %2")
+                         .arg(mode == CONTROL_FLOW ? "flow" : "pressure")
+                         .arg(target));
+}
+
+void ULab::SetClosedLoopTarget(uint target)
+{
+    if (m_loopMode == CONTROL_OFF)
+        return;
+    m_loopTarget = target;
+    ResetClosedLoop(); //新目标重新统计稳定时间，积分项保留避免输出突变
+}
+
+void ULab::StopClosedLoop()
+{
+    if (m_loopMode == CONTROL_OFF)
+        return;
+    // 输出回到安全值：压力模式停气泵，流量模式把气压设定归零，不留下最后一次的闭环输出
+    if (m_loopMode == CONTROL_PRESSURE)
+        StopPump();
+    else
+        SetPressure(0);
+    m_loopMode = CONTROL_OFF;
+
+    // 恢复开始闭环前的采样频率和开关
+    pGetFlowTimer->setInterval(m_loopPrevInterval);
+    SetFluigentEnable(m_loopPrevFluigent);
+    emit SendMessage("Closed loop control stopped");
+}
+
+void ULab::ResetClosedLoop()
+{
+    m_loopStart_us = m_telemetryClock.nsecsElapsed() / 1000;
+    m_loopLast_us = 0;
+    m_loopInBand = 0;
+    m_loopBandEnter_us = 0;
+    m_loopErrorSum = 0;
+    m_loopAbsErrorSum = 0;
+    m_loopErrorCount = 0;
+    m_loopStats = ClosedLoopStats{false, -1, 0, 0, 0};
+}
+
+void ULab::ClosedLoopStep(TelemetrySample sample)
+{
+    if (m_loopMode == CONTROL_OFF)
+        return;
+    // 压力模式只看气压样本，流量模式只看流量样本
+    TELEMETRY_CHANNEL channel = m_loopMode == CONTROL_FLOW ? TELEMETRY_FLOW : TELEMETRY_PRESSURE;
+    if (sample.channel != channel || sample.timestamp_us < m_loopStart_us)
+        return;
+
+    double measure = sample.value;
+    double error = (double) m_loopTarget - measure;
+    bool first = (m_loopLast_us == 0);
+    double dt = first ? 0.0 : (sample.timestamp_us - m_loopLast_us) / 1e6;
+    m_loopLast_us = sample.timestamp_us;
+
+    // 微分项作用在测量值上，避免修改目标时输出跳变
+    double derivative = (first || dt <= 0) ? 0.0 : -(measure - m_loopLastMeasure) / dt;
+    m_loopLastMeasure = measure;
+
+    double unclamped = m_pid.kff * m_loopTarget + m_pid.kp * error
+                       + m_pid.ki * (m_loopIntegral + error * dt) + m_pid.kd * derivative;
+    double output = qBound((double) m_pid.out_min, unclamped, (double) m_pid.out_max);
+    // 抗积分饱和：输出饱和且误差继续推向饱和方向时不再累积
+    if (output == unclamped || (unclamped > output) != (error > 0))
+        m_loopIntegral += error * dt;
+
+    int out = qRound(output);
+    if (out != m_loopLastOutput && pPort->isOpen()) {
+        // 控制输出与采样同频率，不经过指令队列；SetPressure的三次重发也不需要。
+        // 输出紧跟在查询回复之后，常需等间隔闸门，等待期间的新输出覆盖旧输出
+        uint8_t code = m_loopMode == CONTROL_FLOW ? 0x20 : 0x31;
+        WriteGated(GenCMD(code, PUMP_CODE, out >> 8, out & 0xff), true);
+        m_loopLastOutput = out;
+    }
+
+    // 稳定判定与统计
+    m_loopStats.samples++;
+    if (qAbs(error) <= m_pid.settle_band) {
+        if (m_loopInBand++ == 0)
+            m_loopBandEnter_us = sample.timestamp_us;
+    } else {
+        m_loopInBand = 0;
+    }
+    if (!m_loopStats.settled && m_loopInBand >= m_pid.settle_samples) {
+        m_loopStats.settled = true;
+        m_loopStats.settling_ms = (m_loopBandEnter_us - m_loopStart_us) / 1000;
+    }
+    if (m_loopStats.settled) {
+        m_loopErrorSum += error;
+        m_loopAbsErrorSum += qAbs(error);
+        m_loopErrorCount++;
+        m_loopStats.steady_bias = m_loopErrorSum / m_loopErrorCount;
+        m_loopStats.steady_error = m_loopAbsErrorSum / m_loopErrorCount;
+        if (m_loopErrorCount == m_pid.settle_samples) {
+            emit SendMessage(QString("Closed loop settled in %1 ms, steady-state error %2")
+                                 .arg(m_loopStats.settling_ms)
+                                 .arg(m_loopStats.steady_error, 0, 'f', 1));
+            emit ClosedLoopSettled(m_loopStats.settling_ms, m_loopStats.steady_error);
+        }
+    }
+}
+
 void ULab::StartPump(uint16_t speed)
 {
     wrtCmdList.append(GenCMD(0x31, PUMP_CODE, speed >> 8, speed & 0xff));
@@ -243,7 +423,38 @@ void ULab::SetSolenoidValve(uint8_t valves)
 void ULab::RefreshPort()
 {
     if (!wrtCmdList.isEmpty()) {
-        pPort->write(wrtCmdList.takeFirst());
+        WriteGated(wrtCmdList.takeFirst(), false);
+    }
+}
+
+// coalesce为true时，若同一指令码和设备的帧还在等间隔，用新帧替换它(查询和闭环输出只需最新一帧)；
+// 队列中的指令不合并，SetPressure等的重发保持原样
+void ULab::WriteGated(const QByteArray &frame, bool coalesce)
+{
+    if (coalesce) {
+        for (QByteArray &pending : m_gatedFrames) {
+            if (pending.at(1) == frame.at(1) && pending.at(2) == frame.at(2)) {
+                pending = frame;
+                return;
+            }
+        }
+    }
+    m_gatedFrames.append(frame);
+    FlushGated();
+}
+
+void ULab::FlushGated()
+{
+    while (!m_gatedFrames.isEmpty() && pPort->isOpen()) {
+        qint64 now_us = m_telemetryClock.nsecsElapsed() / 1000;
+        qint64 wait_us = m_lastWrite_us < 0 ? 0 : m_lastWrite_us + WRITE_GAP_MS * 1000 - now_us;
+        if (wait_us > 0) {
+            if (!pGateTimer->isActive())
+                pGateTimer->start((wait_us + 999) / 1000);
+            return;
+        }
+        pPort->write(m_gatedFrames.takeFirst());
+        m_lastWrite_us = now_us;
     }
 }
 
@@ -274,10 +485,12 @@ void ULab::ParsePort()
             case PUMP_CODE: //气泵回复指令
             {
                 if (cmd.at(1) == 0x24) {
-                    uint pressure = ((uint) (uint8_t) cmd.at(3) << 8) + cmd.at(4);
+                    uint pressure = ((uint) (uint8_t) cmd.at(3) << 8) + (uint8_t) cmd.at(4);
+                    RecordTelemetry(TELEMETRY_PRESSURE, pressure);
                     emit UpdatePressure(pressure);
                 } else if (cmd.at(1) == 0x23) {
-                    uint flow = ((uint) (uint8_t) cmd.at(3) << 8) + cmd.at(4);
+                    uint flow = ((uint) (uint8_t) cmd.at(3) << 8) + (uint8_t) cmd.at(4);
+                    RecordTelemetry(TELEMETRY_FLOW, flow);
                     emit UpdateFlow(flow);
                 }
                 break;
@@ -290,9 +503,21 @@ void ULab::ParsePort()
 
 void ULab::GetPresAndFlow()
 {
-    GetPressure();
-    MSleep(FLOW_INTERVAL / 2);
-    GetFlow();
+    // 每次只发一条查询，气压和流量交替进行，不再在两次查询之间阻塞等待。
+    // 查询指令不进入wrtCmdList：队列每CMD_INTERVAL才发一条，跟不上10-100Hz的采样；
+    // 但与队列指令、闭环输出共用WRITE_GAP_MS间隔闸门，不会与其他帧紧贴着写出
+    if (!pPort->isOpen())
+        return;
+    uint8_t code = m_queryFlowNext ? TELEMETRY_FLOW : TELEMETRY_PRESSURE;
+    WriteGated(GenCMD(code, PUMP_CODE, 0x00, 0x00), true);
+    m_queryFlowNext = !m_queryFlowNext;
+}
+
+void ULab::RecordTelemetry(TELEMETRY_CHANNEL channel, uint value)
+{
+    TelemetrySample sample{m_telemetryClock.nsecsElapsed() / 1000, channel, value};
+    m_telemetry.Push(sample);
+    emit TelemetrySampled(sample);
 }
 
 QByteArray ULab::GenCMD(uint8_t code, uint8_t id, uint8_t contentH, uint8_t contentL)
@@ -1,17 +1,25 @@
 #ifndef ULAB_H
 #define ULAB_H
 
+#include <QAtomicInteger>
+#include <QElapsedTimer>
 #include <QEventLoop>
 #include <QObject>
 #include <QSerialPort>
 #include <QTime>
 #include <QTimer>
+#include <QVector>
 //#include "CRC.h"
 
 #define CMD_INTERVAL 100   //发送串口指令间隔，单位：ms
 #define PARSE_INTERVAL 30  //解析收到指令间隔，单位：ms
 #define READ_INTERVAL 1000 //发送查询指令间隔，单位：ms
 #define FLOW_INTERVAL 6000 //发送查询气压和流量指令间隔，单位：ms
+#define WRITE_GAP_MS 5      //任意两帧写串口的最小间隔，单位：ms (指令队列、遥测查询、闭环输出共用)
+
+#define TELEMETRY_MIN_RATE_HZ 10   //气压/流量采样最低频率，单位：Hz
+#define TELEMETRY_MAX_RATE_HZ 100  //气压/流量采样最高频率，单位：Hz
+#define TELEMETRY_BUFFER_SIZE 1024 //采样环形缓冲区容量，必须为2的幂
 
 enum DEVICE_CODE {
     PIPET_CODE = 0x01,
@@ -26,6 +34,106 @@ enum AXIS {
     AXIS_Z = 0x11,
 };
 
+enum TELEMETRY_CHANNEL {
+    TELEMETRY_PRESSURE = 0x24,
+    TELEMETRY_FLOW = 0x23,
+};
+
+struct TelemetrySample
+{
+    qint64 timestamp_us;       //收到回复的时刻，从串口打开开始计时 (µs)
+    TELEMETRY_CHANNEL channel; //气压或流量
+    uint value;                //原始值，与UpdatePressure/UpdateFlow一致
+};
+Q_DECLARE_METATYPE(TelemetrySample)
+
+// 单生产者环形缓冲区：ParsePort写入，闭环控制和界面读取，读写均不加锁。
+// 缓冲区满时覆盖最旧的样本，读取方通过游标判断自己是否落后太多。
+template<typename T, int N>
+class TelemetryRing
+{
+    static_assert((N & (N - 1)) == 0, "TelemetryRing size must be a power of two");
+
+public:
+    void Push(const T &sample)
+    {
+        quint32 head = m_head.loadRelaxed();
+        m_slots[head & (N - 1)] = sample;
+        m_head.storeRelease(head + 1);
+    }
+
+    // 读取游标之后的新样本，返回读到的个数，游标更新到最新位置
+    int Read(QVector<T> &out, quint32 &cursor) const
+    {
+        quint32 head = m_head.loadAcquire();
+        if (head - cursor > (quint32) N)
+            cursor = head - N; //读取方落后，丢弃已被覆盖的样本
+        int count = 0;
+        for (quint32 i = cursor; i != head; ++i) {
+            out.append(m_slots[i & (N - 1)]);
+            ++count;
+        }
+        //复制期间若生产者追上来覆盖了开头的样本，丢弃这部分
+        quint32 overrun = m_head.loadAcquire() - cursor;
+        if (overrun > (quint32) N) {
+            int stale = qMin((int) (overrun - N), count);
+            out.remove(out.size() - count, stale);
+            count -= stale;
+        }
+        cursor = head;
+        return count;
+    }
+
+    // 从最新样本往回找第一个满足条件的样本
+    template<typename Pred>
+    bool Latest(T &sample, Pred match) const
+    {
+        quint32 head = m_head.loadAcquire();
+        for (quint32 n = 0; n < (quint32) N && n < head; ++n) {
+            T candidate = m_slots[(head - 1 - n) & (N - 1)];
+            if (match(candidate)) {
+                sample = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    quint32 Head() const { return m_head.loadAcquire(); }
+
+private:
+    T m_slots[N];
+    QAtomicInteger<quint32> m_head{0};
+};
+
+enum CONTROL_MODE {
+    CONTROL_OFF = 0,
+    CONTROL_PRESSURE = 1, //以气泵转速(StartPump)闭环控制气压
+    CONTROL_FLOW = 2,     //以气压设定(SetPressure)闭环控制流量
+};
+
+// PID + 前馈参数，误差和输出都使用下位机的原始单位
+struct PidParams
+{
+    double kp;
+    double ki;             //1/s
+    double kd;             //s
+    double kff;            //前馈：输出 = kff * 目标值 + PID
+    uint16_t out_min;      //输出下限
+    uint16_t out_max;      //输出上限
+    uint settle_band;      //误差在此范围内认为已到达目标
+    int settle_samples;    //连续多少个样本在范围内判定为稳定
+};
+
+struct ClosedLoopStats
+{
+    bool settled;
+    qint64 settling_ms;    //从开始控制到稳定的时间
+    double steady_error;   //稳定后的平均绝对误差
+    double steady_bias;    //稳定后的平均误差(带符号)
+    int samples;           //控制以来处理的样本数
+};
+
 QByteArray CRCMDBS_GetValue(QByteArray msg);
 QString GetAxisName(AXIS axis);
 
@@ -58,9 +166,22 @@ public:
     void GetPos(AXIS axis, DEVICE_CODE code = LOW_STAGE_CODE);
     void SetAxisEnable(AXIS axis, bool enable = false, DEVICE_CODE code = LOW_STAGE_CODE);
     void SetFluigentEnable(bool enable = false);
+    void SetTelemetryRate(uint rate_hz); //气压/流量交替采样频率 (10-100 Hz)
     void GetPressure();
     void GetFlow();
 
+    // Closed loop control
+    static PidParams DefaultPidParams(CONTROL_MODE mode);
+    void StartClosedLoop(CONTROL_MODE mode, uint target);
+    void StartClosedLoop(CONTROL_MODE mode, uint target, const PidParams &params);
+    void SetClosedLoopTarget(uint target);
+    void StopClosedLoop();
+    ClosedLoopStats GetClosedLoopStats() const { return m_loopStats; }
+
+    // Telemetry
+    int ReadTelemetry(QVector<TelemetrySample> &out, quint32 &cursor) const;
+    bool LatestTelemetry(TELEMETRY_CHANNEL channel, TelemetrySample &sample) const;
+
     // Pump
     void StartPump(uint16_t speed);
     void StopPump();
@@ -75,6 +196,8 @@ signals:
     void UpdatePos(DEVICE_CODE id, AXIS axis, int pos); //通知主界面更新位置信息
     void UpdatePressure(uint pressure);                 //通知主界面更新气压信息
     void UpdateFlow(uint flow);                         //通知主界面更新流量信息
+    void TelemetrySampled(TelemetrySample sample);      //新的气压/流量样本已写入缓冲区
+    void ClosedLoopSettled(qint64 settling_ms, double steady_error); //闭环控制已稳定
 
 private slots:
     void RefreshPort();
@@ -86,6 +209,8 @@ private slots:
     void GetPosHighY() { GetPos(AXIS_Y, HIGH_STAGE_CODE); }
     void GetPosHighZ() { GetPos(AXIS_Z, HIGH_STAGE_CODE); }
     void GetPresAndFlow();
+    void ClosedLoopStep(TelemetrySample sample);
+    void FlushGated();
 
 private:
     QSerialPort *pPort;
@@ -98,6 +223,36 @@ private:
     QTimer *pGetFlowTimer;
     QList<QByteArray> wrtCmdList;
     QByteArray readBuffer;
+
+    // 写串口间隔闸门：所有帧经WriteGated写出，距上一帧不足WRITE_GAP_MS时暂存，由pGateTimer到时补写
+    QTimer *pGateTimer;
+    QList<QByteArray> m_gatedFrames; //等待间隔的帧，按写入顺序
+    qint64 m_lastWrite_us = -1;      //最近一次写串口的时刻 (m_telemetryClock)
+    void WriteGated(const QByteArray &frame, bool coalesce);
+
+    QElapsedTimer m_telemetryClock;                                   //样本时间戳基准
+    TelemetryRing<TelemetrySample, TELEMETRY_BUFFER_SIZE> m_telemetry; //所有气压/流量样本
+    bool m_queryFlowNext = false; //交替查询：下一次查询流量还是气压
+    bool m_fluigentEnabled = false; //是否在定时查询气压/流量
+    void RecordTelemetry(TELEMETRY_CHANNEL channel, uint value);
+
+    CONTROL_MODE m_loopMode = CONTROL_OFF;
+    PidParams m_pid{};
+    uint m_loopTarget = 0;
+    qint64 m_loopStart_us = 0;     //开始控制(或修改目标)的时刻
+    qint64 m_loopLast_us = 0;      //上一个样本的时刻
+    double m_loopIntegral = 0;
+    double m_loopLastMeasure = 0;
+    int m_loopLastOutput = -1;     //上一次写给下位机的输出，避免重复发送
+    int m_loopInBand = 0;          //连续在误差范围内的样本数
+    qint64 m_loopBandEnter_us = 0; //最近一次进入误差范围的时刻
+    double m_loopErrorSum = 0;     //稳定后误差累计
+    double m_loopAbsErrorSum = 0;
+    int m_loopErrorCount = 0;
+    ClosedLoopStats m_loopStats{};
+    int m_loopPrevInterval = 0;       //开始闭环前的采样间隔(ms)，停止后恢复
+    bool m_loopPrevFluigent = false;  //开始闭环前是否在采样
+    void ResetClosedLoop();
 };
 
 #endif // ULAB_H